@@ -8,6 +8,8 @@
 #include <pthread.h>
 #include <vector>
 #include <memory>
+#include <future>
+#include <functional>
 #include "protocol/protocol_define.h"
 #include "tcp/endpoint.h"
 #include "common/common_defines.h"
@@ -54,6 +56,12 @@ struct ChannelOptions {
      * socket pool size, set in CONNECTION_TYPE_POOLED case.
      */
     int32_t pool_size;
+    /**
+     * In CONNECTION_TYPE_POOLED case, init returns once this number of connections
+     * are ready, while the others go on connecting in background. Non-positive
+     * means waiting for all connections, which is default.
+     */
+    int32_t pool_ready_size;
     /**
      * Protocol type, only one kind of protocol can be hold by each channel
      */
@@ -62,6 +70,41 @@ struct ChannelOptions {
      * Type of connection to server. CONNECTION_TYPE_SINGLE as default connection type
      */
     EConnectionType connection_type;
+    /**
+     * Max time in microseconds that writes to socket are held and sent together,
+     * 0 means writing immediately, which is default. Batching trades latency for
+     * fewer system calls and TCP segments.
+     */
+    size_t batch_window_us;
+    /**
+     * Writes are sent at once when held data reaches this size.
+     */
+    size_t batch_max_bytes;
+    /**
+     * Max sessions waiting for response on each connection, sessions beyond it
+     * wait for others to finish until their timeout, and fail with SOCKET_BUSY
+     * then. Sessions sent in loop or timer threads, such as inline callbacks,
+     * never wait and fail at once.
+     */
+    size_t max_parallel_sessions;
+    /**
+     * Tune limit of sessions on each connection below max_parallel_sessions by
+     * observed latency, so that requests queue in client instead of server when
+     * server is saturated. Default is false.
+     */
+    bool adaptive_parallel_sessions;
+    /**
+     * Executor running callbacks of async sessions, including deserializing
+     * response. If not set, default executor made by globalInit is used.
+     */
+    std::shared_ptr<CallbackExecutor> callback_executor;
+    /**
+     * Run callbacks of async sessions in loop or timer thread which receives
+     * response or finds timeout, saving a thread switch. Default is false.
+     * Callbacks must be short and never block, as they stall all connections
+     * handled by the same loop thread.
+     */
+    bool inline_callback;
 };
 
 class Socket;
@@ -92,7 +135,8 @@ public:
     bool init(const EndPoint& address, const ChannelOptions* options);
     /**
      *
-     * @param address: endpoint's address.
+     * @param address: endpoint's address, "ip:port", "host:port" or
+     * "unix:/path" of unix domain socket.
      * @param options: channel options.
      * @return
      */
@@ -119,6 +163,11 @@ private:
     bool getSocketInternal(std::shared_ptr<Socket>& socket);
     bool getSubSocketInternal(std::shared_ptr<Socket>& socket);
     bool tryConnect(std::shared_ptr<Socket>& socket);
+    //@on_done is called with the socket created here and the result
+    std::shared_future<bool> tryConnectAsync(
+            std::shared_ptr<Socket>& socket,
+            std::function<void(const Socket*, bool)> on_done =
+                std::function<void(const Socket*, bool)>());
 
     static void deleteThreadLocalSubChannel(void* arg);
 
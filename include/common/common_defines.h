@@ -6,6 +6,8 @@
 #define RPC_INCLUDE_COMMON_DEFINES_H
 
 #include <string>
+#include <vector>
+#include <functional>
 
 namespace antflash {
 
@@ -33,15 +35,192 @@ static constexpr auto CACHELINE_SIZE = 64;
 static constexpr size_t BUFFER_DEFAULT_SLICE_SIZE = 8192;
 static constexpr size_t BUFFER_DEFAULT_BLOCK_SIZE = 8192;
 static constexpr size_t BUFFER_MAX_SLICE_SIZE = 65536;
+//Events handled in one poll at first, which doubles whenever a poll comes
+//back full, up to max_poll_events of loop options
 static constexpr size_t MAX_POLL_EVENT = 32;
+static constexpr size_t LOOP_MAX_POLL_EVENTS = 1024;
+//Buckets of log2 histograms of loop threads
+static constexpr size_t LOOP_HISTOGRAM_BUCKETS = 24;
+//Tasks pending in each loop thread, must be power of 2
+static constexpr size_t LOOP_TASK_QUEUE_SIZE = 4096;
+//Callbacks pending in each thread of default callback executor, must be
+//power of 2, callbacks run in place when it is full
+static constexpr size_t CALLBACK_QUEUE_SIZE = 4096;
 static constexpr int32_t SOCKET_CONNECT_TIMEOUT_MS = 200;
 static constexpr int32_t SOCKET_TIMEOUT_MS = 500;
 static constexpr int32_t SOCKET_MAX_RETRY = 3;
 static constexpr size_t SOCKET_MAX_IDLE_US = 15 * 1000 * 1000;
+static constexpr size_t SOCKET_MIN_ONCE_READ = 4096;
+static constexpr size_t SOCKET_MAX_ONCE_READ = 1024 * 1024;
+//Writes no smaller than this are sent by MSG_ZEROCOPY, 0 means disabled
+static constexpr size_t SOCKET_ZERO_COPY_THRESHOLD = 0;
+//Max bytes queued when socket is not writable, writes over it fail
+static constexpr size_t SOCKET_MAX_PENDING_WRITE_BYTES = 64 * 1024 * 1024;
 
 static constexpr size_t MAX_PARALLEL_SESSION_SIZE_ON_SOCKET = 1024;
+//Upper bound of sessions waiting on one socket, which leaves request id
+//room for generation of session slot
+static constexpr size_t MAX_SESSION_SLOTS_ON_SOCKET = 1 << 20;
+//Adaptive in flight window of socket shrinks when latency goes beyond this
+//times of the lowest latency, and never goes below the min window. The lowest
+//latency is measured again every some periods to follow changes of server.
+static constexpr double SOCKET_WINDOW_LATENCY_TOLERANCE = 2.0;
+static constexpr size_t SOCKET_MIN_INFLIGHT_WINDOW = 4;
+static constexpr size_t SOCKET_WINDOW_MIN_LATENCY_PERIODS = 64;
 
 static constexpr size_t CONNECTION_POOL_MAX_SOCKET_SIZE = 32;
+static constexpr size_t CHANNEL_BATCH_MAX_BYTES = 64 * 1024;
+
+/*IO Buffer Related*/
+static constexpr size_t BLOCK_POOL_MAX_RETAINED_BYTES = 4 * 1024 * 1024;
+static constexpr size_t IO_BUFFER_MAX_CHAINED_BLOCKS = 8;
+//Threads which allocate no io buffer block in this period are asked to
+//return blocks cached by them
+static constexpr size_t IO_BUFFER_IDLE_TRIM_US = 30 * 1000 * 1000;
+
+/**
+ * Statistics of io buffer block pool
+ */
+struct IOBufferPoolStats {
+    //Blocks allocated from system
+    size_t allocated_blocks;
+    //Blocks reused from thread caches
+    size_t reused_blocks;
+    //Blocks released by threads which are not their owner
+    size_t remote_freed_blocks;
+    //Bytes of free blocks retained by all thread caches
+    size_t retained_bytes;
+    //Number of thread caches, including caches of exited threads
+    size_t thread_caches;
+    //Blocks in use, including blocks larger than max size class
+    size_t live_blocks;
+    //Bytes of blocks in use
+    size_t live_bytes;
+    //Partially filled blocks cached by thread-local chains of io buffer
+    size_t chained_blocks;
+    //Bytes of blocks cached by thread-local chains of io buffer
+    size_t chained_bytes;
+    //Bytes of blocks in use but not cached by any chain, which are held by
+    //io buffer slices. A whole block is pinned however small the slice is.
+    size_t pinned_bytes;
+};
+
+//Load of loop thread is measured by events handled and bytes read per
+//second, reading this many bytes is taken as costly as handling one event.
+//Rates are sampled at most once per sampling period.
+static constexpr size_t LOOP_LOAD_BYTES_PER_EVENT = 16384;
+static constexpr size_t LOOP_LOAD_SAMPLE_US = 100000;
+//Sockets are moved only if busiest loop thread is this times busier than
+//idlest one, and busier by at least this rate
+static constexpr double LOOP_REBALANCE_RATIO = 2.0;
+static constexpr size_t LOOP_REBALANCE_MIN_RATE = 1000;
+
+/**
+ * How sockets are assigned to schedule loop threads
+ */
+enum class ELoopAssign {
+    //By socket fd, default
+    FD,
+    //Loop threads on numa node of the thread connecting socket, falls back
+    //to FD if no loop thread is pinned on that node
+    CALLER_NUMA,
+    //Loop thread on cpu where kernel handles packets of socket, or on numa
+    //node of that cpu, by SO_INCOMING_CPU after connected, linux only
+    INCOMING_CPU,
+    //Least loaded loop thread, by sockets it reads and its recent rate of
+    //events and bytes read
+    LEAST_LOADED,
+};
+
+/**
+ * Executor which runs tasks of async sessions, deserializing response and
+ * calling callback, out of loop and timer threads.
+ */
+using CallbackExecutor = std::function<void(std::function<void()>)>;
+
+/**
+ * Options of schedule loop threads
+ */
+struct LoopOptions {
+    //Number of loop threads, hardware concurrency if not positive
+    int32_t threads = -1;
+    //Idle window of busy poll mode, in which loop thread keeps polling with
+    //zero timeout instead of sleeping after last event. 0 means disabled,
+    //which is default, as loop thread burns a cpu while spinning.
+    uint32_t busy_poll_us = 0;
+    //Number of loop threads in busy poll mode, all if not positive
+    int32_t busy_poll_threads = -1;
+    //Set SO_BUSY_POLL of sockets read by busy poll loop threads, so that
+    //kernel polls device queue too, 0 means not set
+    uint32_t socket_busy_poll_us = 0;
+    //Cpus to pin loop threads on, loop thread i is pinned to cpu
+    //loop_cpus[i % size]. Empty means not pinned, which is default.
+    std::vector<int> loop_cpus;
+    //Cpus to pin timer thread on, empty means not pinned
+    std::vector<int> timer_cpus;
+    ELoopAssign loop_assign = ELoopAssign::FD;
+    //Move busy sockets from busiest loop thread to idlest one periodically,
+    //one socket at a time, no matter which loop they are assigned to
+    bool loop_rebalance = false;
+    //Threads of default executor of async session callbacks, number of loop
+    //threads plus timer thread if negative. 0 means no default executor, and
+    //callbacks run in loop or timer thread as before.
+    int32_t callback_threads = -1;
+    //Max events handled in one poll, poll batch starts from MAX_POLL_EVENT
+    //and grows up to this while polls come back full
+    uint32_t max_poll_events = LOOP_MAX_POLL_EVENTS;
+};
+
+/**
+ * Statistics of loop threads in busy poll mode, and of callbacks which loop
+ * and timer threads hand to executors
+ */
+struct LoopStats {
+    //Loop threads in busy poll mode
+    size_t busy_poll_threads;
+    //Time spent by polls which found no event, cpu is burnt while spinning
+    size_t spin_us;
+    //Cpu time spent by polls which found events, including handling them
+    size_t handle_us;
+    //Events handled by loop threads
+    size_t events;
+    //Events found while spinning, whose wakeup latency is saved
+    size_t spin_hits;
+    //Times loop threads went to sleep after idle window
+    size_t sleeps;
+    //Callbacks run by executors, and their time queued from being handed
+    //over until starting to run
+    size_t callbacks;
+    size_t callback_delay_us;
+    size_t callback_max_delay_us;
+};
+
+/**
+ * Load of one schedule loop thread
+ */
+struct LoopLoad {
+    //Sockets read by loop thread
+    size_t sockets;
+    //Events handled per second in last sampling period
+    size_t events_per_sec;
+    //Bytes read per second in last sampling period
+    size_t bytes_per_sec;
+    //Sockets moved into and out of loop thread by rebalancing
+    size_t migrated_in;
+    size_t migrated_out;
+    //Max events handled in one poll now
+    size_t poll_batch;
+    //Log2 histograms of iterations which handled events since loop thread
+    //started, bucket 0 counts value 0, bucket i counts values in
+    //[2^(i-1), 2^i), and the last bucket counts larger values too.
+    //Events handled per wakeup
+    size_t wakeup_events[LOOP_HISTOGRAM_BUCKETS];
+    //Microseconds handling events and tasks after wakeup
+    size_t handle_us[LOOP_HISTOGRAM_BUCKETS];
+    //Microseconds since previous iteration which handled events, either
+    //spinning or asleep
+    size_t idle_us[LOOP_HISTOGRAM_BUCKETS];
+};
 
 /*Bolt Protocol Related*/
 static constexpr uint8_t BOLT_PROTOCOL_TYPE = 1;
@@ -52,12 +52,14 @@ public:
 
         _buffer[write & _mask] = val;
 
-        //this will block write thread for a while waiting for index going forward
+        //this will block write thread for a while waiting for index going forward,
+        //slots are committed in order, so wait until earlier producers commit
         auto write_commit = write;
         size_t count = 0;
         while(!_write_idx.compare_exchange_strong(
-                write_commit, write_commit + 1, 
+                write_commit, write + 1,
                 std::memory_order_acq_rel, std::memory_order_relaxed)) {
+            write_commit = write;
             if (++count > 100) {
                 count = 0;
                 std::this_thread::yield();
@@ -54,9 +54,15 @@ public:
         _td_capacity(capacity), 
         _queue_size(queue_size),
         _exit(false),
-        _need_wakeup(0) {}
+        _need_wakeup(0),
+        _key_created(false) {}
 
     ~ThreadPool() {
+        //Threads still paired never touch their pool threads after key is
+        //deleted, so all pool threads can be freed below
+        if (_key_created) {
+            pthread_key_delete(_paired_thread);
+        }
         _exit = true;
         {
             std::lock_guard<std::mutex> guard(_td_wakeup_mtx);
@@ -65,20 +71,25 @@ public:
         for (auto& td : _tds) {
             if (td->td->joinable()) {
                 td->td->join();
-            }   
-
-            auto status = td->status.load(std::memory_order_acquire);
-            if (status == EThreadStatus::STANDBY) {
-                delete td;
-            } 
-            //FIXME other status       
+            }
         }
+        for (auto& td : _tds) {
+            PackagedTask task = nullptr;
+            while (td->tasks && td->tasks->pop(task)) {
+                delete task;
+            }
+            delete td;
+        }
+        _tds.clear();
     }
 
     bool init() {
         _tds.clear();
         _tds.reserve(_td_capacity);
-        pthread_key_create(&_paired_thread, deleteThreadLocalPairThread);
+        if (!_key_created) {
+            pthread_key_create(&_paired_thread, deleteThreadLocalPairThread);
+            _key_created = true;
+        }
 
         for (size_t i = 0; i < _td_capacity; ++i) {
             auto td = new SingleThread;
@@ -97,7 +108,7 @@ public:
                         PackagedTask task = nullptr;
                         {
                             std::unique_lock<std::mutex> guard(_td_wakeup_mtx);
-                            _need_wakeup.fetch_add(1, std::memory_order_relaxed);
+                            _need_wakeup.fetch_add(1, std::memory_order_seq_cst);
                             _td_wakeup.wait(guard, [this, status, td, &task](){
                                 if (!_exit) {
                                     return status == EThreadStatus::STANDBY ?
@@ -113,7 +124,13 @@ public:
                         }
                     }
                 }
-                tryConsume(*td);
+                //Run tasks left in queue, so that none is lost when pool
+                //is destroyed
+                PackagedTask task = nullptr;
+                while (td->tasks && td->tasks->pop(task)) {
+                    (*task)();
+                    delete task;
+                }
             }));
             _tds.emplace_back(td);
         }
@@ -129,6 +146,9 @@ public:
             delete task_package;
         }
 
+        //Pair with increasing _need_wakeup before checking queues, so that
+        //either waiting thread sees the task or it is seen waiting here
+        std::atomic_thread_fence(std::memory_order_seq_cst);
         if (_need_wakeup.load(std::memory_order_relaxed) > 0) {
             std::unique_lock<std::mutex> guard(_td_wakeup_mtx);
             _td_wakeup.notify_all();
@@ -162,7 +182,7 @@ private:
                 delete p_task;
                 return;
             }
-        } while (p_task->status.compare_exchange_strong(
+        } while (!p_task->status.compare_exchange_strong(
                     status,
                     EThreadStatus::INACTIVE, 
                     std::memory_order_acq_rel, 
@@ -269,6 +289,7 @@ private:
     std::condition_variable _td_wakeup;
     bool _exit;
     std::atomic<size_t> _need_wakeup;
+    bool _key_created;
 };
 
 }
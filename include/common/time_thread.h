@@ -27,16 +27,20 @@ class TimeThread {
 public:
     TimeThread();
     ~TimeThread();
-    bool init();
+    //Pin timer thread to cpus if not empty
+    bool init(const std::vector<int>& cpus = std::vector<int>());
     void destroy();
     size_t schedule(size_t timeout, TimerTaskFn fn);
     size_t scheduleAbs(size_t abs_time, TimerTaskFn&& fn);
     bool unschedule(size_t task_id);
+    //Whether current thread is timer thread, in which tasks run
+    bool inTimeThread() const;
 private:
     void loopOnce();
     TaskContainer* getLocalTaskContainer();
     void collectUnschedule(TaskContainer*);
     void collectUnschedule();
+    void wakeToCollect();
 
     std::unique_ptr<std::thread> _td;
     std::atomic<bool> _exit;
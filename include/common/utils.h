@@ -6,11 +6,18 @@
 #define RPC_COMMON_UTILS_H
 
 #include <cctype>
+#include <cstdlib>
 #include <cstring>
 #include <chrono>
+#include <time.h>
 #include <string>
 #include <vector>
 #include <experimental/string_view>
+#if defined(OS_LINUX)
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#endif
 
 namespace antflash {
 
@@ -58,6 +65,78 @@ public:
                 system_clock::now().time_since_epoch()).count();
     }
 
+    static size_t getSteadyTimeStampMicro() {
+        using namespace std::chrono;
+        return duration_cast<microseconds>(
+                steady_clock::now().time_since_epoch()).count();
+    }
+
+    //Cpu time consumed by calling thread
+    static size_t getThreadCpuTimeMicro() {
+        struct timespec ts;
+        if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+            return 0;
+        }
+        return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+    }
+
+    //Pin calling thread to cpus, linux only
+    static bool setThreadAffinity(const std::vector<int>& cpus) {
+#if defined(OS_LINUX)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (auto cpu : cpus) {
+            if (cpu >= 0 && cpu < CPU_SETSIZE) {
+                CPU_SET(cpu, &set);
+            }
+        }
+        if (CPU_COUNT(&set) == 0) {
+            return false;
+        }
+        return 0 == pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+        return false;
+#endif
+    }
+
+    //Cpu which calling thread is running on, -1 if unknown
+    static int getCurrentCpu() {
+#if defined(OS_LINUX)
+        return sched_getcpu();
+#else
+        return -1;
+#endif
+    }
+
+    //Numa node of cpu, -1 if unknown
+    static int getCpuNumaNode(int cpu) {
+#if defined(OS_LINUX)
+        if (cpu < 0) {
+            return -1;
+        }
+        //Cpu directory of sysfs holds a link named by its node
+        auto path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+        DIR* dir = opendir(path.c_str());
+        if (nullptr == dir) {
+            return -1;
+        }
+        int node = -1;
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != nullptr) {
+            if (strncmp(entry->d_name, "node", 4) == 0
+                && std::isdigit(entry->d_name[4])) {
+                node = atoi(entry->d_name + 4);
+                break;
+            }
+        }
+        closedir(dir);
+        //Machines without numa have no link, all cpus are on node 0
+        return node < 0 ? 0 : node;
+#else
+        return -1;
+#endif
+    }
+
     static void leftTrim(char *str) {
         char* p = str;
         if (nullptr != p) {
@@ -6,12 +6,15 @@
 #define RPC_INCLUDE_BOLT_REQUEST_H
 
 #include <string>
+#include <memory>
+#include <functional>
 #include <google/protobuf/message.h>
 #include "protocol/request_base.h"
 #include "common/common_defines.h"
 
 namespace antflash {
 
+class IOBuffer;
 namespace bolt {
 class BoltInternalRequest;
 }
@@ -52,12 +55,23 @@ public:
         _data_type = EDataType::PROTOBUF;
         return *this;
     }
+    /**
+     * Send data owned by user without copying, data should not be modified
+     * until deleter is called, which may be called in rpc internal thread.
+     * @param data
+     * @param size
+     * @param deleter called with data when rpc does not refer to it any more
+     * @return
+     */
+    BoltRequest& data(void* data, size_t size,
+                      std::function<void(void*)> deleter);
 
 private:
     enum class EDataType {
         CSTRING,
         STRING,
         PROTOBUF,
+        USER_DATA,
         NONE
     };
 
@@ -72,6 +86,7 @@ private:
     } _data;
 
     EDataType _data_type;
+    std::shared_ptr<IOBuffer> _user_data;
 };
 
 }
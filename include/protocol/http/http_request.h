@@ -6,6 +6,7 @@
 #define RPC_INCLUDE_HTTP_REQUEST_H
 
 #include <memory>
+#include <functional>
 #include <string>
 #include "protocol/request_base.h"
 #include "common/uri.h"
@@ -38,6 +39,16 @@ public:
     }
     HttpRequest& attach(const std::string& data);
     HttpRequest& attach(const char* data);
+    /**
+     * Attach data owned by user without copying, data should not be modified
+     * until deleter is called, which may be called in rpc internal thread.
+     * @param data
+     * @param size
+     * @param deleter called with data when rpc does not refer to it any more
+     * @return
+     */
+    HttpRequest& attach(void* data, size_t size,
+                        std::function<void(void*)> deleter);
     std::shared_ptr<IOBuffer> attach() const;
     size_t attach_size() const;
 
@@ -23,6 +23,28 @@ namespace antflash {
  */
 bool globalInit();
 
+/**
+ * Global init with specific loop options, such as number of scheduler
+ * threads and cpus which threads are pinned on.
+ * @param options
+ * @return true if init success, else false
+ */
+bool globalInit(const LoopOptions& options);
+
+/**
+ * Get statistics of loop threads in busy poll mode aggregated over threads,
+ * and of async callbacks run by executors.
+ * @return
+ */
+LoopStats getLoopStats();
+
+/**
+ * Get load of each loop thread, such as sockets it reads, rate of events it
+ * handles, and histograms telling whether it is saturated.
+ * @return
+ */
+std::vector<LoopLoad> getLoopLoads();
+
 /**
  * Global destroy for ant feature rpc client, not thread compatible,
  * you should call this method before process end, or some exception may
@@ -44,6 +66,49 @@ LogHandler* setLogHandler(LogHandler* handler);
  */
 void setLogLevel(LogLevel level);
 
+/**
+ * Set max bytes of free io buffer blocks retained by each thread,
+ * free blocks over this limit will be returned to system.
+ * @param bytes
+ */
+void setIOBufferPoolMaxRetainedBytes(size_t bytes);
+
+/**
+ * Get statistics of io buffer block pool.
+ * @return
+ */
+IOBufferPoolStats getIOBufferPoolStats();
+
+/**
+ * Set max number of partially filled blocks cached by thread-local chain of
+ * io buffer in each thread, blocks over this limit are not cached.
+ * @param num
+ */
+void setIOBufferMaxChainedBlocks(size_t num);
+
+/**
+ * Release blocks cached by calling thread, including blocks in its io buffer
+ * chain and free blocks retained by its block pool cache. Threads which
+ * become idle after bursty traffic could call this to give memory back.
+ */
+void trimIOBufferThreadCache();
+
+/**
+ * Ask all threads to release blocks cached by them as trimIOBufferThreadCache
+ * does. Loop threads release them at once, and other threads on their next
+ * io buffer allocation. Socket manager asks idle threads periodically.
+ * @param idle_only: only ask threads which allocated no block since last call
+ */
+void trimIOBufferThreadCaches(bool idle_only = false);
+
+/**
+ * Set min size of data which is sent by MSG_ZEROCOPY on linux, smaller
+ * data is still copied into kernel. 0 means disabled, which is default.
+ * Only sockets connected after setting are affected.
+ * @param bytes
+ */
+void setSocketZeroCopyThreshold(size_t bytes);
+
 }
 
 #endif //RPC_INCLUDE_RPC_H
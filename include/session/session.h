@@ -25,7 +25,8 @@ public:
                 _request(nullptr),
                 _response(nullptr),
                 _error_code(ESessionError::SESSION_OK),
-                _channel(nullptr) {}
+                _channel(nullptr),
+                _inline_callback(-1) {}
     ~Session();
 
     //Set request data to be sent. Before session sync/async function returns,
@@ -62,6 +63,20 @@ public:
         return *this;
     }
 
+    //Set executor running callback of async session, and this executor is higher
+    //priority than channel's one, if not set, use channel's executor or default one.
+    inline Session& executor(std::shared_ptr<CallbackExecutor> executor) {
+        _executor = std::move(executor);
+        return *this;
+    }
+
+    //Run callback of async session in loop or timer thread instead of executor,
+    //if not set, use channel's inline_callback by default.
+    inline Session& inlineCallback(bool enable) {
+        _inline_callback = enable ? 1 : 0;
+        return *this;
+    }
+
     //Send data to server synchronized, block the thread calling this sync function.
     Session& sync();
 
@@ -101,6 +116,9 @@ private:
 
     Channel* _channel;
     std::shared_ptr<Socket> _socket;
+
+    std::shared_ptr<CallbackExecutor> _executor;
+    int32_t _inline_callback;
 };
 
 class PipelineSession {
@@ -17,13 +17,22 @@ struct EndPoint {
     EndPoint() : ip(IP_ANY), port(0) {}
     EndPoint(const in_addr &i, int p) : ip(i), port(p) {}
     EndPoint(const sockaddr_in& in) : ip(in.sin_addr), port(in.sin_port) {}
-    EndPoint(const EndPoint& right) : ip(right.ip), port(right.port) {}
+    EndPoint(const EndPoint& right) : ip(right.ip), port(right.port),
+                                      unix_path(right.unix_path) {}
+    EndPoint& operator=(const EndPoint& right) = default;
 
+    //Parse "ip:port", "host:port" or "unix:/path" of unix domain socket
     bool parseFromString(const char *str);
     std::string ipToStr() const;
 
+    bool isUnix() const {
+        return !unix_path.empty();
+    }
+
     in_addr ip;
     int port;
+    //Path of unix domain socket, empty if endpoint is tcp
+    std::string unix_path;
 };
 
 
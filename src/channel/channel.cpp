@@ -5,6 +5,8 @@
 #include "channel/channel.h"
 #include <limits>
 #include <random>
+#include <mutex>
+#include <condition_variable>
 #include "common/common_defines.h"
 #include "common/life_cycle_lock.h"
 #include "common/log.h"
@@ -16,6 +18,15 @@ struct SubChannel {
     Channel channel;
     std::atomic<size_t> shared_num;
     std::atomic<size_t> is_active;
+    //Connecting in background since init, never picked until done
+    std::atomic<bool> connecting;
+};
+
+struct PoolConnectState {
+    std::mutex mtx;
+    std::condition_variable cond;
+    size_t connected = 0;
+    size_t finished = 0;
 };
 
 struct ThreadLocalSubChannel {
@@ -38,8 +49,14 @@ ChannelOptions::ChannelOptions() :
         timeout_ms(SOCKET_TIMEOUT_MS),
         max_retry(SOCKET_MAX_RETRY),
         pool_size(std::thread::hardware_concurrency()),
+        pool_ready_size(0),
         protocol(EProtocolType::PROTOCOL_BOLT),
-        connection_type(EConnectionType::CONNECTION_TYPE_SINGLE) {
+        connection_type(EConnectionType::CONNECTION_TYPE_SINGLE),
+        batch_window_us(0),
+        batch_max_bytes(CHANNEL_BATCH_MAX_BYTES),
+        max_parallel_sessions(MAX_PARALLEL_SESSION_SIZE_ON_SOCKET),
+        adaptive_parallel_sessions(false),
+        inline_callback(false) {
 }
 
 ChannelOptions::ChannelOptions(const ChannelOptions& right) :
@@ -47,8 +64,15 @@ ChannelOptions::ChannelOptions(const ChannelOptions& right) :
         timeout_ms(right.timeout_ms),
         max_retry(right.max_retry),
         pool_size(right.pool_size),
+        pool_ready_size(right.pool_ready_size),
         protocol(right.protocol),
-        connection_type(right.connection_type) {
+        connection_type(right.connection_type),
+        batch_window_us(right.batch_window_us),
+        batch_max_bytes(right.batch_max_bytes),
+        max_parallel_sessions(right.max_parallel_sessions),
+        adaptive_parallel_sessions(right.adaptive_parallel_sessions),
+        callback_executor(right.callback_executor),
+        inline_callback(right.inline_callback) {
 }
 
 ChannelOptions& ChannelOptions::operator=(const ChannelOptions& right) {
@@ -57,8 +81,15 @@ ChannelOptions& ChannelOptions::operator=(const ChannelOptions& right) {
         timeout_ms = right.timeout_ms;
         max_retry = right.max_retry;
         pool_size = right.pool_size;
+        pool_ready_size = right.pool_ready_size;
         protocol = right.protocol;
         connection_type = right.connection_type;
+        batch_window_us = right.batch_window_us;
+        batch_max_bytes = right.batch_max_bytes;
+        max_parallel_sessions = right.max_parallel_sessions;
+        adaptive_parallel_sessions = right.adaptive_parallel_sessions;
+        callback_executor = right.callback_executor;
+        inline_callback = right.inline_callback;
     }
 
     return *this;
@@ -94,19 +125,61 @@ bool Channel::init(const EndPoint& address,
             return false;
         }
 
+        //Connect all sub channels in parallel, and wait until enough of
+        //them are ready, the others go on connecting in background
+        size_t total = _options.pool_size;
+        size_t need = total;
+        if (_options.pool_ready_size > 0
+            && (size_t)_options.pool_ready_size < total) {
+            need = _options.pool_ready_size;
+        }
+        std::shared_ptr<PoolConnectState> state(new PoolConnectState);
         _sub_channels.resize(_options.pool_size);
         for (auto& sub_channel : _sub_channels) {
             sub_channel.reset(new SubChannel);
             sub_channel->shared_num.store(0, std::memory_order_relaxed);
-            sub_channel->is_active.store(true, std::memory_order_relaxed);
+            //Inactive until connected, so that it is not picked before
+            sub_channel->is_active.store(false, std::memory_order_relaxed);
+            sub_channel->connecting.store(true, std::memory_order_relaxed);
             sub_channel->channel._address = _address;
             sub_channel->channel._protocol = _protocol;
             sub_channel->channel._lock.reset(new LifeCycleLock);
-            ret = sub_channel->channel.tryConnect(
-                    sub_channel->channel._socket);
-            if (!ret) {
-                break;
-            }
+            sub_channel->channel._options.connect_timeout_ms = _options.connect_timeout_ms;
+            sub_channel->channel._options.batch_window_us = _options.batch_window_us;
+            sub_channel->channel._options.batch_max_bytes = _options.batch_max_bytes;
+            sub_channel->channel._options.max_parallel_sessions = _options.max_parallel_sessions;
+            sub_channel->channel._options.adaptive_parallel_sessions =
+                    _options.adaptive_parallel_sessions;
+            auto sub = sub_channel;
+            sub_channel->channel.tryConnectAsync(
+                    sub_channel->channel._socket,
+                    [sub, state](const Socket* target, bool connected) {
+                        //Socket is not replaced while connecting, ignore
+                        //result anyway if it is not the one in sub channel
+                        if (sub->channel._socket.get() == target) {
+                            if (!connected) {
+                                //Surrender the ownership so that socket
+                                //manager can reclaim this socket.
+                                sub->channel._socket->releaseExclusive();
+                            }
+                            sub->is_active.store(connected, std::memory_order_release);
+                        }
+                        sub->connecting.store(false, std::memory_order_release);
+                        std::lock_guard<std::mutex> guard(state->mtx);
+                        ++state->finished;
+                        if (connected) {
+                            ++state->connected;
+                        }
+                        state->cond.notify_all();
+                    });
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(state->mtx);
+            state->cond.wait(lock, [state, need, total]() {
+                return state->connected >= need || state->finished == total;
+            });
+            ret = state->connected >= need;
         }
         if (!ret) {
             _sub_channels.clear();
@@ -204,14 +277,29 @@ bool Channel::getSocketInternal(std::shared_ptr<Socket>& socket) {
     return ret;
 }
 
-bool Channel::tryConnect(std::shared_ptr<Socket>& socket) {
+std::shared_future<bool> Channel::tryConnectAsync(
+        std::shared_ptr<Socket>& socket,
+        std::function<void(const Socket*, bool)> on_done) {
     LOG_INFO("try connect to remote:{}", _address.ipToStr());
-    socket.reset(new Socket(_address));
+    socket.reset(new Socket(_address, _options.max_parallel_sessions));
     //Hold the ownership of this socket to make sure not be reclaimed by socket manager
     //Always success here.
     socket->tryExclusive();
     socket->setBindProtocol(_protocol);
-    bool ret = socket->connect(_options.connect_timeout_ms);
+    socket->setWriteBatch(_options.batch_window_us, _options.batch_max_bytes);
+    socket->setAdaptiveWindow(_options.adaptive_parallel_sessions);
+    std::function<void(bool)> done;
+    if (on_done) {
+        const Socket* target = socket.get();
+        done = [target, on_done](bool connected) {
+            on_done(target, connected);
+        };
+    }
+    return socket->connectAsync(_options.connect_timeout_ms, std::move(done));
+}
+
+bool Channel::tryConnect(std::shared_ptr<Socket>& socket) {
+    bool ret = tryConnectAsync(socket).get();
 
     if (!ret) {
         //If socket connect fail, surrender the ownership
@@ -224,6 +312,10 @@ bool Channel::tryConnect(std::shared_ptr<Socket>& socket) {
 
 bool Channel::getSubSocketInternal(std::shared_ptr<Socket> &socket) {
     LOG_DEBUG("try get sub socket");
+    //Pool is cleared if init fails
+    if (_sub_channels.empty()) {
+        return false;
+    }
     //Get thread local sub channel index
     ThreadLocalSubChannel* sub_channel =
             (ThreadLocalSubChannel*)pthread_getspecific(_local_sub_channel_idx);
@@ -271,10 +363,25 @@ bool Channel::getSubSocketInternal(std::shared_ptr<Socket> &socket) {
             }
         }
 
-        //All channel in pool is not active then random one
+        //All channel in pool is not active then random one, except those
+        //still connecting in background, which must not be reconnected
         if (minus_shared_num == std::numeric_limits<size_t>::max()) {
             std::random_device rd;
-            most_idle_sub_channel = rd() % _sub_channels.size();
+            size_t start = rd() % _sub_channels.size();
+            most_idle_sub_channel = -1;
+            for (size_t n = 0; n < _sub_channels.size(); ++n) {
+                size_t i = (start + n) % _sub_channels.size();
+                if (!_sub_channels[i]->connecting
+                        .load(std::memory_order_acquire)) {
+                    most_idle_sub_channel = (ssize_t)i;
+                    break;
+                }
+            }
+            if (most_idle_sub_channel < 0) {
+                LOG_ERROR("all channels in pool are connecting.");
+                sub_channel->idx = -1;
+                return false;
+            }
             minus_shared_num = _sub_channels[most_idle_sub_channel]->shared_num.
                     load(std::memory_order_relaxed);
         }
@@ -0,0 +1,399 @@
+// Copyright (c) 2018 Ant Financial, Inc. All Rights Reserved
+//
+
+#include "block_pool.h"
+#include <atomic>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <vector>
+#include "common/macro.h"
+#include "rpc.h"
+
+namespace antflash {
+
+constexpr uint32_t BlockPool::SIZE_CLASS_NUM;
+constexpr uint32_t BlockPool::NONE_SIZE_CLASS;
+constexpr uint32_t BlockPool::USER_SIZE_CLASS;
+
+static constexpr size_t s_size_classes[BlockPool::SIZE_CLASS_NUM] = {
+        BUFFER_DEFAULT_BLOCK_SIZE,
+        BUFFER_MAX_SLICE_SIZE
+};
+
+struct BlockThreadCache {
+    Block* free_list[BlockPool::SIZE_CLASS_NUM];
+
+    //Blocks released by other threads, collected by owner thread lazily
+    std::atomic<Block*> remote_free;
+    std::atomic<bool> abandoned;
+    //Set by any thread, and honoured by owner thread on next acquiring
+    std::atomic<bool> trim_requested;
+    //Blocks acquired when trim was requested last time, guarded by registry
+    size_t trim_mark;
+
+    //Counters below are only modified by owner thread
+    std::atomic<size_t> allocated;
+    std::atomic<size_t> reused;
+    std::atomic<size_t> acquired_bytes;
+    std::atomic<size_t> local_freed;
+    std::atomic<size_t> local_freed_bytes;
+    std::atomic<size_t> retained_bytes;
+    std::atomic<size_t> chained_blocks;
+    std::atomic<size_t> chained_bytes;
+
+    //Counters below are modified by other threads
+    std::atomic<size_t> remote_freed;
+    std::atomic<size_t> remote_freed_bytes;
+
+    BlockThreadCache() : remote_free(nullptr), abandoned(false),
+                         trim_requested(false), trim_mark(0),
+                         allocated(0), reused(0), acquired_bytes(0),
+                         local_freed(0), local_freed_bytes(0),
+                         retained_bytes(0), chained_blocks(0),
+                         chained_bytes(0), remote_freed(0),
+                         remote_freed_bytes(0) {
+        for (auto& list : free_list) {
+            list = nullptr;
+        }
+    }
+};
+
+//Thread caches are never freed, cache of exited thread is abandoned and
+//will be adopted by a new thread, as blocks released by other threads may
+//still refer to it.
+struct BlockThreadCacheRegistry {
+    std::mutex mtx;
+    std::vector<BlockThreadCache*> caches;
+    std::vector<BlockThreadCache*> abandoned;
+};
+
+static BlockThreadCacheRegistry& getRegistry() {
+    static auto registry = new BlockThreadCacheRegistry;
+    return *registry;
+}
+
+static std::atomic<size_t> s_max_retained_bytes(BLOCK_POOL_MAX_RETAINED_BYTES);
+
+//Blocks not owned by any thread cache, such as blocks larger than max size class
+static std::atomic<size_t> s_unowned_live_blocks(0);
+static std::atomic<size_t> s_unowned_live_bytes(0);
+
+static thread_local BlockThreadCache* s_local_cache = nullptr;
+static thread_local bool s_local_cache_exited = false;
+
+//Only modified by owner thread, no need to use atomic read-modify-write
+static inline void increase(std::atomic<size_t>& counter, size_t n) {
+    counter.store(counter.load(std::memory_order_relaxed) + n,
+                  std::memory_order_relaxed);
+}
+
+static inline void decrease(std::atomic<size_t>& counter, size_t n) {
+    counter.store(counter.load(std::memory_order_relaxed) - n,
+                  std::memory_order_relaxed);
+}
+
+static inline void add(std::atomic<size_t>& counter, int64_t n) {
+    if (n >= 0) {
+        increase(counter, static_cast<size_t>(n));
+    } else {
+        decrease(counter, static_cast<size_t>(-n));
+    }
+}
+
+static inline uint32_t getSizeClass(size_t size) {
+    for (uint32_t i = 0; i < BlockPool::SIZE_CLASS_NUM; ++i) {
+        if (size <= s_size_classes[i]) {
+            return i;
+        }
+    }
+    return BlockPool::NONE_SIZE_CLASS;
+}
+
+static Block* newBlock(size_t size, uint32_t cls, BlockThreadCache* cache) {
+    void *mem = std::malloc(size);
+    if (UNLIKELY(nullptr == mem)) {
+        return nullptr;
+    }
+    if (nullptr == cache) {
+        s_unowned_live_blocks.fetch_add(1, std::memory_order_relaxed);
+        s_unowned_live_bytes.fetch_add(size, std::memory_order_relaxed);
+    }
+    return new(mem) Block(size, cls, cache);
+}
+
+static inline void deleteBlock(Block* block) {
+    if (nullptr == block->owner) {
+        s_unowned_live_blocks.fetch_sub(1, std::memory_order_relaxed);
+        s_unowned_live_bytes.fetch_sub(block->wholeSize(), std::memory_order_relaxed);
+    }
+    block->~Block();
+    std::free(block);
+}
+
+static void pushLocal(BlockThreadCache* cache, Block* block) {
+    const size_t size = s_size_classes[block->size_class];
+    if (cache->retained_bytes.load(std::memory_order_relaxed) + size
+            > s_max_retained_bytes.load(std::memory_order_relaxed)) {
+        deleteBlock(block);
+        return;
+    }
+    block->next = cache->free_list[block->size_class];
+    cache->free_list[block->size_class] = block;
+    increase(cache->retained_bytes, size);
+}
+
+static void collectRemote(BlockThreadCache* cache) {
+    Block* block = cache->remote_free.exchange(nullptr, std::memory_order_acquire);
+    while (block) {
+        Block* next = block->next;
+        pushLocal(cache, block);
+        block = next;
+    }
+}
+
+static void releaseAll(BlockThreadCache* cache) {
+    for (uint32_t i = 0; i < BlockPool::SIZE_CLASS_NUM; ++i) {
+        while (cache->free_list[i]) {
+            Block* block = cache->free_list[i];
+            cache->free_list[i] = block->next;
+            decrease(cache->retained_bytes, s_size_classes[i]);
+            deleteBlock(block);
+        }
+    }
+}
+
+struct BlockThreadCacheGuard {
+    ~BlockThreadCacheGuard() {
+        BlockThreadCache* cache = s_local_cache;
+        s_local_cache = nullptr;
+        s_local_cache_exited = true;
+        if (nullptr == cache) {
+            return;
+        }
+
+        //Return all retained blocks to system, and blocks released later by
+        //other threads will be freed directly by them.
+        //Chain of io buffer is destroyed with thread, and its blocks are
+        //accounted as released by other threads.
+        cache->chained_blocks.store(0, std::memory_order_relaxed);
+        cache->chained_bytes.store(0, std::memory_order_relaxed);
+        releaseAll(cache);
+        cache->abandoned.store(true, std::memory_order_seq_cst);
+        collectRemote(cache);
+        releaseAll(cache);
+
+        auto& registry = getRegistry();
+        std::lock_guard<std::mutex> guard(registry.mtx);
+        registry.abandoned.push_back(cache);
+    }
+};
+
+static BlockThreadCache* getLocalCache() {
+    if (LIKELY(nullptr != s_local_cache)) {
+        return s_local_cache;
+    }
+    if (s_local_cache_exited) {
+        return nullptr;
+    }
+
+    static thread_local BlockThreadCacheGuard s_guard;
+    (void)s_guard;
+
+    auto& registry = getRegistry();
+    std::lock_guard<std::mutex> guard(registry.mtx);
+    if (!registry.abandoned.empty()) {
+        s_local_cache = registry.abandoned.back();
+        registry.abandoned.pop_back();
+        s_local_cache->abandoned.store(false, std::memory_order_seq_cst);
+    } else {
+        s_local_cache = new BlockThreadCache;
+        registry.caches.push_back(s_local_cache);
+    }
+
+    return s_local_cache;
+}
+
+Block* BlockPool::acquire(size_t size) {
+    const uint32_t cls = getSizeClass(size);
+    if (UNLIKELY(cls == NONE_SIZE_CLASS)) {
+        return newBlock(size, cls, nullptr);
+    }
+
+    auto cache = getLocalCache();
+    if (UNLIKELY(nullptr == cache)) {
+        return newBlock(s_size_classes[cls], cls, nullptr);
+    }
+    if (UNLIKELY(cache->trim_requested.load(std::memory_order_relaxed))) {
+        trimLocal();
+    }
+
+    Block* block = cache->free_list[cls];
+    if (nullptr == block) {
+        collectRemote(cache);
+        block = cache->free_list[cls];
+    }
+
+    if (nullptr != block) {
+        cache->free_list[cls] = block->next;
+        block->next = nullptr;
+        block->size = 0;
+        block->nshared.store(1, std::memory_order_relaxed);
+        decrease(cache->retained_bytes, s_size_classes[cls]);
+        increase(cache->reused, 1);
+        increase(cache->acquired_bytes, s_size_classes[cls]);
+        return block;
+    }
+
+    block = newBlock(s_size_classes[cls], cls, cache);
+    if (LIKELY(nullptr != block)) {
+        increase(cache->allocated, 1);
+        increase(cache->acquired_bytes, s_size_classes[cls]);
+    }
+    return block;
+}
+
+void BlockPool::release(Block* block) {
+    BlockThreadCache* owner = block->owner;
+    if (UNLIKELY(nullptr == owner)) {
+        if (block->size_class == USER_SIZE_CLASS) {
+            auto user_block = static_cast<UserBlock*>(block);
+            if (user_block->deleter) {
+                user_block->deleter(user_block->data);
+            }
+            delete user_block;
+            return;
+        }
+        deleteBlock(block);
+        return;
+    }
+
+    const size_t size = s_size_classes[block->size_class];
+    if (owner == s_local_cache) {
+        increase(owner->local_freed, 1);
+        increase(owner->local_freed_bytes, size);
+        pushLocal(owner, block);
+        return;
+    }
+
+    owner->remote_freed.fetch_add(1, std::memory_order_relaxed);
+    owner->remote_freed_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (owner->abandoned.load(std::memory_order_seq_cst)) {
+        deleteBlock(block);
+        return;
+    }
+
+    Block* head = owner->remote_free.load(std::memory_order_relaxed);
+    do {
+        block->next = head;
+    } while (!owner->remote_free.compare_exchange_weak(
+            head, block, std::memory_order_release, std::memory_order_relaxed));
+}
+
+Block* BlockPool::wrap(void* data, uint32_t size,
+                       std::function<void(void*)> deleter) {
+    return new UserBlock(data, size, USER_SIZE_CLASS, std::move(deleter));
+}
+
+void BlockPool::setMaxRetainedBytes(size_t bytes) {
+    s_max_retained_bytes.store(bytes, std::memory_order_relaxed);
+}
+
+size_t BlockPool::getMaxRetainedBytes() {
+    return s_max_retained_bytes.load(std::memory_order_relaxed);
+}
+
+size_t BlockPool::sizeOfClass(uint32_t cls) {
+    return cls < SIZE_CLASS_NUM ? s_size_classes[cls] : 0;
+}
+
+void BlockPool::addLocalChained(int64_t blocks, int64_t bytes) {
+    auto cache = s_local_cache;
+    if (nullptr == cache) {
+        return;
+    }
+    add(cache->chained_blocks, blocks);
+    add(cache->chained_bytes, bytes);
+}
+
+void BlockPool::trimLocal() {
+    auto cache = s_local_cache;
+    if (nullptr == cache) {
+        return;
+    }
+    cache->trim_requested.store(false, std::memory_order_relaxed);
+    collectRemote(cache);
+    releaseAll(cache);
+}
+
+void BlockPool::requestTrim(bool idle_only) {
+    auto& registry = getRegistry();
+    std::lock_guard<std::mutex> guard(registry.mtx);
+    for (auto cache : registry.caches) {
+        auto acquired = cache->allocated.load(std::memory_order_relaxed)
+                        + cache->reused.load(std::memory_order_relaxed);
+        bool idle = acquired == cache->trim_mark;
+        cache->trim_mark = acquired;
+        if (cache->abandoned.load(std::memory_order_relaxed)
+            || (idle_only && !idle)
+            || cache->retained_bytes.load(std::memory_order_relaxed)
+               + cache->chained_bytes.load(std::memory_order_relaxed) == 0) {
+            continue;
+        }
+        cache->trim_requested.store(true, std::memory_order_relaxed);
+    }
+}
+
+bool BlockPool::takeLocalTrimRequest() {
+    auto cache = s_local_cache;
+    return nullptr != cache
+           && cache->trim_requested.load(std::memory_order_relaxed)
+           && cache->trim_requested.exchange(false, std::memory_order_relaxed);
+}
+
+//Counters are read without synchronization, so freed ones may be newer
+//than acquired ones.
+static inline size_t liveCount(size_t acquired, size_t freed) {
+    return acquired > freed ? acquired - freed : 0;
+}
+
+IOBufferPoolStats BlockPool::stats() {
+    IOBufferPoolStats stats = {};
+    auto& registry = getRegistry();
+    std::lock_guard<std::mutex> guard(registry.mtx);
+    for (auto cache : registry.caches) {
+        auto allocated = cache->allocated.load(std::memory_order_relaxed);
+        auto reused = cache->reused.load(std::memory_order_relaxed);
+        auto acquired_bytes = cache->acquired_bytes.load(std::memory_order_relaxed);
+        auto remote_freed = cache->remote_freed.load(std::memory_order_relaxed);
+        auto remote_freed_bytes = cache->remote_freed_bytes.load(std::memory_order_relaxed);
+        stats.allocated_blocks += allocated;
+        stats.reused_blocks += reused;
+        stats.remote_freed_blocks += remote_freed;
+        stats.retained_bytes += cache->retained_bytes.load(std::memory_order_relaxed);
+        stats.live_blocks += liveCount(
+                allocated + reused,
+                cache->local_freed.load(std::memory_order_relaxed) + remote_freed);
+        stats.live_bytes += liveCount(
+                acquired_bytes,
+                cache->local_freed_bytes.load(std::memory_order_relaxed)
+                + remote_freed_bytes);
+        stats.chained_blocks += cache->chained_blocks.load(std::memory_order_relaxed);
+        stats.chained_bytes += cache->chained_bytes.load(std::memory_order_relaxed);
+    }
+    stats.thread_caches = registry.caches.size();
+    stats.live_blocks += s_unowned_live_blocks.load(std::memory_order_relaxed);
+    stats.live_bytes += s_unowned_live_bytes.load(std::memory_order_relaxed);
+    stats.pinned_bytes = liveCount(stats.live_bytes, stats.chained_bytes);
+    return stats;
+}
+
+void setIOBufferPoolMaxRetainedBytes(size_t bytes) {
+    BlockPool::setMaxRetainedBytes(bytes);
+}
+
+IOBufferPoolStats getIOBufferPoolStats() {
+    return BlockPool::stats();
+}
+
+}
@@ -0,0 +1,131 @@
+// Copyright (c) 2018 Ant Financial, Inc. All Rights Reserved
+//
+
+#ifndef RPC_COMMON_BLOCK_POOL_H
+#define RPC_COMMON_BLOCK_POOL_H
+
+#include <atomic>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+#include "common/common_defines.h"
+
+namespace antflash {
+
+struct BlockThreadCache;
+
+struct Block {
+    //Intrusive reference counter, block is released to pool when it
+    //decreases to 0.
+    std::atomic<uint32_t> nshared;
+    uint32_t size;
+    uint32_t capacity;
+
+    //Size class and thread cache which allocate this block, block is always
+    //recycled to its owner cache, no matter which thread releases it.
+    uint32_t size_class;
+    BlockThreadCache* owner;
+
+    //Link of thread-local block chain or free list of thread cache
+    Block* next;
+
+    //Point to memory right after block header, or memory owned by user
+    char* data;
+
+    Block(uint32_t hint_size, uint32_t cls, BlockThreadCache* cache) :
+            nshared(1), size(0), capacity(hint_size - sizeof(Block)),
+            size_class(cls), owner(cache), next(nullptr),
+            data(reinterpret_cast<char*>(this + 1)) {
+    }
+    Block(void* user_data, uint32_t user_size, uint32_t cls) :
+            nshared(1), size(user_size), capacity(user_size),
+            size_class(cls), owner(nullptr), next(nullptr),
+            data(static_cast<char*>(user_data)) {
+    }
+    ~Block() = default;
+
+    //Memory size of block, including its header
+    inline size_t wholeSize() const {
+        return capacity + sizeof(Block);
+    }
+
+    inline uint32_t freeSpace() const {
+        return capacity - size;
+    }
+
+    inline void incRef() {
+        nshared.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    inline void decRef();
+
+    inline uint32_t refCount() const {
+        return nshared.load(std::memory_order_relaxed);
+    }
+};
+
+//Block refers to memory owned by user, deleter is called when the last
+//reference is released, maybe in a thread different from the creator.
+struct UserBlock : public Block {
+    std::function<void(void*)> deleter;
+
+    UserBlock(void* user_data, uint32_t user_size, uint32_t cls,
+              std::function<void(void*)>&& d) :
+            Block(user_data, user_size, cls), deleter(std::move(d)) {
+    }
+};
+
+/**
+ * Size classed block allocator for io buffer. Each thread holds its own cache of
+ * free blocks, and blocks released in other threads are pushed back to owner
+ * cache by a lock free list, which will be collected when owner cache is empty.
+ * Blocks larger than max size class are allocated and freed directly.
+ */
+class BlockPool {
+public:
+    static constexpr uint32_t SIZE_CLASS_NUM = 2;
+    static constexpr uint32_t NONE_SIZE_CLASS = SIZE_CLASS_NUM;
+    static constexpr uint32_t USER_SIZE_CLASS = SIZE_CLASS_NUM + 1;
+
+    //Allocate a block whose whole size is at least @size, with one reference
+    static Block* acquire(size_t size = BUFFER_DEFAULT_BLOCK_SIZE);
+    static void release(Block* block);
+
+    //Wrap memory owned by user into a full block, with one reference
+    static Block* wrap(void* data, uint32_t size,
+                       std::function<void(void*)> deleter);
+
+    //Free blocks retained by one thread cache over @bytes will be returned to system
+    static void setMaxRetainedBytes(size_t bytes);
+    static size_t getMaxRetainedBytes();
+
+    //Account blocks cached by thread-local chain of io buffer in calling thread
+    static void addLocalChained(int64_t blocks, int64_t bytes);
+
+    //Return free blocks retained by calling thread to system
+    static void trimLocal();
+
+    //Ask thread caches to return their free blocks, each of them does it in
+    //its owner thread. If idle_only, only caches which acquired no block
+    //since last request are asked.
+    static void requestTrim(bool idle_only);
+    //Take trim request of calling thread, return whether it was asked
+    static bool takeLocalTrimRequest();
+
+    static IOBufferPoolStats stats();
+
+    static size_t sizeOfClass(uint32_t cls);
+};
+
+inline void Block::decRef() {
+    //If we hold the only reference, no one else could increase it, so
+    //atomic read-modify-write is unnecessary.
+    if (nshared.load(std::memory_order_acquire) == 1
+        || nshared.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        BlockPool::release(this);
+    }
+}
+
+}
+
+#endif //RPC_COMMON_BLOCK_POOL_H
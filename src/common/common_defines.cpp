@@ -48,10 +48,14 @@ static void ProtoBufLogHandler(google::protobuf::LogLevel level,
 */
 
 bool globalInit() {
+    return globalInit(LoopOptions());
+}
+
+bool globalInit(const LoopOptions& options) {
     //google::protobuf::SetLogHandler(&ProtoBufLogHandler);
 
     //Init schedule first so that sockets can be connected/read normally
-    if (!Schedule::getInstance().init()) {
+    if (!Schedule::getInstance().init(options)) {
         return false;
     }
 
@@ -81,6 +85,9 @@ void globalDestroy() {
 
     //timeout thread must by destroyed after socket manager
     Schedule::getInstance().destroy_time_schedule();
+
+    //Callbacks handed over by loop and timer threads are run before returning
+    Schedule::getInstance().destroy_executor();
 }
 
 const char* getRpcStatus(ERpcStatus status) {
@@ -8,121 +8,217 @@
 #include <memory>
 #include <cstdlib>
 #include <cmath>
+#include <limits>
 #include <sstream>
+#include <atomic>
+#include <errno.h>
+#include <sys/socket.h>
 #include "common/macro.h"
 #include "common/common_defines.h"
+#include "rpc.h"
+#include "tcp/socket_base.h"
+#include "schedule/schedule.h"
 
 namespace antflash {
 
-struct Block {
-    std::shared_ptr<Block> next;
-    uint32_t size;
-    uint32_t capacity;
-    char data[0];
-
-    Block(uint32_t hint_size) :
-            size(0), capacity(hint_size - offsetof(Block, data)) {
-    }
-    ~Block() = default;
-
-    inline uint32_t freeSpace() const {
-        return capacity - size;
-    }
-};
-
-using TLSBlockChain = std::shared_ptr<Block>;
-
 //When pushing data to block, a thread-local block is always used, which it's thread-compatible,
 //and io buffer just hold a block ref of this block and index range it use.
 //When popping data from block, io buffer's block may refer to block belonged to other thread,
 //so only block ref's range is changed or removed but block stay unchanged.
 //When block is full, it will be removed and waiting for reclaimed when shared counter
 //decrease to 0.
+//Chain holds one reference of each block in it, and caches no more than
+//s_max_chained_blocks blocks, others are released when pushed back.
+static std::atomic<size_t> s_max_chained_blocks(IO_BUFFER_MAX_CHAINED_BLOCKS);
+
+struct TLSBlockChain {
+    Block* head = nullptr;
+    size_t num_blocks = 0;
+
+    ~TLSBlockChain() {
+        clear();
+    }
+
+    inline Block* popHead() {
+        Block* block = head;
+        head = block->next;
+        block->next = nullptr;
+        --num_blocks;
+        BlockPool::addLocalChained(-1, -(int64_t)block->wholeSize());
+        return block;
+    }
+
+    inline void pushHead(Block* block) {
+        block->next = head;
+        head = block;
+        ++num_blocks;
+        BlockPool::addLocalChained(1, block->wholeSize());
+    }
+
+    void clear() {
+        while (head) {
+            popHead()->decRef();
+        }
+    }
+};
+
 thread_local TLSBlockChain s_tls_block_chain;
 
-static std::shared_ptr<Block> createBlock(
-        uint32_t size = BUFFER_DEFAULT_BLOCK_SIZE) {
-    void *mem = std::malloc(size);
-    if (LIKELY(nullptr != mem)) {
-        return std::shared_ptr<Block>(new(mem) Block(size), [](Block* p) {
-                        p->~Block();
-                        std::free(p);
-                        });
+//Release blocks cached by calling thread if other thread asked
+static inline void honourTrimRequest() {
+    if (UNLIKELY(BlockPool::takeLocalTrimRequest())) {
+        trimIOBufferThreadCache();
     }
-    return std::shared_ptr<Block>();
 }
 
-static std::shared_ptr<Block> shareBlockFromTLSChain() {
+static Block* shareBlockFromTLSChain() {
+    honourTrimRequest();
     //Pop head until one block has free space, if this block ref count is 1,
     //it will be reclaimed.
-    while (s_tls_block_chain) {
-        if (s_tls_block_chain->freeSpace() > 0) {
-            return s_tls_block_chain;
+    while (s_tls_block_chain.head) {
+        if (s_tls_block_chain.head->freeSpace() > 0) {
+            return s_tls_block_chain.head;
         }
-        s_tls_block_chain = s_tls_block_chain->next;
+        s_tls_block_chain.popHead()->decRef();
     }
 
-    //Original hazard block's counter is decrease, and if decreased to 0,
-    //memory will be free, and if not, memory will be free when all io
-    //buffer which holds shared its pointer deconstructed.
-    s_tls_block_chain = createBlock();
+    auto block = BlockPool::acquire();
+    if (UNLIKELY(nullptr == block)) {
+        return nullptr;
+    }
+    s_tls_block_chain.pushHead(block);
 
-    //After return, both s_tls_block_chain and io buffer which calling
-    //shareBlockFromTLSChain holds the shared pointer, the shared counter
-    //is 2 but not 1, and deconstruction among threads is safe.
-    return s_tls_block_chain;
+    //Block is still owned by chain after return, caller should increase
+    //reference if it holds the block.
+    return block;
 }
 
-static void releaseBlockToTLSChain(std::shared_ptr<Block>& block) {
-    if (block->freeSpace() == 0) {
+static void releaseBlockToTLSChain(Block* block) {
+    if (block->freeSpace() == 0
+        || s_tls_block_chain.num_blocks
+           >= s_max_chained_blocks.load(std::memory_order_relaxed)) {
+        block->decRef();
         return;
     }
-    block->next = s_tls_block_chain;
-    s_tls_block_chain = block;
+    s_tls_block_chain.pushHead(block);
 }
 
-static std::shared_ptr<Block> acquireBlockFromTLSChain() {
+static Block* acquireBlockFromTLSChain() {
+    honourTrimRequest();
     //Pop head until one block has free space, if this block ref count is 1,
     //it will be reclaimed.
-    while (s_tls_block_chain) {
-        if (s_tls_block_chain->freeSpace() > 0) {
-            auto block = s_tls_block_chain;
-            s_tls_block_chain = block->next;
-            block->next.reset();
+    while (s_tls_block_chain.head) {
+        auto block = s_tls_block_chain.popHead();
+        if (block->freeSpace() > 0) {
             return block;
         }
-        s_tls_block_chain = s_tls_block_chain->next;
+        block->decRef();
     }
 
-    //After return, only io buffer which calling acquireBlockFromTLSChain
-    // holds the shared pointer, the shared counter is 1.
-    return createBlock();
+    //After return, reference of chain is given to caller.
+    return BlockPool::acquire();
 }
 
-static constexpr size_t IO_BUFFER_DEFAULT_SLICE_REF_SIZE = 4;
-IOBuffer::IOBuffer() : _ref_offset(0) {
-    _ref.reserve(IO_BUFFER_DEFAULT_SLICE_REF_SIZE);
+constexpr uint32_t IOBuffer::SliceQueue::INLINE_SLICE_SIZE;
+
+IOBuffer::SliceQueue::~SliceQueue() {
+    clear();
+    if (_slots != _inline) {
+        delete[] _slots;
+    }
+}
+
+IOBuffer::SliceQueue::SliceQueue(const SliceQueue& right) : SliceQueue() {
+    *this = right;
+}
+
+IOBuffer::SliceQueue::SliceQueue(SliceQueue&& right) : SliceQueue() {
+    moveFrom(right);
+}
+
+IOBuffer::SliceQueue& IOBuffer::SliceQueue::operator=(const SliceQueue& right) {
+    if (this != &right) {
+        clear();
+        for (size_t i = 0; i < right._size; ++i) {
+            right[i].block->incRef();
+            push_back(right[i]);
+        }
+    }
+    return *this;
+}
+
+IOBuffer::SliceQueue& IOBuffer::SliceQueue::operator=(SliceQueue&& right) {
+    if (this != &right) {
+        clear();
+        moveFrom(right);
+    }
+    return *this;
+}
+
+void IOBuffer::SliceQueue::clear() {
+    for (size_t i = 0; i < _size; ++i) {
+        (*this)[i].block->decRef();
+    }
+    _begin = 0;
+    _size = 0;
+}
+
+void IOBuffer::SliceQueue::grow() {
+    const uint32_t cap = _cap << 1;
+    Slice* slots = new Slice[cap];
+    const uint32_t first = std::min(_size, _cap - _begin);
+    memcpy(slots, _slots + _begin, first * sizeof(Slice));
+    memcpy(slots + first, _slots, (_size - first) * sizeof(Slice));
+    if (_slots != _inline) {
+        delete[] _slots;
+    }
+    _slots = slots;
+    _cap = cap;
+    _begin = 0;
+}
+
+//Must be empty before moving
+void IOBuffer::SliceQueue::moveFrom(SliceQueue& right) {
+    if (right._slots != right._inline) {
+        //Steal heap slots directly
+        if (_slots != _inline) {
+            delete[] _slots;
+        }
+        _slots = right._slots;
+        _cap = right._cap;
+        _begin = right._begin;
+        _size = right._size;
+        right._slots = right._inline;
+        right._cap = INLINE_SLICE_SIZE;
+    } else {
+        for (size_t i = 0; i < right._size; ++i) {
+            push_back(right[i]);
+        }
+    }
+    right._begin = 0;
+    right._size = 0;
+}
+
+IOBuffer::IOBuffer() : _length(0) {
 }
 
 IOBuffer::~IOBuffer() {
 
 }
 
-IOBuffer::IOBuffer(const IOBuffer &right) {
-    _ref = right._ref;
-    _ref_offset = right._ref_offset;
+IOBuffer::IOBuffer(const IOBuffer &right) :
+        _ref(right._ref), _length(right._length) {
 }
 
-IOBuffer::IOBuffer(IOBuffer &&right) {
-    _ref = std::move(right._ref);
-    _ref_offset = right._ref_offset;
-    right.clear();
+IOBuffer::IOBuffer(IOBuffer &&right) :
+        _ref(std::move(right._ref)), _length(right._length) {
+    right._length = 0;
 }
 
 IOBuffer &IOBuffer::operator=(const IOBuffer &right) {
     if (this != &right) {
         _ref = right._ref;
-        _ref_offset = right._ref_offset;
+        _length = right._length;
     }
     return *this;
 }
@@ -130,21 +226,24 @@ IOBuffer &IOBuffer::operator=(const IOBuffer &right) {
 IOBuffer &IOBuffer::operator=(IOBuffer &&right) {
     if (this != &right) {
         _ref = std::move(right._ref);
-        right.clear();
+        _length = right._length;
+        right._length = 0;
     }
     return *this;
 }
 
 void IOBuffer::swap(IOBuffer &right) {
     if (this != &right) {
-        _ref.swap(right._ref);
-        std::swap(_ref_offset, right._ref_offset);
+        IOBuffer tmp(std::move(right));
+        right = std::move(*this);
+        *this = std::move(tmp);
     }
 }
 
 std::string IOBuffer::to_string() const {
     std::string s;
-    for (size_t i = _ref_offset; i < _ref.size(); ++i) {
+    s.reserve(_length);
+    for (size_t i = 0; i < _ref.size(); ++i) {
         s.append(_ref[i].block->data + _ref[i].offset,
                  _ref[i].length);
     }
@@ -153,62 +252,66 @@ std::string IOBuffer::to_string() const {
 
 size_t IOBuffer::pop_front(size_t n) {
     size_t cur_size = 0;
-    size_t ref_idx = _ref_offset;
-    while (cur_size < n) {
-        if (ref_idx >= _ref.size()) {
-            break;
-        }
-
+    while (cur_size < n && !_ref.empty()) {
+        auto& front = _ref.front();
         size_t pop_size = n - cur_size;
-        if (pop_size < _ref[ref_idx].length) {
-            _ref[ref_idx].offset += pop_size;
-            _ref[ref_idx].length -= pop_size;
+        if (pop_size < front.length) {
+            front.offset += pop_size;
+            front.length -= pop_size;
             cur_size += pop_size;
         } else {
-            cur_size += _ref[ref_idx].length;
-            ++ref_idx;
+            cur_size += front.length;
+            _ref.pop_front();
         }
     }
 
-    _ref_offset = ref_idx;
-    tryReleaseBlock();
-
+    _length -= cur_size;
     return cur_size;
 }
 
 size_t IOBuffer::pop_back(size_t n) {
     size_t cur_size = 0;
-    ssize_t ref_idx = _ref.size() - 1;
-    while (cur_size < n) {
-        if (ref_idx < (ssize_t)_ref_offset) {
-            break;
-        }
-
+    while (cur_size < n && !_ref.empty()) {
+        auto& back = _ref.back();
         size_t pop_size = n - cur_size;
-        if (pop_size < _ref[ref_idx].length) {
-            _ref[ref_idx].length -= pop_size;
+        if (pop_size < back.length) {
+            back.length -= pop_size;
             cur_size += pop_size;
         } else {
-            cur_size += _ref[ref_idx].length;
+            cur_size += back.length;
             _ref.pop_back();
-            --ref_idx;
         }
     }
 
+    _length -= cur_size;
     return cur_size;
 }
 
 void IOBuffer::append(const IOBuffer &other) {
-    for (auto& ref : other._ref) {
-        _ref.emplace_back(ref);
+    const size_t num = other._ref.size();
+    const size_t length = other._length;
+    for (size_t i = 0; i < num; ++i) {
+        const Slice slice = other._ref[i];
+        slice.block->incRef();
+        _ref.push_back(slice);
     }
+    _length += length;
 }
 
 void IOBuffer::append(IOBuffer &&other) {
-    for (auto& ref : other._ref) {
-        _ref.emplace_back(ref);
+    if (UNLIKELY(this == &other)) {
+        append(static_cast<const IOBuffer&>(other));
+        return;
     }
-    other.clear();
+    if (_ref.empty()) {
+        *this = std::move(other);
+        return;
+    }
+    while (!other._ref.empty()) {
+        _ref.push_back(other._ref.take_front());
+    }
+    _length += other._length;
+    other._length = 0;
 }
 
 void IOBuffer::append(char c) {
@@ -219,7 +322,7 @@ void IOBuffer::append(char c) {
 
     block->data[block->size] = c;
     do {
-        if (_ref.size() > _ref_offset) {
+        if (!_ref.empty()) {
             auto &back = _ref.back();
             if (back.block == block
                 && back.offset + back.length == block->size) {
@@ -228,10 +331,12 @@ void IOBuffer::append(char c) {
             }
         }
 
-        _ref.emplace_back(block, block->size, 1);
+        block->incRef();
+        _ref.push_back({block, block->size, 1});
     } while (0);
 
     ++block->size;
+    ++_length;
 }
 
 void IOBuffer::append(const void *data, size_t count) {
@@ -251,7 +356,7 @@ void IOBuffer::append(const void *data, size_t count) {
         memmove(block->data + block->size, (char*)data + cur_size, push_size);
 
         do {
-            if (_ref.size() > _ref_offset) {
+            if (!_ref.empty()) {
                 auto &back = _ref.back();
                 if (back.block == block
                     && back.offset + back.length == block->size) {
@@ -260,11 +365,13 @@ void IOBuffer::append(const void *data, size_t count) {
                 }
             }
 
-            _ref.emplace_back(block, block->size, push_size);
+            block->incRef();
+            _ref.push_back({block, block->size, (uint32_t)push_size});
         } while (0);
 
         block->size += push_size;
         cur_size += push_size;
+        _length += push_size;
     }
 }
 
@@ -272,51 +379,78 @@ void IOBuffer::append(const char *data) {
     append(data, strlen(data));
 }
 
+void IOBuffer::append_user_data(void *data, size_t count,
+                                std::function<void(void*)> deleter) {
+    if (UNLIKELY(nullptr == data || 0 == count)) {
+        if (deleter) {
+            deleter(data);
+        }
+        return;
+    }
+
+    //Slice length is 32 bits, fall back to copy for huge data
+    if (UNLIKELY(count > std::numeric_limits<uint32_t>::max())) {
+        append(data, count);
+        if (deleter) {
+            deleter(data);
+        }
+        return;
+    }
+
+    auto block = BlockPool::wrap(data, count, std::move(deleter));
+    _ref.push_back({block, 0, (uint32_t)count});
+    _length += count;
+}
+
 ssize_t IOBuffer::append_from_file_descriptor(int fd, size_t max_size) {
     constexpr int MAX_APPEND_IOVEC = 64;
     iovec vec[MAX_APPEND_IOVEC];
+    Block* blocks[MAX_APPEND_IOVEC];
     int nvec = 0;
     size_t space = 0;
-    std::shared_ptr<Block> block_head;
-    std::shared_ptr<Block> block_tail;
     do {
-        auto block = acquireBlockFromTLSChain();
+        //Fill free space of thread-local block first, and use large blocks
+        //when much more data is expected
+        const size_t left = max_size - space;
+        auto block = (nvec > 0 && left >= BUFFER_MAX_SLICE_SIZE) ?
+                     BlockPool::acquire(BUFFER_MAX_SLICE_SIZE)
+                     : acquireBlockFromTLSChain();
         if (UNLIKELY(!block)) {
-            return -1;
-        }
-        if (block_tail) {
-            block_tail->next = block;
-        } else {
-            block_head = block;
+            break;
         }
-
+        blocks[nvec] = block;
         vec[nvec].iov_base = block->data + block->size;
         vec[nvec].iov_len = std::min((size_t)block->freeSpace(), max_size - space);
         space += vec[nvec].iov_len;
         ++nvec;
-        if (space >= max_size || nvec >= MAX_APPEND_IOVEC) {
-            break;
-        }
-        block_tail = block;
-    } while (true);
+    } while (space < max_size && nvec < MAX_APPEND_IOVEC);
+
+    if (UNLIKELY(nvec == 0)) {
+        return -1;
+    }
 
     ssize_t nr = readv(fd, vec, nvec);
     if (nr > 0) {
         size_t total_len = nr;
-        do {
-            const size_t len = std::min(total_len, (size_t) block_head->freeSpace());
+        for (int i = 0; i < nvec && total_len > 0; ++i) {
+            Block* block = blocks[i];
+            const size_t len = std::min(total_len, (size_t)vec[i].iov_len);
             total_len -= len;
-            _ref.emplace_back(block_head, block_head->size, len);
-            block_head->size += len;
-            if (block_head->freeSpace() == 0) {
-                block_head = block_head->next;
-            }
-        } while (total_len > 0);
+            block->incRef();
+            _ref.push_back({block, block->size, (uint32_t)len});
+            block->size += len;
+            _length += len;
+        }
     }
 
-    while (block_head) {
-        releaseBlockToTLSChain(block_head);
-        block_head = block_head->next;
+    //Return blocks in reverse order, so that first block with free space
+    //is head of chain again, and blocks not used at all are returned to pool
+    for (int i = nvec - 1; i >= 0; --i) {
+        if (blocks[i]->size == 0 && i > 0) {
+            blocks[i]->decRef();
+        } else {
+            releaseBlockToTLSChain(blocks[i]);
+        }
     }
 
     return nr;
@@ -324,30 +458,23 @@ ssize_t IOBuffer::append_from_file_descriptor(int fd, size_t max_size) {
 
 size_t IOBuffer::cut(IOBuffer *out, size_t n) {
     size_t cur_size = 0;
-    size_t idx = _ref_offset;
-    while (cur_size < n) {
-        if (idx >= _ref.size()) {
-            break;
-        }
-
+    while (cur_size < n && !_ref.empty()) {
+        auto& front = _ref.front();
         size_t cut_size = n - cur_size;
-        if (cut_size < _ref[idx].length) {
-            out->_ref.emplace_back(_ref[idx].block,
-                                   _ref[idx].offset,
-                                   cut_size);
-            _ref[idx].offset += cut_size;
-            _ref[idx].length -= cut_size;
+        if (cut_size < front.length) {
+            front.block->incRef();
+            out->_ref.push_back({front.block, front.offset, (uint32_t)cut_size});
+            front.offset += cut_size;
+            front.length -= cut_size;
             cur_size += cut_size;
         } else {
-            out->_ref.emplace_back(_ref[idx]);
-            cur_size += _ref[idx].length;
-            ++_ref_offset;
-            ++idx;
+            cur_size += front.length;
+            out->_ref.push_back(_ref.take_front());
         }
     }
 
-    tryReleaseBlock();
-
+    _length -= cur_size;
+    out->_length += cur_size;
     return cur_size;
 }
 
@@ -364,50 +491,53 @@ size_t IOBuffer::cut(std::string &out, size_t n) {
 
 size_t IOBuffer::cut(void *out, size_t n) {
     size_t cur_size = 0;
-    size_t idx = _ref_offset;
-    while (cur_size < n) {
-        if (idx >= _ref.size()) {
-            break;
-        }
-
+    while (cur_size < n && !_ref.empty()) {
+        auto& front = _ref.front();
         size_t cut_size = n - cur_size;
-        if (cut_size < _ref[idx].length) {
+        if (cut_size < front.length) {
             memmove((char*)out + cur_size,
-                    _ref[idx].block->data + _ref[idx].offset,
+                    front.block->data + front.offset,
                     cut_size);
-            _ref[idx].offset += cut_size;
-            _ref[idx].length -= cut_size;
+            front.offset += cut_size;
+            front.length -= cut_size;
             cur_size += cut_size;
         } else {
             memmove((char*)out + cur_size,
-                    _ref[idx].block->data + _ref[idx].offset,
-                    _ref[idx].length);
-            cur_size += _ref[idx].length;
-            ++_ref_offset;
-            ++idx;
+                    front.block->data + front.offset,
+                    front.length);
+            cur_size += front.length;
+            _ref.pop_front();
         }
     }
 
-    tryReleaseBlock();
-
+    _length -= cur_size;
     return cur_size;
 }
 
-ssize_t IOBuffer::cut_into_file_descriptor(int fd, size_t size_hint) {
-    constexpr size_t IOBUF_IOV_MAX = 256;
-    const size_t nref = std::min(_ref.size() - _ref_offset, IOBUF_IOV_MAX);
-    struct iovec vec[nref];
+size_t IOBuffer::prepare_iovec(
+        struct iovec* vec, size_t nref, size_t size_hint) const {
     size_t nvec = 0;
     size_t cur_len = 0;
 
     do {
-        vec[nvec].iov_base = _ref[_ref_offset + nvec].block->data
-                             + _ref[_ref_offset + nvec].offset;
-        vec[nvec].iov_len = _ref[_ref_offset + nvec].length;
+        vec[nvec].iov_base = _ref[nvec].block->data + _ref[nvec].offset;
+        vec[nvec].iov_len = _ref[nvec].length;
         cur_len += vec[nvec].iov_len;
         ++nvec;
     } while (nvec < nref && cur_len < size_hint);
 
+    return nvec;
+}
+
+ssize_t IOBuffer::cut_into_file_descriptor(int fd, size_t size_hint) {
+    constexpr size_t IOBUF_IOV_MAX = 256;
+    const size_t nref = std::min(_ref.size(), IOBUF_IOV_MAX);
+    if (UNLIKELY(nref == 0)) {
+        return 0;
+    }
+    struct iovec vec[nref];
+    size_t nvec = prepare_iovec(vec, nref, size_hint);
+
     ssize_t nw = writev(fd, vec, nvec);
 
     if (nw > 0) {
@@ -417,9 +547,36 @@ ssize_t IOBuffer::cut_into_file_descriptor(int fd, size_t size_hint) {
     return nw;
 }
 
+ssize_t IOBuffer::cut_into_file_descriptor_zero_copy(
+        int fd, size_t size_hint, IOBuffer* pinned) {
+#if defined(OS_LINUX)
+    constexpr size_t IOBUF_IOV_MAX = 256;
+    const size_t nref = std::min(_ref.size(), IOBUF_IOV_MAX);
+    if (UNLIKELY(nref == 0)) {
+        return 0;
+    }
+    struct iovec vec[nref];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = vec;
+    msg.msg_iovlen = prepare_iovec(vec, nref, size_hint);
+
+    ssize_t nw = sendmsg(fd, &msg, MSG_ZEROCOPY);
+
+    if (nw > 0) {
+        cut(pinned, nw);
+    }
+
+    return nw;
+#else
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
 size_t IOBuffer::copy_to(void *out, size_t n) const {
     size_t cur_size = 0;
-    size_t idx = _ref_offset;
+    size_t idx = 0;
     while (cur_size < n) {
         if (idx >= _ref.size()) {
             break;
@@ -445,34 +602,14 @@ size_t IOBuffer::copy_to(void *out, size_t n) const {
 
 std::pair<const char *, size_t> IOBuffer::slice(size_t i) const {
     return std::make_pair<const char*, size_t>(
-            _ref[_ref_offset + i].block->data
-            + _ref[_ref_offset + i].offset,
-            (size_t)_ref[_ref_offset + i].length);
+            _ref[i].block->data + _ref[i].offset,
+            (size_t)_ref[i].length);
 }
 
 std::pair<const char*, size_t> IOBuffer::block(size_t i) const {
     return std::make_pair<const char*, size_t>(
-            _ref[_ref_offset + i].block->data,
-            (size_t)_ref[_ref_offset + i].block->size);
-}
-
-void IOBuffer::tryReleaseBlock() {
-    if (_ref_offset > IO_BUFFER_DEFAULT_SLICE_REF_SIZE) {
-        size_t size = _ref.size() - _ref_offset;
-        if (size == 0) {
-            _ref.clear();
-            _ref_offset = 0;
-            return;
-        }
-
-        auto itr = _ref.begin();
-        for (size_t i = _ref_offset; i < _ref.size(); ++i, ++itr) {
-            *itr = _ref[i];
-        }
-
-        _ref.erase(itr, _ref.end());
-        _ref_offset = 0;
-    }
+            (const char*)_ref[i].block->data,
+            (size_t)_ref[i].block->size);
 }
 
 std::string IOBuffer::dump() const {
@@ -524,8 +661,231 @@ std::string IOBuffer::dump() const {
     return ss.str();
 }
 
+const void* IOBufferReader::fetch(void* tmp, size_t n) const {
+    if (UNLIKELY(n > left())) {
+        return nullptr;
+    }
+    if (n == 0) {
+        return tmp;
+    }
+
+    auto& slice = _buf->_ref[_index];
+    const char* data = slice.block->data + slice.offset + _offset;
+    if (LIKELY(slice.length - _offset >= n)) {
+        return data;
+    }
+
+    //Bytes span several slices
+    size_t cur_size = 0;
+    size_t index = _index;
+    size_t offset = _offset;
+    while (cur_size < n) {
+        auto& cur = _buf->_ref[index];
+        size_t copy_size = std::min(n - cur_size, cur.length - offset);
+        memcpy((char*)tmp + cur_size, cur.block->data + cur.offset + offset, copy_size);
+        cur_size += copy_size;
+        ++index;
+        offset = 0;
+    }
+
+    return tmp;
+}
+
+bool IOBufferReader::read(void* out, size_t n) {
+    auto data = fetch(out, n);
+    if (UNLIKELY(nullptr == data)) {
+        return false;
+    }
+    if (data != out) {
+        memcpy(out, data, n);
+    }
+    skip(n);
+    return true;
+}
+
+bool IOBufferReader::read(std::string& out, size_t n) {
+    if (UNLIKELY(n > left())) {
+        return false;
+    }
+
+    auto& slice = _buf->_ref[_index];
+    if (LIKELY(n == 0 || slice.length - _offset >= n)) {
+        out.assign(slice.block->data + slice.offset + _offset, n);
+        skip(n);
+        return true;
+    }
+
+    out.resize(n);
+    return read(&out[0], n);
+}
+
+bool IOBufferReader::readUint16(uint16_t& value) {
+    uint16_t tmp;
+    auto data = (const uint8_t*)fetch(&tmp, sizeof(tmp));
+    if (UNLIKELY(nullptr == data)) {
+        return false;
+    }
+    value = ((uint16_t)data[0] << 8) | data[1];
+    skip(sizeof(tmp));
+    return true;
+}
+
+bool IOBufferReader::readUint32(uint32_t& value) {
+    uint32_t tmp;
+    auto data = (const uint8_t*)fetch(&tmp, sizeof(tmp));
+    if (UNLIKELY(nullptr == data)) {
+        return false;
+    }
+    value = ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16)
+            | ((uint32_t)data[2] << 8) | data[3];
+    skip(sizeof(tmp));
+    return true;
+}
+
+bool IOBufferReader::next(const char** data, size_t* size) {
+    if (_index >= _buf->_ref.size()) {
+        return false;
+    }
+
+    auto& slice = _buf->_ref[_index];
+    *data = slice.block->data + slice.offset + _offset;
+    *size = slice.length - _offset;
+    _position += *size;
+    ++_index;
+    _offset = 0;
+    return true;
+}
+
+size_t IOBufferReader::skip(size_t n) {
+    size_t cur_size = 0;
+    while (cur_size < n && _index < _buf->_ref.size()) {
+        auto& slice = _buf->_ref[_index];
+        size_t skip_size = std::min(n - cur_size, slice.length - _offset);
+        cur_size += skip_size;
+        _offset += skip_size;
+        if (_offset == slice.length) {
+            ++_index;
+            _offset = 0;
+        }
+    }
+    _position += cur_size;
+    return cur_size;
+}
+
+char* IOBufferAppender::reserveSlow(size_t n) {
+    flush();
+
+    //Use head of thread-local chain if it has enough space, or else a new
+    //block which is put to chain after flushing.
+    while (s_tls_block_chain.head) {
+        if (s_tls_block_chain.head->freeSpace() >= n) {
+            _block = s_tls_block_chain.popHead();
+            break;
+        }
+        if (s_tls_block_chain.head->freeSpace() > 0) {
+            break;
+        }
+        s_tls_block_chain.popHead()->decRef();
+    }
+    if (nullptr == _block) {
+        //Size of block includes its header
+        _block = BlockPool::acquire(
+                std::max(n + sizeof(Block), BUFFER_DEFAULT_BLOCK_SIZE));
+        if (UNLIKELY(nullptr == _block)) {
+            return nullptr;
+        }
+    }
+
+    _begin = _block->size;
+    return _block->data + _block->size;
+}
+
+void IOBufferAppender::append(const void* data, size_t n) {
+    size_t cur_size = 0;
+    while (cur_size < n) {
+        size_t push_size = n - cur_size;
+        if (nullptr == _block || _block->freeSpace() == 0) {
+            if (UNLIKELY(nullptr == reserveSlow(1))) {
+                return;
+            }
+        }
+        push_size = std::min(push_size, (size_t)_block->freeSpace());
+        memcpy(_block->data + _block->size, (const char*)data + cur_size, push_size);
+        _block->size += push_size;
+        cur_size += push_size;
+    }
+}
+
+void IOBufferAppender::appendUint16(uint16_t value) {
+    auto data = (uint8_t*)reserve(sizeof(value));
+    if (UNLIKELY(nullptr == data)) {
+        return;
+    }
+    data[0] = value >> 8;
+    data[1] = value;
+    commit(sizeof(value));
+}
+
+void IOBufferAppender::appendUint32(uint32_t value) {
+    auto data = (uint8_t*)reserve(sizeof(value));
+    if (UNLIKELY(nullptr == data)) {
+        return;
+    }
+    data[0] = value >> 24;
+    data[1] = value >> 16;
+    data[2] = value >> 8;
+    data[3] = value;
+    commit(sizeof(value));
+}
+
+void IOBufferAppender::appendDecimal(int64_t value) {
+    char tmp[20];
+    size_t n = 0;
+    uint64_t abs_value = value < 0 ? -(uint64_t)value : value;
+    do {
+        tmp[n++] = '0' + abs_value % 10;
+        abs_value /= 10;
+    } while (abs_value > 0);
+    if (value < 0) {
+        tmp[n++] = '-';
+    }
+
+    auto data = reserve(n);
+    if (UNLIKELY(nullptr == data)) {
+        return;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        data[i] = tmp[n - 1 - i];
+    }
+    commit(n);
+}
+
+void IOBufferAppender::flush() {
+    if (nullptr == _block) {
+        return;
+    }
+
+    const uint32_t length = _block->size - _begin;
+    if (length > 0) {
+        auto& ref = _buf->_ref;
+        if (!ref.empty() && ref.back().block == _block
+            && ref.back().offset + ref.back().length == _begin) {
+            ref.back().length += length;
+        } else {
+            _block->incRef();
+            ref.push_back({_block, _begin, length});
+        }
+        _buf->_length += length;
+    }
+
+    //Reference of appender is given back to thread-local chain
+    releaseBlockToTLSChain(_block);
+    _block = nullptr;
+    _begin = 0;
+}
+
 IOBufferZeroCopyInputStream::IOBufferZeroCopyInputStream(const IOBuffer& buf)
-        : _buf(&buf), _byte_count(0), _add_offset(0), _ref_index(buf._ref_offset) {
+        : _buf(&buf), _byte_count(0), _add_offset(0), _ref_index(0) {
 }
 
 IOBufferZeroCopyInputStream::~IOBufferZeroCopyInputStream() {
@@ -548,7 +908,7 @@ bool IOBufferZeroCopyInputStream::Next(const void **data, int *size) {
 }
 
 void IOBufferZeroCopyInputStream::BackUp(int count) {
-    if (_ref_index > _buf->_ref_offset) {
+    if (_ref_index > 0) {
         --_ref_index;
         auto& slice = _buf->_ref[_ref_index];
         _add_offset = slice.length - count;
@@ -597,7 +957,9 @@ bool IOBufferZeroCopyOutputStream::Next(void **data, int *size) {
     _byte_count += *size;
 
     //assume all left size used
-    _buf->_ref.emplace_back(block, block->size, block->freeSpace());
+    block->incRef();
+    _buf->_ref.push_back({block, block->size, block->freeSpace()});
+    _buf->_length += block->freeSpace();
     block->size = block->capacity;
 
     return true;
@@ -613,13 +975,16 @@ void IOBufferZeroCopyOutputStream::BackUp(int count) {
         if (LIKELY((int)slice.length > count)) {
             slice.length -= count;
             _byte_count -= count;
+            _buf->_length -= count;
             slice.block->size -= count;
             break;
         } else {
-            _byte_count -= slice.length;
-            slice.block->size -= slice.length;
+            const uint32_t length = slice.length;
+            _byte_count -= length;
+            _buf->_length -= length;
+            slice.block->size -= length;
             _buf->_ref.pop_back();
-            count -= slice.length;
+            count -= length;
         }
     }
 }
@@ -628,13 +993,48 @@ google::protobuf::int64 IOBufferZeroCopyOutputStream::ByteCount() const {
     return _byte_count;
 }
 
+IOBuffer::BlockUnitTest::~BlockUnitTest() {
+    if (block) {
+        block->decRef();
+    }
+}
+
+IOBuffer::BlockUnitTest::BlockUnitTest(const BlockUnitTest& right) :
+        block(right.block) {
+    if (block) {
+        block->incRef();
+    }
+}
+
 bool IOBuffer::BlockUnitTest::exist() {
-    return !block.expired();
+    return block->refCount() > 1;
 }
 
 IOBuffer::BlockUnitTest IOBuffer::weakBlock(size_t i) {
     BlockUnitTest block;
-    block.block = _ref[_ref_offset + i].block;
+    block.block = _ref[i].block;
+    block.block->incRef();
     return block;
 };
+
+void setIOBufferMaxChainedBlocks(size_t num) {
+    s_max_chained_blocks.store(num, std::memory_order_relaxed);
+}
+
+void trimIOBufferThreadCache() {
+    s_tls_block_chain.clear();
+    BlockPool::trimLocal();
+}
+
+void trimIOBufferThreadCaches(bool idle_only) {
+    BlockPool::requestTrim(idle_only);
+    //Loop threads may wait for events for long, honour request at once
+    auto& schedule = Schedule::getInstance();
+    for (size_t i = 0; i < schedule.scheduleThreadSize(); ++i) {
+        schedule.runInLoop(i, []() {
+            honourTrimRequest();
+        });
+    }
+}
+
 }
@@ -6,36 +6,97 @@
 #define RPC_IO_BUFFER_REFINE_H
 
 #include <vector>
-#include <memory>
+#include <functional>
+#include <cstring>
 #include <sys/uio.h>
 #include <google/protobuf/io/zero_copy_stream.h>
 #include "common/common_defines.h"
+#include "common/block_pool.h"
 
 namespace antflash {
 
-struct Block;
-
 //IO buffer, not thread safe
 class IOBuffer {
 friend class IOBufferZeroCopyOutputStream;
 friend class IOBufferZeroCopyInputStream;
+friend class IOBufferReader;
+friend class IOBufferAppender;
 public:
     //IOBuffer with Slice, reference to Block. Slice memory allocation
     //is much smaller than Block, and several Slices shared one Block's
-    // reference with different offset and length.
+    // reference with different offset and length. Slice is POD, reference
+    //of block is managed by SliceQueue.
     struct Slice {
-        std::shared_ptr<Block> block;
+        Block* block;
         uint32_t offset;
         uint32_t length;
+    };
+
+    //Ring queue of slices, slices are stored inline when there are no more
+    //than INLINE_SLICE_SIZE slices, or else stored in heap whose capacity
+    //is always power of 2. Push and pop at both ends are O(1).
+    //Each slice in queue holds one reference of its block.
+    class SliceQueue {
+    public:
+        static constexpr uint32_t INLINE_SLICE_SIZE = 4;
+
+        SliceQueue() : _slots(_inline), _cap(INLINE_SLICE_SIZE),
+                       _begin(0), _size(0) {}
+        ~SliceQueue();
+        SliceQueue(const SliceQueue& right);
+        SliceQueue(SliceQueue&& right);
+        SliceQueue& operator=(const SliceQueue& right);
+        SliceQueue& operator=(SliceQueue&& right);
+
+        size_t size() const { return _size; }
+        bool empty() const { return _size == 0; }
+
+        Slice& operator[](size_t i) {
+            return _slots[(_begin + i) & (_cap - 1)];
+        }
+        const Slice& operator[](size_t i) const {
+            return _slots[(_begin + i) & (_cap - 1)];
+        }
+        Slice& front() { return _slots[_begin]; }
+        Slice& back() { return (*this)[_size - 1]; }
+
+        //Push slice and take over one reference of its block
+        void push_back(const Slice& slice) {
+            if (_size == _cap) {
+                grow();
+            }
+            (*this)[_size] = slice;
+            ++_size;
+        }
+
+        //Pop slice and give up its reference of block to caller
+        Slice take_front() {
+            Slice slice = _slots[_begin];
+            _begin = (_begin + 1) & (_cap - 1);
+            --_size;
+            return slice;
+        }
 
-        Slice() = default;
-        ~Slice() = default;
-        Slice(const Slice&) = default;
-        Slice& operator=(const Slice&) = default;
-        Slice(Slice&&) = default;
-        Slice& operator=(Slice&&) = default;
-        Slice(const std::shared_ptr<Block>& b, uint32_t o, uint32_t l) :
-                block(b), offset(o), length(l) {}
+        void pop_front() {
+            take_front().block->decRef();
+        }
+
+        void pop_back() {
+            back().block->decRef();
+            --_size;
+        }
+
+        void clear();
+
+    private:
+        void grow();
+        void moveFrom(SliceQueue& right);
+
+        Slice _inline[INLINE_SLICE_SIZE];
+        Slice* _slots;
+        uint32_t _cap;
+        uint32_t _begin;
+        uint32_t _size;
     };
 
     IOBuffer();
@@ -74,6 +135,11 @@ public:
 
     void append(const char *data);
 
+    //Append memory owned by user without copying, deleter is called with
+    //@data when no io buffer refers to it any more.
+    void append_user_data(void *data, size_t count,
+                          std::function<void(void*)> deleter);
+
     ssize_t append_from_file_descriptor(int fd, size_t max_size);
 
     size_t cut(IOBuffer *out, size_t n);
@@ -84,44 +150,157 @@ public:
 
     ssize_t cut_into_file_descriptor(int fd, size_t size_hint);
 
+    //Send data by sendmsg with MSG_ZEROCOPY, kernel refers to block memory
+    //directly, so data sent is cut into @pinned, which should be kept until
+    //kernel notifies completion from socket error queue.
+    ssize_t cut_into_file_descriptor_zero_copy(
+            int fd, size_t size_hint, IOBuffer* pinned);
+
     size_t copy_to(void *buf, size_t n) const;
 
     void clear() {
         _ref.clear();
-        _ref_offset = 0;
+        _length = 0;
     }
 
     bool empty() const {
-        return length() == 0;
+        return _length == 0;
     }
 
     size_t length() const {
-        size_t total_size = 0;
-        for (size_t i = _ref_offset; i < _ref.size(); ++i) {
-            total_size += _ref[i].length;
-        }
-        return total_size;
+        return _length;
     }
 
-    size_t size() const { return length(); }
+    size_t size() const { return _length; }
     inline size_t slice_num() const {
-        return _ref.size() - _ref_offset;
+        return _ref.size();
     }
     std::pair<const char*, size_t> slice(size_t i) const;
 
     /****** For  unit test begin *******/
     std::pair<const char*, size_t> block(size_t i) const;
     struct BlockUnitTest {
-        std::weak_ptr<Block> block;
+        Block* block;
+        BlockUnitTest() : block(nullptr) {}
+        ~BlockUnitTest();
+        BlockUnitTest(const BlockUnitTest& right);
+        BlockUnitTest& operator=(const BlockUnitTest&) = delete;
+        //Whether block is referenced by others except this
         bool exist();
     };
     BlockUnitTest weakBlock(size_t i);
     /****** For  unit test end *******/
 private:
-    void tryReleaseBlock();
+    size_t prepare_iovec(struct iovec* vec, size_t nref, size_t size_hint) const;
+
+    SliceQueue _ref;
+    size_t _length;
+};
+
+//Cursor to read io buffer without consuming it, io buffer should not be
+//modified during reading.
+class IOBufferReader {
+public:
+    explicit IOBufferReader(const IOBuffer& buf) :
+            _buf(&buf), _index(0), _offset(0), _position(0) {}
+
+    //Return pointer to @n contiguous bytes at cursor without moving cursor.
+    //If bytes are in one slice, pointer refers to block directly, or else
+    //bytes are copied to @tmp whose size should not be less than @n.
+    //Return nullptr if not enough data.
+    const void* fetch(void* tmp, size_t n) const;
+
+    //Copy @n bytes at cursor to @out and move cursor
+    bool read(void* out, size_t n);
+
+    //Assign @n bytes at cursor to @out and move cursor
+    bool read(std::string& out, size_t n);
+
+    bool readUint8(uint8_t& value) {
+        return read(&value, sizeof(value));
+    }
+
+    //Read big endian integers
+    bool readUint16(uint16_t& value);
+    bool readUint32(uint32_t& value);
+
+    //Return contiguous bytes left in current slice and move cursor to next slice.
+    bool next(const char** data, size_t* size);
+
+    size_t skip(size_t n);
+
+    //Bytes read from begin of io buffer
+    size_t position() const {
+        return _position;
+    }
+
+    size_t left() const {
+        return _buf->size() - _position;
+    }
+
+private:
+    const IOBuffer* _buf;
+    size_t _index;
+    size_t _offset;
+    size_t _position;
+};
+
+//Appender to write small pieces of data to tail of io buffer in batch.
+//Writable space of a thread-local block is reserved and filled through raw
+//pointers, and data is committed to io buffer as one slice when flushing,
+//so io buffer should not be modified by others before flush.
+class IOBufferAppender {
+public:
+    explicit IOBufferAppender(IOBuffer* buf) :
+            _buf(buf), _block(nullptr), _begin(0) {}
+
+    ~IOBufferAppender() {
+        flush();
+    }
+
+    IOBufferAppender(const IOBufferAppender&) = delete;
+    IOBufferAppender& operator=(const IOBufferAppender&) = delete;
+
+    //Return pointer to at least @n contiguous writable bytes, call commit
+    //with bytes actually written. Return nullptr if allocation fails.
+    char* reserve(size_t n) {
+        if (_block && _block->freeSpace() >= n) {
+            return _block->data + _block->size;
+        }
+        return reserveSlow(n);
+    }
+
+    //Written bytes should not be more than reserved ones
+    void commit(size_t n) {
+        _block->size += n;
+    }
+
+    void append(const void* data, size_t n);
+
+    void append(const std::string& data) {
+        append(data.data(), data.size());
+    }
+
+    void append(const char* data) {
+        append(data, strlen(data));
+    }
+
+    //Append integers in big endian
+    void appendUint16(uint16_t value);
+    void appendUint32(uint32_t value);
+
+    //Append integer as decimal string
+    void appendDecimal(int64_t value);
+
+    //Commit all written bytes to io buffer
+    void flush();
+
+private:
+    char* reserveSlow(size_t n);
 
-    std::vector<Slice> _ref;
-    size_t _ref_offset;
+    IOBuffer* _buf;
+    Block* _block;
+    uint32_t _begin;
 };
 
 class IOBufferZeroCopyInputStream
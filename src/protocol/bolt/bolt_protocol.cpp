@@ -4,10 +4,13 @@
 
 #include "bolt_protocol.h"
 #include <arpa/inet.h>
+#include <cstring>
+#include <limits>
 #include "protocol/bolt/bolt_request.h"
 #include "protocol/bolt/bolt_response.h"
 #include "common/io_buffer.h"
 #include "common/log.h"
+#include "common/macro.h"
 
 namespace antflash {
 namespace bolt {
@@ -76,20 +79,19 @@ private:
     std::shared_ptr<BoltRequest> _req;
 };
 
-static uint32_t appendBoltHeaderKV(
-        IOBuffer &buffer,
+static constexpr uint32_t boltHeaderKVSize(
+        uint32_t key_size, uint32_t value_size) {
+    return sizeof(uint32_t) * 2 + key_size + value_size;
+}
+
+static void appendBoltHeaderKV(
+        IOBufferAppender &appender,
         const char *key, uint32_t key_size,
         const char *value, uint32_t value_size) {
-    constexpr uint32_t KEY_VALUE_SIZE_BTYES = sizeof(uint32_t) * 2;
-
-    uint32_t key_size_network = htonl(key_size);
-    buffer.append(&key_size_network, sizeof(uint32_t));//key size
-    buffer.append(key, key_size);//key
-    uint32_t value_size_network = htonl(value_size);
-    buffer.append(&value_size_network, sizeof(uint32_t));//value size
-    buffer.append(value, value_size);
-
-    return KEY_VALUE_SIZE_BTYES + key_size + value_size;
+    appender.appendUint32(key_size);//key size
+    appender.append(key, key_size);//key
+    appender.appendUint32(value_size);//value size
+    appender.append(value, value_size);
 }
 
 bool BoltInternalRequest::serialize(IOBuffer& buffer) {
@@ -99,66 +101,101 @@ bool BoltInternalRequest::serialize(IOBuffer& buffer) {
         return true;
     }
 
-    IOBuffer buffer_body;
-
     //class name
     constexpr char class_name[] = "com.alipay.sofa.rpc.core.request.SofaRequest";
     constexpr uint32_t class_name_size = sizeof(class_name) - 1;
     _header.class_len = class_name_size;
-    buffer_body.append(class_name, class_name_size);
 
     //service
-    const char service_key[] = "service";
+    constexpr char service_key[] = "service";
     constexpr uint32_t service_key_size = sizeof(service_key) - 1;
-    _header.header_len += appendBoltHeaderKV(
-            buffer_body,
-            service_key, service_key_size,
-            _request._service.data(),
-            _request._service.size());
-
     //header
-    const char sofa_service_key[] = "sofa_head_target_service";
+    constexpr char sofa_service_key[] = "sofa_head_target_service";
     constexpr uint32_t sofa_service_key_size = sizeof(sofa_service_key) - 1;
-    _header.header_len += appendBoltHeaderKV(
-            buffer_body, sofa_service_key, sofa_service_key_size,
-            _request._service.data(),
-            _request._service.size());
-
     constexpr char method_key[] = "sofa_head_method_name";
     constexpr uint32_t method_key_size = sizeof(method_key) - 1;
-    _header.header_len += appendBoltHeaderKV(
-            buffer_body, method_key, method_key_size,
-            _request._method.data(),
-            _request._method.size());
-
     constexpr char trace_id_key[] = "rpc_trace_context.sofaTraceId";
     constexpr uint32_t trace_id_key_size = sizeof(trace_id_key) - 1;
-    _header.header_len += appendBoltHeaderKV(
-            buffer_body, trace_id_key, trace_id_key_size,
-            _request._trace_id.data(),
-            _request._trace_id.size());
 
+    _header.header_len =
+            boltHeaderKVSize(service_key_size, _request._service.size())
+            + boltHeaderKVSize(sofa_service_key_size, _request._service.size())
+            + boltHeaderKVSize(method_key_size, _request._method.size())
+            + boltHeaderKVSize(trace_id_key_size, _request._trace_id.size());
+
+    //Size of content is calculated before writing, so that header is
+    //written first and content is serialized into one contiguous space.
+    const google::protobuf::Message* proto = nullptr;
+    const char* content = nullptr;
     if (_request._data_type == BoltRequest::EDataType::PROTOBUF
         && _request._data.proto) {
-        //TODO compress if needed
-        IOBufferZeroCopyOutputStream wrapper(&buffer_body);
-        _request._data.proto->SerializeToZeroCopyStream(&wrapper);
-        _header.content_len = buffer_body.size()
-                              - _header.class_len - _header.header_len;
+        proto = _request._data.proto;
+        if (!proto->IsInitialized()) {
+            LOG_ERROR("protobuf content missing required fields: {}",
+                      proto->InitializationErrorString());
+            return false;
+        }
+        auto size = proto->ByteSizeLong();
+        if (size > std::numeric_limits<uint32_t>::max()) {
+            LOG_ERROR("protobuf content is too large: {}", size);
+            return false;
+        }
+        _header.content_len = size;
     } else if (_request._data_type == BoltRequest::EDataType::STRING
                && _request._data.str) {
+        content = _request._data.str->data();
         _header.content_len = _request._data.str->length();
-        buffer_body.append(_request._data.str->data(),
-                           _request._data.str->length());
     } else if (_request._data_type == BoltRequest::EDataType::CSTRING
                && _request._data.c_str) {
+        content = _request._data.c_str;
         _header.content_len = strlen(_request._data.c_str);
-        buffer.append(_request._data.c_str);
+    } else if (_request._data_type == BoltRequest::EDataType::USER_DATA
+               && _request._user_data) {
+        _header.content_len = _request._user_data->size();
     }
+    const uint32_t content_len = _header.content_len;
 
+    IOBufferAppender appender(&buffer);
     _header.hton();
-    buffer.append((void*)&_header, sizeof(_header));
-    buffer.append(std::move(buffer_body));
+    appender.append(&_header, sizeof(_header));
+    appender.append(class_name, class_name_size);
+    appendBoltHeaderKV(
+            appender,
+            service_key, service_key_size,
+            _request._service.data(),
+            _request._service.size());
+    appendBoltHeaderKV(
+            appender, sofa_service_key, sofa_service_key_size,
+            _request._service.data(),
+            _request._service.size());
+    appendBoltHeaderKV(
+            appender, method_key, method_key_size,
+            _request._method.data(),
+            _request._method.size());
+    appendBoltHeaderKV(
+            appender, trace_id_key, trace_id_key_size,
+            _request._trace_id.data(),
+            _request._trace_id.size());
+
+    if (proto) {
+        //TODO compress if needed
+        //Large message is serialized into a dedicated block
+        auto data = appender.reserve(content_len);
+        if (UNLIKELY(nullptr == data)) {
+            LOG_ERROR("reserve {} bytes for protobuf content fail", content_len);
+            return false;
+        }
+        proto->SerializeWithCachedSizesToArray(
+                reinterpret_cast<google::protobuf::uint8*>(data));
+        appender.commit(content_len);
+    } else if (content) {
+        appender.append(content, content_len);
+    } else if (_request._data_type == BoltRequest::EDataType::USER_DATA
+               && _request._user_data) {
+        //Only share blocks of user data, request can be sent again
+        appender.flush();
+        buffer.append(*_request._user_data);
+    }
 
     return true;
 }
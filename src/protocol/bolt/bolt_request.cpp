@@ -0,0 +1,17 @@
+// Copyright (c) 2018 Ant Financial, Inc. All Rights Reserved
+//
+
+#include "protocol/bolt/bolt_request.h"
+#include "common/io_buffer.h"
+
+namespace antflash {
+
+BoltRequest& BoltRequest::data(void* data, size_t size,
+                               std::function<void(void*)> deleter) {
+    _user_data.reset(new IOBuffer);
+    _user_data->append_user_data(data, size, std::move(deleter));
+    _data_type = EDataType::USER_DATA;
+    return *this;
+}
+
+}
@@ -45,8 +45,8 @@ const std::string& BoltResponse::msg() const {
 }
 
 EResParseResult BoltResponse::deserialize(IOBuffer &buffer) noexcept {
-    auto cn = buffer.cut(&_header, sizeof(BoltHeader));
-    if (cn < sizeof(BoltHeader)) {
+    IOBufferReader reader(buffer);
+    if (!reader.read(&_header, sizeof(BoltHeader))) {
         LOG_ERROR("not enough data for header");
         return EResParseResult::PARSE_NOT_ENOUGH_DATA;
     }
@@ -55,21 +55,25 @@ EResParseResult BoltResponse::deserialize(IOBuffer &buffer) noexcept {
 
     if (_header.proto != BOLT_PROTOCOL_TYPE) {
         LOG_ERROR("proto type is {}, not {}", _header.proto, BOLT_PROTOCOL_TYPE);
+        buffer.pop_front(reader.position());
         return EResParseResult::PARSE_ERROR;
     }
 
     if (_header.type != BOLT_PROTOCOL_RESPONSE) {
         LOG_ERROR("message type is {}, not {}", _header.type, BOLT_PROTOCOL_RESPONSE);
+        buffer.pop_front(reader.position());
         return EResParseResult::PARSE_ERROR;
     }
 
     if (_header.cmdcode == BOLT_PROTOCOL_CMD_HEARTBEAT) {
         LOG_DEBUG("heartbeat received");
+        buffer.pop_front(reader.position());
         return EResParseResult::PARSE_OK;
     }
 
     if (_header.cmdcode != BOLT_PROTOCOL_CMD_RESPONSE) {
         LOG_ERROR("protocol cmd {}, not {}", (int)_header.cmdcode, BOLT_PROTOCOL_CMD_RESPONSE);
+        buffer.pop_front(reader.position());
         return EResParseResult::PARSE_ERROR;
     }
 
@@ -79,14 +83,12 @@ EResParseResult BoltResponse::deserialize(IOBuffer &buffer) noexcept {
         auto data_size = _header.class_len
                          + _header.header_len
                          + _header.content_len;
-        buffer.pop_front(data_size);
+        buffer.pop_front(reader.position() + data_size);
 
         return EResParseResult::PARSE_OK;
     }
 
-    _class_name.resize(_header.class_len);
-    cn = buffer.cut(&_class_name[0], _header.class_len);
-    if (cn < _header.class_len) {
+    if (!reader.read(_class_name, _header.class_len)) {
         LOG_ERROR("parse class name fail");
         return EResParseResult::PARSE_NOT_ENOUGH_DATA;
     }
@@ -95,55 +97,43 @@ EResParseResult BoltResponse::deserialize(IOBuffer &buffer) noexcept {
     while (left_size > 0) {
         std::string key_str;
         uint32_t header_key_size = 0;
-        cn = buffer.cut(&header_key_size, sizeof(uint32_t));
-        if (cn < sizeof(uint32_t)) {
+        if (!reader.readUint32(header_key_size)) {
             LOG_ERROR("parse header key size fail");
             return EResParseResult::PARSE_NOT_ENOUGH_DATA;
         }
-        header_key_size = ntohl(header_key_size);
         left_size -= sizeof(uint32_t);
 
-        if (header_key_size > 0) {
-            key_str.resize(header_key_size);
-            cn = buffer.cut(&key_str[0], header_key_size);
-            if (cn < header_key_size) {
-                LOG_ERROR("parse header key name fail");
-                return EResParseResult::PARSE_NOT_ENOUGH_DATA;
-            }
-            left_size -= header_key_size;
+        if (!reader.read(key_str, header_key_size)) {
+            LOG_ERROR("parse header key name fail");
+            return EResParseResult::PARSE_NOT_ENOUGH_DATA;
         }
+        left_size -= header_key_size;
 
         uint32_t header_value_size = 0;
         std::string value_str;
-        cn = buffer.cut(&header_value_size, sizeof(uint32_t));
-        if (cn < sizeof(uint32_t)) {
+        if (!reader.readUint32(header_value_size)) {
             LOG_ERROR("parse header value size fail");
             return EResParseResult::PARSE_NOT_ENOUGH_DATA;
         }
-        header_value_size = ntohl(header_value_size);
         left_size -= sizeof(uint32_t);
 
-        if (header_value_size > 0) {
-            value_str.resize(header_value_size);
-            cn = buffer.cut(&value_str[0], header_value_size);
-            if (cn < header_value_size) {
-                LOG_ERROR("parse header value name fail");
-                return EResParseResult::PARSE_NOT_ENOUGH_DATA;
-            }
-            left_size -= header_value_size;
+        if (!reader.read(value_str, header_value_size)) {
+            LOG_ERROR("parse header value name fail");
+            return EResParseResult::PARSE_NOT_ENOUGH_DATA;
         }
+        left_size -= header_value_size;
+
         _header_map.emplace(std::move(key_str), std::move(value_str));
     }
 
     if (_header.content_len > 0) {
         if (_data_type == EDataType::STRING) {
-            _data.str->resize(_header.content_len);
-            cn = buffer.cut(&(*_data.str)[0], _header.content_len);
-            if (cn < _header.content_len) {
+            if (!reader.read(*_data.str, _header.content_len)) {
                 LOG_ERROR("parse string content fail");
                 return EResParseResult::PARSE_NOT_ENOUGH_DATA;
             }
         } else if (_data_type == EDataType::PROTOBUF) {
+            buffer.pop_front(reader.position());
             IOBufferZeroCopyInputStream stream(buffer);
             google::protobuf::io::ZeroCopyInputStream *input = &stream;
             google::protobuf::io::CodedInputStream decoder(input);
@@ -157,9 +147,11 @@ EResParseResult BoltResponse::deserialize(IOBuffer &buffer) noexcept {
                 return EResParseResult::PARSE_ERROR;
             }
             buffer.pop_front(_header.content_len);
+            return EResParseResult::PARSE_OK;
         }
     }
 
+    buffer.pop_front(reader.position());
     return EResParseResult::PARSE_OK;
 }
 
@@ -169,20 +161,22 @@ EResParseResult BoltResponse::checkHeader(
         size_t& request_id) {
     constexpr size_t MAX_BOLT_BODY_SIZE = 64 * 1024 * 1024;
 
-    BoltHeader header;
-    auto cn = buffer.copy_to(&header, sizeof(BoltHeader));
-    header.ntoh();
-
-    if (cn < sizeof(BoltHeader)) {
+    BoltHeader tmp;
+    IOBufferReader reader(buffer);
+    auto header = static_cast<const BoltHeader*>(
+            reader.fetch(&tmp, sizeof(BoltHeader)));
+    if (nullptr == header) {
         return EResParseResult::PARSE_NOT_ENOUGH_DATA;
     }
 
-    request_id = header.request_id;
-    data_size = header.class_len + header.header_len + header.content_len;
+    request_id = ntohl(header->request_id);
+    data_size = (size_t)ntohs(header->class_len)
+                + ntohs(header->header_len)
+                + ntohl(header->content_len);
     if (data_size > MAX_BOLT_BODY_SIZE) {
         return EResParseResult::PARSE_ERROR;
     }
-    data_size += sizeof(header);
+    data_size += sizeof(BoltHeader);
     if (data_size > buffer.size()) {
         return EResParseResult::PARSE_NOT_ENOUGH_DATA;
     }
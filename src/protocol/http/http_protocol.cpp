@@ -4,7 +4,6 @@
 
 #include "http_protocol.h"
 #include <unordered_map>
-#include <sstream>
 #include "common/io_buffer.h"
 #include "common/log.h"
 #include "protocol/http/http_request.h"
@@ -32,9 +31,7 @@ class HttpInternalRequest {
 public:
     HttpInternalRequest(const HttpRequest& request, size_t request_id) :
             _request(request) {
-        std::stringstream ss;
-        ss << request_id;
-        _header.setHeader(LOG_ID, ss.str());
+        _header.setHeader(LOG_ID, std::to_string(request_id));
         _header.setHeader(CONNECTION, "keep-alive");
     }
 
@@ -48,38 +45,51 @@ bool HttpInternalRequest::serialize(antflash::IOBuffer& buffer) {
 
     static const char* s_http_line_end = "\r\n";
 
-    std::stringstream http_ss;
-    http_ss << HttpHeader::getMethod(_request._method) << " ";
-    http_ss << _request._uri.path();
-    http_ss << " HTTP/1.1"<< s_http_line_end;
+    IOBufferAppender appender(&buffer);
+    appender.append(HttpHeader::getMethod(_request._method));
+    appender.append(" ");
+    appender.append(_request._uri.path());
+    appender.append(" HTTP/1.1");
+    appender.append(s_http_line_end);
     if (_request._method != EHttpMethod::HTTP_METHOD_GET) {
-        http_ss << "Content-Length: " << _request.attach_size() << s_http_line_end;
+        appender.append("Content-Length: ");
+        appender.appendDecimal(_request.attach_size());
+        appender.append(s_http_line_end);
     }
     if (!_request._attch_type.empty()) {
-        http_ss << "Content-Type: " << _request._attch_type << s_http_line_end;
+        appender.append("Content-Type: ");
+        appender.append(_request._attch_type);
+        appender.append(s_http_line_end);
     }
 
-    http_ss << "Host: " << _request._uri.host()
-            << ":" << _request._uri.port() << s_http_line_end;
-    http_ss << "Accept: */*" << s_http_line_end;
-    http_ss << "User-Agent: curl/7.0" << s_http_line_end;
+    appender.append("Host: ");
+    appender.append(_request._uri.host());
+    appender.append(":");
+    appender.appendDecimal(_request._uri.port());
+    appender.append(s_http_line_end);
+    appender.append("Accept: */*");
+    appender.append(s_http_line_end);
+    appender.append("User-Agent: curl/7.0");
+    appender.append(s_http_line_end);
 
     for (auto& p : _header._header_map) {
-        http_ss << HttpHeader::getHeaderKey((EHttpHeaderKey)p.first)
-                << ": " << p.second << s_http_line_end;
+        appender.append(HttpHeader::getHeaderKey((EHttpHeaderKey)p.first));
+        appender.append(": ");
+        appender.append(p.second);
+        appender.append(s_http_line_end);
     }
 
-    http_ss << s_http_line_end;
+    appender.append(s_http_line_end);
+    appender.flush();
 
-    buffer.append(http_ss.str());
+    LOG_DEBUG("http request:{} {}",
+              HttpHeader::getMethod(_request._method), _request._uri.path());
 
     if (_request._data) {
-        //FIXME copy iobuffer after refine iobuffer
-        buffer.append(std::move(*_request._data));
+        //Only share blocks of attach data, request can be sent again
+        buffer.append(*_request._data);
     }
 
-    LOG_INFO("http info:\n{}", buffer.to_string());
-
     return true;
 }
 
@@ -22,6 +22,13 @@ HttpRequest& HttpRequest::attach(const char* data) {
     return *this;
 }
 
+HttpRequest& HttpRequest::attach(void* data, size_t size,
+                                 std::function<void(void*)> deleter) {
+    _data.reset(new IOBuffer);
+    _data->append_user_data(data, size, std::move(deleter));
+    return *this;
+}
+
 std::shared_ptr<IOBuffer> HttpRequest::attach() const {
     return _data;
 }
@@ -100,11 +100,12 @@ int HttpResponse::onHeaderValue(
         }
     }
 
-    std::string value(data, size);
-    auto itr = msg->header.emplace(msg->cur_header, value);
-    if (!itr.second) {
-        itr.first->second.append(",");
-        itr.first->second.append(value);
+    auto itr = msg->header.find(msg->cur_header);
+    if (itr == msg->header.end()) {
+        msg->header.emplace(msg->cur_header, std::string(data, size));
+    } else {
+        itr->second.append(",");
+        itr->second.append(data, size);
     }
 
     return 0;
@@ -193,13 +194,14 @@ EResParseResult HttpResponse::checkHeader(
         parser->data = info;
     }
 
+    IOBufferReader reader(buffer);
+    const char* data = nullptr;
+    size_t size = 0;
     size_t nr = 0;
-    for (size_t i = 0; i < buffer.slice_num(); ++i) {
-        auto data = buffer.slice(i);
-        if (data.second > 0) {
+    while (reader.next(&data, &size)) {
+        if (size > 0) {
             nr += http_parser_execute(
-                    parser, &g_parser_settings,
-                    data.first, data.second);
+                    parser, &g_parser_settings, data, size);
             if (parser->http_errno != 0) {
                 //FIXME http parse fail handle
                 LOG_ERROR("http parse error:{}", (int)parser->http_errno);
@@ -5,25 +5,37 @@
 #include "loop.h"
 #include <sys/epoll.h>
 #include <errno.h>
+#include <functional>
+#include <vector>
 #include "common/common_defines.h"
+#include "common/utils.h"
 
 namespace antflash {
 
 using ScheduleHandler = std::function<void()>;
 
-struct LoopInternalData {
-    struct epoll_event events[MAX_POLL_EVENT];
-};
-
-Loop::Loop() {
+class EpollLoop final : public Loop {
+public:
+    bool init() override;
+    void destroy() override;
+    int loop_once(int timeout_ms) override;
 
-}
+    bool add_event(int fd, int events, void* handler) override;
+    bool modify_event(int fd, int events, void* handler) override;
+    void remove_event(int fd, int events) override;
 
-Loop::~Loop() {
+private:
+    base::FdGuard _backend_fd;
+    std::vector<struct epoll_event> _events;
+};
 
+Loop* Loop::create(const LoopOptions& options) {
+    Loop* loop = new EpollLoop;
+    loop->set_max_poll_batch(options.max_poll_events);
+    return loop;
 }
 
-bool Loop::init() {
+bool EpollLoop::init() {
     _backend_fd = epoll_create(1024*1024);
 
 
@@ -35,32 +47,42 @@ bool Loop::init() {
         return false;
     }
 
-    _data.reset(new LoopInternalData);
     return true;
 }
 
-void Loop::destroy() {
+void EpollLoop::destroy() {
 
 }
 
-void Loop::loop_once() {
-    auto actives = epoll_wait(_backend_fd.fd(), _data->events, MAX_POLL_EVENT, -1);
+int EpollLoop::loop_once(int timeout_ms) {
+    auto batch = poll_batch();
+    if (_events.size() < batch) {
+        _events.resize(batch);
+    }
+    auto actives = epoll_wait(_backend_fd.fd(), _events.data(),
+                             batch, timeout_ms);
 
-    if (actives == -1 && errno != EINTR) {
-        //ERROR
-        return;
+    if (actives == -1) {
+        //ERROR if not EINTR
+        return 0;
+    }
+    if (actives > 0) {
+        _wake_us = Utils::getSteadyTimeStampMicro();
     }
 
     for (auto i = 0; i < actives; ++i) {
-        struct epoll_event& ke = _data->events[i];
+        struct epoll_event& ke = _events[i];
         if (ke.data.ptr) {
             auto handler = static_cast<ScheduleHandler*>(ke.data.ptr);
             (*handler)();
         }
     }
+
+    grow_poll_batch(actives);
+    return actives;
 }
 
-bool Loop::add_event(int fd, int events, void* handler) {
+bool EpollLoop::add_event(int fd, int events, void* handler) {
     struct epoll_event ev;
     memset(&ev, 0, sizeof(ev));
     ev.events = events | EPOLLET;
@@ -69,7 +91,16 @@ bool Loop::add_event(int fd, int events, void* handler) {
     return 0 == epoll_ctl(_backend_fd.fd(), EPOLL_CTL_ADD, fd, &ev);
 }
 
-void Loop::remove_event(int fd, int events) {
+bool EpollLoop::modify_event(int fd, int events, void* handler) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events | EPOLLET;
+    ev.data.ptr = handler;
+
+    return 0 == epoll_ctl(_backend_fd.fd(), EPOLL_CTL_MOD, fd, &ev);
+}
+
+void EpollLoop::remove_event(int fd, int events) {
     struct epoll_event ev;
     memset(&ev, 0, sizeof(ev));
     ev.events = events | EPOLLET;
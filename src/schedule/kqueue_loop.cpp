@@ -9,25 +9,36 @@
 #include <sys/time.h>
 #include <poll.h>
 #include <errno.h>
+#include <vector>
 #include "common/common_defines.h"
+#include "common/utils.h"
 
 namespace antflash {
 
 using ScheduleHandler = std::function<void()>;
 
-struct LoopInternalData {
-    struct kevent events[MAX_POLL_EVENT];
-};
-
-Loop::Loop() {
+class KqueueLoop final : public Loop {
+public:
+    bool init() override;
+    void destroy() override;
+    int loop_once(int timeout_ms) override;
 
-}
+    bool add_event(int fd, int events, void* handler) override;
+    bool modify_event(int fd, int events, void* handler) override;
+    void remove_event(int fd, int events) override;
 
-Loop::~Loop() {
+private:
+    base::FdGuard _backend_fd;
+    std::vector<struct kevent> _events;
+};
 
+Loop* Loop::create(const LoopOptions& options) {
+    Loop* loop = new KqueueLoop;
+    loop->set_max_poll_batch(options.max_poll_events);
+    return loop;
 }
 
-bool Loop::init() {
+bool KqueueLoop::init() {
     _backend_fd = kqueue();
 
     if (_backend_fd.fd() == -1) {
@@ -38,32 +49,45 @@ bool Loop::init() {
         return false;
     }
 
-    _data.reset(new LoopInternalData);
     return true;
 }
 
-void Loop::destroy() {
+void KqueueLoop::destroy() {
 
 }
 
-void Loop::loop_once() {
-    auto actives = kevent(_backend_fd.fd(), nullptr, 0, _data->events, MAX_POLL_EVENT, nullptr);
+int KqueueLoop::loop_once(int timeout_ms) {
+    struct timespec timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000;
+    auto batch = poll_batch();
+    if (_events.size() < batch) {
+        _events.resize(batch);
+    }
+    auto actives = kevent(_backend_fd.fd(), nullptr, 0, _events.data(), batch,
+                          timeout_ms < 0 ? nullptr : &timeout);
 
-    if (actives == -1 && errno != EINTR) {
-        //ERROR
-        return;
+    if (actives == -1) {
+        //ERROR if not EINTR
+        return 0;
+    }
+    if (actives > 0) {
+        _wake_us = Utils::getSteadyTimeStampMicro();
     }
 
     for (auto i = 0; i < actives; ++i) {
-        struct kevent& ke = _data->events[i];
+        struct kevent& ke = _events[i];
         if (ke.udata) {
             auto handler = static_cast<ScheduleHandler*>(ke.udata);
             (*handler)();
         }
     }
+
+    grow_poll_batch(actives);
+    return actives;
 }
 
-bool Loop::add_event(int fd, int events, void* handler) {
+bool KqueueLoop::add_event(int fd, int events, void* handler) {
     struct timespec immediatelly;
     immediatelly.tv_nsec = 0;
     immediatelly.tv_sec = 0;
@@ -79,7 +103,23 @@ bool Loop::add_event(int fd, int events, void* handler) {
     return 0 == kevent(_backend_fd.fd(), ev, n, nullptr, 0, &immediatelly);
 }
 
-void Loop::remove_event(int fd, int events) {
+bool KqueueLoop::modify_event(int fd, int events, void* handler) {
+    struct timespec immediatelly;
+    immediatelly.tv_nsec = 0;
+    immediatelly.tv_sec = 0;
+    struct kevent ev[2];
+    //Filter not in events is kept but disabled
+    EV_SET(&ev[0], fd, EVFILT_READ,
+           (events & POLLIN) ? EV_ADD|EV_ENABLE|EV_CLEAR : EV_ADD|EV_DISABLE,
+           0, 0, handler);
+    EV_SET(&ev[1], fd, EVFILT_WRITE,
+           (events & POLLOUT) ? EV_ADD|EV_ENABLE|EV_CLEAR : EV_ADD|EV_DISABLE,
+           0, 0, handler);
+
+    return 0 == kevent(_backend_fd.fd(), ev, 2, nullptr, 0, &immediatelly);
+}
+
+void KqueueLoop::remove_event(int fd, int events) {
     struct timespec immediatelly;
     immediatelly.tv_nsec = 0;
     immediatelly.tv_sec = 0;
@@ -6,27 +6,66 @@
 #define RPC_SCHEDULE_LOOP_H
 
 #include "tcp/socket_base.h"
+#include "common/common_defines.h"
 #include <memory>
+#include <atomic>
+#include <algorithm>
 
 namespace antflash {
 
-struct LoopInternalData;
-
 class Loop {
 public:
-    Loop();
-    ~Loop();
+    Loop() : _wake_us(0), _poll_batch(MAX_POLL_EVENT),
+             _max_poll_batch(MAX_POLL_EVENT) {}
+    virtual ~Loop() {}
+
+    //Create loop of system, epoll on linux and kqueue on mac os
+    static Loop* create(const LoopOptions& options);
+
+    virtual bool init() = 0;
+    virtual void destroy() = 0;
+    //Wait events for at most timeout_ms and handle them, 0 returns at once
+    //and -1 waits until any event, return number of events handled
+    virtual int loop_once(int timeout_ms) = 0;
+
+    virtual bool add_event(int fd, int events, void* handler) = 0;
+    //Replace events of fd which is already added
+    virtual bool modify_event(int fd, int events, void* handler) = 0;
+    virtual void remove_event(int fd, int events) = 0;
+
+    //Steady time in microseconds when last poll returned with events
+    size_t wake_us() const {
+        return _wake_us;
+    }
+
+    //Max events handled in one loop_once now
+    size_t poll_batch() const {
+        return _poll_batch.load(std::memory_order_relaxed);
+    }
+
+protected:
+    void set_max_poll_batch(size_t max_batch) {
+        _max_poll_batch = std::max(max_batch, (size_t)1);
+        _poll_batch.store(std::min((size_t)MAX_POLL_EVENT, _max_poll_batch),
+                          std::memory_order_relaxed);
+    }
 
-    bool init();
-    void destroy();
-    void loop_once();
+    //Double poll batch up to max if poll came back full, so that a burst over
+    //many sockets is handled by fewer polls
+    void grow_poll_batch(size_t actives) {
+        auto batch = _poll_batch.load(std::memory_order_relaxed);
+        if (actives >= batch && batch < _max_poll_batch) {
+            _poll_batch.store(std::min(batch * 2, _max_poll_batch),
+                              std::memory_order_relaxed);
+        }
+    }
 
-    bool add_event(int fd, int events, void* handler);
-    void remove_event(int fd, int events);
+    size_t _wake_us;
 
 private:
-    base::FdGuard _backend_fd;
-    std::unique_ptr<LoopInternalData> _data;
+    //Written by loop thread only
+    std::atomic<size_t> _poll_batch;
+    size_t _max_poll_batch;
 };
 
 }
@@ -4,20 +4,70 @@
 
 #include "loop_thread.h"
 #include <functional>
+#include <algorithm>
 #include <poll.h>
+#if defined(OS_LINUX)
+#include <sys/eventfd.h>
+#endif
 #include "loop.h"
 #include "common/log.h"
+#include "common/utils.h"
 
 namespace antflash {
 
-LoopThread::LoopThread() : _exit(false) {
+static thread_local LoopThread* s_current_loop = nullptr;
+
+struct LoopThread::LoopTask {
+    std::function<void()> fn;
+
+    LoopTask(std::function<void()>&& f) : fn(std::move(f)) {}
+};
+
+//Counter written by loop thread only, no need to use atomic read-modify-write
+static inline void increase(std::atomic<size_t>& counter, size_t n) {
+    counter.store(counter.load(std::memory_order_relaxed) + n,
+                  std::memory_order_relaxed);
+}
+
+void LoopHistogram::add(size_t value) {
+    size_t idx = 0;
+    if (value > 0) {
+        idx = std::min((size_t)(64 - __builtin_clzll(value)),
+                       LOOP_HISTOGRAM_BUCKETS - 1);
+    }
+    increase(_buckets[idx], 1);
+}
+
+void LoopHistogram::copy_to(size_t (&buckets)[LOOP_HISTOGRAM_BUCKETS]) const {
+    for (size_t i = 0; i < LOOP_HISTOGRAM_BUCKETS; ++i) {
+        buckets[i] = _buckets[i].load(std::memory_order_relaxed);
+    }
+}
+
+LoopThread::LoopThread() : _exit(false), _woken(false), _cpu(-1), _numa_node(-1),
+    _spin_us(0), _handle_us(0), _events(0), _spin_hits(0), _sleeps(0),
+    _last_handled_us(0),
+    _read_bytes(0), _sockets(0), _migrated_in(0), _migrated_out(0),
+    _sample_us(0), _sample_events(0), _sample_bytes(0),
+    _events_per_sec(0), _bytes_per_sec(0) {
 }
 
 LoopThread::~LoopThread() {
+    if (_tasks) {
+        LoopTask* task = nullptr;
+        while (_tasks->pop(task)) {
+            delete task;
+        }
+    }
 }
 
 
-LoopThread::LoopThread(LoopThread&& right) {
+LoopThread::LoopThread(LoopThread&& right) : _woken(false), _cpu(-1), _numa_node(-1),
+    _spin_us(0), _handle_us(0), _events(0), _spin_hits(0), _sleeps(0),
+    _last_handled_us(0),
+    _read_bytes(0), _sockets(0), _migrated_in(0), _migrated_out(0),
+    _sample_us(0), _sample_events(0), _sample_bytes(0),
+    _events_per_sec(0), _bytes_per_sec(0) {
     _thread = std::move(right._thread);
     _exit.store(right._exit.load());
     right._exit.store(false);
@@ -33,7 +83,15 @@ LoopThread& LoopThread::operator=(LoopThread&& right) {
     return *this;
 }
 
-bool LoopThread::start() {
+bool LoopThread::start(const LoopOptions& options, int cpu) {
+    _options = options;
+    _cpu = cpu;
+#if defined(OS_LINUX)
+    _wakeup_fds[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_wakeup_fds[0].fd() < 0) {
+        return false;
+    }
+#else
     int wakeup_fd[2];
     wakeup_fd[0] = -1;
     wakeup_fd[1] = -1;
@@ -42,22 +100,54 @@ bool LoopThread::start() {
     }
     _wakeup_fds[0] = wakeup_fd[0];
     _wakeup_fds[1] = wakeup_fd[1];
+    base::set_non_blocking(wakeup_fd[0]);
+    base::set_non_blocking(wakeup_fd[1]);
+#endif
+    _tasks.reset(new MPSCQueue<LoopTask*>(LOOP_TASK_QUEUE_SIZE));
+    _on_wakeup = [this]() {
+        //Only clear readiness of fd, tasks are run after all events
+        uint64_t buf[64];
+        while (read(_wakeup_fds[0].fd(), buf, sizeof(buf)) > 0) {
+        }
+    };
 
     std::promise<bool> thread_ok;
     _thread.reset(new std::thread([this, &thread_ok](){
+        s_current_loop = this;
+        if (_cpu >= 0) {
+            if (Utils::setThreadAffinity({_cpu})) {
+                _numa_node = Utils::getCpuNumaNode(_cpu);
+            } else {
+                LOG_ERROR("pin loop thread to cpu {} fail", _cpu);
+                _cpu = -1;
+            }
+        }
         try {
-            _loop.reset(new Loop());
-            if (!_loop->init()) {
+            _loop.reset(Loop::create(_options));
+            if (!_loop || !_loop->init()
+                || !_loop->add_event(_wakeup_fds[0].fd(), POLLIN, &_on_wakeup)) {
                 thread_ok.set_value(false);
                 return;
             }
 
             thread_ok.set_value(true);
 
-            while (!_exit.load(std::memory_order_acquire)) {
-                _loop->loop_once();
+            _last_handled_us = Utils::getSteadyTimeStampMicro();
+            if (_options.busy_poll_us > 0) {
+                busy_poll();
+            } else {
+                while (!_exit.load(std::memory_order_acquire)) {
+                    auto n = _loop->loop_once(-1);
+                    run_tasks();
+                    increase(_events, n);
+                    if (n > 0) {
+                        record_iteration(n, Utils::getSteadyTimeStampMicro());
+                    }
+                }
             }
 
+            //Tasks posted before stopping are still run in loop thread
+            run_tasks();
             _loop->destroy();
         } catch (const std::exception& ex) {
             thread_ok.set_exception(std::make_exception_ptr(ex));
@@ -67,23 +157,184 @@ bool LoopThread::start() {
     return thread_ok.get_future().get();
 }
 
+bool LoopThread::in_loop_thread() {
+    return s_current_loop != nullptr;
+}
+
+void LoopThread::count_read_bytes(size_t n) {
+    if (s_current_loop) {
+        increase(s_current_loop->_read_bytes, n);
+    }
+}
+
+void LoopThread::attach_socket(bool migrated) {
+    _sockets.fetch_add(1, std::memory_order_relaxed);
+    if (migrated) {
+        _migrated_in.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void LoopThread::detach_socket(bool migrated) {
+    _sockets.fetch_sub(1, std::memory_order_relaxed);
+    if (migrated) {
+        _migrated_out.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void LoopThread::sample_load(size_t now_us) {
+    auto events = _events.load(std::memory_order_relaxed);
+    auto bytes = _read_bytes.load(std::memory_order_relaxed);
+    if (_sample_us > 0 && now_us > _sample_us) {
+        auto period = now_us - _sample_us;
+        _events_per_sec = (events - _sample_events) * 1000000UL / period;
+        _bytes_per_sec = (bytes - _sample_bytes) * 1000000UL / period;
+    }
+    _sample_us = now_us;
+    _sample_events = events;
+    _sample_bytes = bytes;
+}
+
+LoopLoad LoopThread::load() const {
+    LoopLoad load;
+    load.sockets = _sockets.load(std::memory_order_relaxed);
+    load.events_per_sec = _events_per_sec;
+    load.bytes_per_sec = _bytes_per_sec;
+    load.migrated_in = _migrated_in.load(std::memory_order_relaxed);
+    load.migrated_out = _migrated_out.load(std::memory_order_relaxed);
+    load.poll_batch = _loop ? _loop->poll_batch() : 0;
+    _wakeup_events.copy_to(load.wakeup_events);
+    _iteration_handle_us.copy_to(load.handle_us);
+    _idle_us.copy_to(load.idle_us);
+    return load;
+}
+
 void LoopThread::stop() {
     //memory barrier
     _exit.store(true, std::memory_order_release);
+    if (!_thread) {
+        return;
+    }
     //wakeup loop
-    add_event(_wakeup_fds[1].fd(), POLLOUT, nullptr);
+    wakeup();
 
-    if (_thread && _thread->joinable()) {
+    if (_thread->joinable()) {
         _thread->join();
     }
 }
 
+bool LoopThread::run_in_loop(std::function<void()> task) {
+    if (!_tasks || _exit.load(std::memory_order_acquire)) {
+        return false;
+    }
+    auto loop_task = new LoopTask(std::move(task));
+    if (!_tasks->push(loop_task)) {
+        LOG_ERROR("too many tasks pending in loop thread");
+        delete loop_task;
+        return false;
+    }
+    //Write fd only once until loop thread runs tasks
+    if (!_woken.exchange(true, std::memory_order_seq_cst)) {
+        wakeup();
+    }
+    return true;
+}
+
+void LoopThread::wakeup() {
+#if defined(OS_LINUX)
+    uint64_t one = 1;
+    auto ret = write(_wakeup_fds[0].fd(), &one, sizeof(one));
+#else
+    char one = 1;
+    auto ret = write(_wakeup_fds[1].fd(), &one, sizeof(one));
+#endif
+    (void)ret;
+}
+
+void LoopThread::run_tasks() {
+    //Reset before popping, so that task pushed after it wakes loop again
+    _woken.store(false, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    LoopTask* task = nullptr;
+    while (_tasks->pop(task)) {
+        task->fn();
+        delete task;
+    }
+}
+
+void LoopThread::record_iteration(size_t n, size_t end_us) {
+    auto wake_us = std::max(_loop->wake_us(), _last_handled_us);
+    _wakeup_events.add(n);
+    _iteration_handle_us.add(end_us > wake_us ? end_us - wake_us : 0);
+    _idle_us.add(wake_us - _last_handled_us);
+    _last_handled_us = end_us;
+}
+
+void LoopThread::busy_poll() {
+    auto idle_begin = Utils::getSteadyTimeStampMicro();
+    while (!_exit.load(std::memory_order_acquire)) {
+        auto begin = Utils::getSteadyTimeStampMicro();
+        if (begin - idle_begin < _options.busy_poll_us) {
+            //Thread is on cpu all the time, so wall time is cpu time
+            auto n = _loop->loop_once(0);
+            run_tasks();
+            auto end = Utils::getSteadyTimeStampMicro();
+            if (n > 0) {
+                increase(_handle_us, end - begin);
+                increase(_events, n);
+                increase(_spin_hits, n);
+                record_iteration(n, end);
+                idle_begin = end;
+            } else {
+                increase(_spin_us, end - begin);
+                //Let other threads sharing this cpu run, such as the one
+                //which is going to send a request
+                std::this_thread::yield();
+            }
+        } else {
+            //Idle window passed, sleep until next event. Time asleep is
+            //not counted, while cpu time of wakeup and handling is.
+            auto cpu_begin = Utils::getThreadCpuTimeMicro();
+            auto n = _loop->loop_once(-1);
+            run_tasks();
+            increase(_handle_us, Utils::getThreadCpuTimeMicro() - cpu_begin);
+            increase(_events, n);
+            increase(_sleeps, 1);
+            idle_begin = Utils::getSteadyTimeStampMicro();
+            if (n > 0) {
+                record_iteration(n, idle_begin);
+            }
+        }
+    }
+}
+
 bool LoopThread::add_event(int fd, int events, void* handler) {
+    //Let kernel poll device queue for sockets read by busy poll thread
+    if (handler && (events & POLLIN) && _options.busy_poll_us > 0
+        && _options.socket_busy_poll_us > 0
+        && !base::set_busy_poll(fd, _options.socket_busy_poll_us)) {
+        LOG_DEBUG("set SO_BUSY_POLL of fd {} fail", fd);
+    }
     return _loop->add_event(fd, events, handler);
 }
 
+bool LoopThread::modify_event(int fd, int events, void* handler) {
+    return _loop->modify_event(fd, events, handler);
+}
+
 void LoopThread::remove_event(int fd, int events) {
     _loop->remove_event(fd, events);
 }
 
+void LoopThread::collect_stats(LoopStats& stats) const {
+    if (_options.busy_poll_us == 0) {
+        return;
+    }
+    ++stats.busy_poll_threads;
+    stats.spin_us += _spin_us.load(std::memory_order_relaxed);
+    stats.handle_us += _handle_us.load(std::memory_order_relaxed);
+    stats.events += _events.load(std::memory_order_relaxed);
+    stats.spin_hits += _spin_hits.load(std::memory_order_relaxed);
+    stats.sleeps += _sleeps.load(std::memory_order_relaxed);
+}
+
 }
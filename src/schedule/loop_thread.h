@@ -9,12 +9,31 @@
 #include <thread>
 #include <future>
 #include <memory>
+#include <functional>
 #include "tcp/socket_base.h"
+#include "common/common_defines.h"
+#include "common/lockfree_queue.h"
 
 namespace antflash {
 
 class Loop;
 
+//Log2 histogram, written by loop thread only
+class LoopHistogram final {
+public:
+    LoopHistogram() {
+        for (auto& bucket : _buckets) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void add(size_t value);
+    void copy_to(size_t (&buckets)[LOOP_HISTOGRAM_BUCKETS]) const;
+
+private:
+    std::atomic<size_t> _buckets[LOOP_HISTOGRAM_BUCKETS];
+};
+
 class LoopThread final {
 public:
     LoopThread();
@@ -26,18 +45,90 @@ public:
     LoopThread(LoopThread&& right);
     LoopThread& operator=(LoopThread&& right);
 
-    bool start();
+    //Pin loop thread to cpu if not negative
+    bool start(const LoopOptions& options = LoopOptions(), int cpu = -1);
 
     void stop();
 
+    //Run task in loop thread after events polled so far are handled, even if
+    //it is called in loop thread. Return false if loop thread is stopped or
+    //too many tasks are pending.
+    bool run_in_loop(std::function<void()> task);
+
     bool add_event(int fd, int events, void* handler);
+    bool modify_event(int fd, int events, void* handler);
     void remove_event(int fd, int events);
 
+    //Cpu which loop thread is pinned on, -1 if not pinned
+    int cpu() const {
+        return _cpu;
+    }
+    //Numa node of pinned cpu, -1 if not pinned
+    int numa_node() const {
+        return _numa_node;
+    }
+
+    //Add statistics of busy poll mode to stats
+    void collect_stats(LoopStats& stats) const;
+
+    //Whether current thread is any loop thread
+    static bool in_loop_thread();
+
+    //Count bytes read by socket into load of current loop thread
+    static void count_read_bytes(size_t n);
+
+    //Sockets read by this loop thread
+    void attach_socket(bool migrated = false);
+    void detach_socket(bool migrated = false);
+
+    //Update rates of load since last sample, not thread safe
+    void sample_load(size_t now_us);
+    LoopLoad load() const;
+
 private:
+    struct LoopTask;
+
+    void busy_poll();
+    void wakeup();
+    void run_tasks();
+    //Record iteration which handled n events and ended at end_us
+    void record_iteration(size_t n, size_t end_us);
+
+    LoopOptions _options;
     std::atomic<bool> _exit;
     std::unique_ptr<std::thread> _thread;
     std::unique_ptr<Loop> _loop;
+    //eventfd on linux, or read and write end of pipe
     base::FdGuard _wakeup_fds[2];
+    std::function<void()> _on_wakeup;
+    std::unique_ptr<MPSCQueue<LoopTask*>> _tasks;
+    //Whether loop thread is woken up and not yet run tasks
+    std::atomic<bool> _woken;
+    int _cpu;
+    int _numa_node;
+
+    //Written by loop thread only
+    std::atomic<size_t> _spin_us;
+    std::atomic<size_t> _handle_us;
+    std::atomic<size_t> _events;
+    std::atomic<size_t> _spin_hits;
+    std::atomic<size_t> _sleeps;
+    LoopHistogram _wakeup_events;
+    LoopHistogram _iteration_handle_us;
+    LoopHistogram _idle_us;
+    //End of last iteration which handled events
+    size_t _last_handled_us;
+
+    //Load of loop thread, read bytes are written by loop thread only
+    std::atomic<size_t> _read_bytes;
+    std::atomic<size_t> _sockets;
+    std::atomic<size_t> _migrated_in;
+    std::atomic<size_t> _migrated_out;
+    size_t _sample_us;
+    size_t _sample_events;
+    size_t _sample_bytes;
+    size_t _events_per_sec;
+    size_t _bytes_per_sec;
 };
 
 }
@@ -5,26 +5,54 @@
 #include "schedule.h"
 #include "loop_thread.h"
 #include "common/log.h"
+#include "rpc.h"
+#include "common/utils.h"
+#include <string.h>
+#include <algorithm>
+#include <limits>
 
 namespace antflash {
 
-Schedule::Schedule() {
+static std::atomic<size_t> s_callbacks(0);
+static std::atomic<size_t> s_callback_delay_us(0);
+static std::atomic<size_t> s_callback_max_delay_us(0);
+
+Schedule::Schedule() : _loop_assign(ELoopAssign::FD), _loop_rebalance(false),
+                       _load_sample_us(0) {
 
 }
 
 Schedule::~Schedule() {
     destroy_schedule();
     destroy_time_schedule();
+    destroy_executor();
 }
 
 bool Schedule::init(int32_t schedule_num) {
+    LoopOptions options;
+    options.threads = schedule_num;
+    return init(options);
+}
+
+bool Schedule::init(const LoopOptions& options) {
+    int32_t schedule_num = options.threads;
     if (schedule_num <= 0) {
         schedule_num = std::thread::hardware_concurrency();
     }
     _threads.resize(schedule_num);
     bool ret = true;
-    for (auto& thread : _threads) {
-        if (!thread.start()) {
+    for (size_t i = 0; i < _threads.size(); ++i) {
+        LoopOptions thread_options(options);
+        //Only first busy_poll_threads threads spin
+        if (options.busy_poll_threads > 0
+            && i >= (size_t)options.busy_poll_threads) {
+            thread_options.busy_poll_us = 0;
+        }
+        int cpu = -1;
+        if (!options.loop_cpus.empty()) {
+            cpu = options.loop_cpus[i % options.loop_cpus.size()];
+        }
+        if (!_threads[i].start(thread_options, cpu)) {
             ret = false;
             break;
         }
@@ -34,13 +62,45 @@ bool Schedule::init(int32_t schedule_num) {
         destroy_schedule();
     }
 
+    _loop_assign = options.loop_assign;
+    _loop_rebalance = options.loop_rebalance;
+    _load_sample_us = 0;
+    _cpu_nodes.clear();
+    if (_loop_assign == ELoopAssign::CALLER_NUMA
+        || _loop_assign == ELoopAssign::INCOMING_CPU) {
+        for (size_t i = 0; i < std::thread::hardware_concurrency(); ++i) {
+            _cpu_nodes.push_back(Utils::getCpuNumaNode(i));
+        }
+    }
+
     _time_thread.reset(new TimeThread);
-    ret = _time_thread->init();
+    ret = _time_thread->init(options.timer_cpus);
     if (!ret) {
         destroy_schedule();
         destroy_time_schedule();
     }
 
+    if (ret) {
+        int32_t callback_threads = options.callback_threads;
+        if (callback_threads < 0) {
+            callback_threads = _threads.size() + 1;
+        }
+        _callback_executor.reset();
+        _callback_pool.reset();
+        if (callback_threads > 0) {
+            _callback_pool.reset(new ThreadPool<std::function<void()>>(
+                    callback_threads, CALLBACK_QUEUE_SIZE));
+            _callback_pool->init();
+            //Each loop or timer thread is paired with one pool thread, and
+            //runs callback in place if its queue is full
+            auto pool = _callback_pool.get();
+            _callback_executor = std::make_shared<CallbackExecutor>(
+                    [pool](std::function<void()> task) {
+                        pool->submit(std::move(task));
+                    });
+        }
+    }
+
     return ret;
 }
 
@@ -57,30 +117,244 @@ void Schedule::destroy_time_schedule() {
     }
 }
 
+void Schedule::destroy_executor() {
+    //Pool threads run callbacks left in queues before exiting
+    _callback_executor.reset();
+    _callback_pool.reset();
+}
+
 bool Schedule::addScheduleInternal(int fd, int events, void *handler, int idx) {
     if (_threads.size() == 0) {
         return false;
     }
-    if (idx > 0) {
+    if (idx >= 0) {
         return _threads[idx % _threads.size()].add_event(fd, events, handler);
     } else {
         return _threads[fd % _threads.size()].add_event(fd, events, handler);
     }
 }
 
+bool Schedule::modifySchedule(int fd, int events, Handler &handler, int idx) {
+    if (_threads.size() == 0) {
+        return false;
+    }
+    if (idx >= 0) {
+        return _threads[idx % _threads.size()].modify_event(
+                fd, events, (void*)&handler);
+    } else {
+        return _threads[fd % _threads.size()].modify_event(
+                fd, events, (void*)&handler);
+    }
+}
+
 void Schedule::removeSchedule(int fd, int events, int idx) {
     if (_threads.size() == 0) {
         return;
     }
-    if (idx > 0) {
+    if (idx >= 0) {
         _threads[idx % _threads.size()].remove_event(fd, events);
     } else {
         _threads[fd % _threads.size()].remove_event(fd, events);
     }
 }
 
+bool Schedule::runInLoop(int idx, Handler task) {
+    if (idx < 0 || (size_t)idx >= _threads.size()) {
+        return false;
+    }
+    return _threads[idx].run_in_loop(std::move(task));
+}
+
 size_t Schedule::scheduleThreadSize() const {
     return _threads.size();
 }
 
+int Schedule::assignLoop(int fd) {
+    if (_threads.empty()) {
+        return -1;
+    }
+    if (_loop_assign == ELoopAssign::LEAST_LOADED) {
+        return leastLoadedLoop();
+    }
+    if (_loop_assign == ELoopAssign::CALLER_NUMA) {
+        auto idx = loopOnNode(cpuNumaNode(Utils::getCurrentCpu()), fd);
+        if (idx >= 0) {
+            return idx;
+        }
+    }
+    return fd % _threads.size();
+}
+
+int Schedule::reassignLoop(int fd, int idx) const {
+    if (_loop_assign != ELoopAssign::INCOMING_CPU) {
+        return idx;
+    }
+    auto cpu = base::incoming_cpu(fd);
+    if (cpu < 0) {
+        return idx;
+    }
+    for (size_t i = 0; i < _threads.size(); ++i) {
+        if (_threads[i].cpu() == cpu) {
+            return i;
+        }
+    }
+    auto node_idx = loopOnNode(cpuNumaNode(cpu), fd);
+    return node_idx >= 0 ? node_idx : idx;
+}
+
+int Schedule::loopOnNode(int node, int fd) const {
+    if (node < 0) {
+        return -1;
+    }
+    //Spread sockets over loop threads on node by fd
+    size_t num = 0;
+    for (auto& thread : _threads) {
+        if (thread.numa_node() == node) {
+            ++num;
+        }
+    }
+    if (num == 0) {
+        return -1;
+    }
+    size_t nth = fd % num;
+    for (size_t i = 0; i < _threads.size(); ++i) {
+        if (_threads[i].numa_node() == node && nth-- == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void Schedule::attachSocket(int idx, bool migrated) {
+    if (idx >= 0 && (size_t)idx < _threads.size()) {
+        _threads[idx].attach_socket(migrated);
+    }
+}
+
+void Schedule::detachSocket(int idx, bool migrated) {
+    if (idx >= 0 && (size_t)idx < _threads.size()) {
+        _threads[idx].detach_socket(migrated);
+    }
+}
+
+void Schedule::countReadBytes(size_t n) {
+    LoopThread::count_read_bytes(n);
+}
+
+void Schedule::sampleLoads() {
+    auto now = Utils::getSteadyTimeStampMicro();
+    if (now - _load_sample_us < LOOP_LOAD_SAMPLE_US) {
+        return;
+    }
+    _load_sample_us = now;
+    for (auto& thread : _threads) {
+        thread.sample_load(now);
+    }
+}
+
+std::vector<LoopLoad> Schedule::loopLoads() {
+    std::vector<LoopLoad> loads;
+    std::lock_guard<std::mutex> guard(_load_mtx);
+    sampleLoads();
+    loads.reserve(_threads.size());
+    for (auto& thread : _threads) {
+        loads.emplace_back(thread.load());
+    }
+    return loads;
+}
+
+int Schedule::leastLoadedLoop() {
+    auto loads = loopLoads();
+    size_t total_score = 0;
+    size_t total_sockets = 0;
+    for (auto& load : loads) {
+        total_score += loadScore(load.events_per_sec, load.bytes_per_sec);
+        total_sockets += load.sockets;
+    }
+    //Rates are sampled periodically while sockets are counted at once, take
+    //each socket as an average one so that sockets assigned within the same
+    //sampling period are spread
+    size_t per_socket = std::max((size_t)1, total_score / std::max((size_t)1, total_sockets));
+    int idx = 0;
+    size_t min_cost = std::numeric_limits<size_t>::max();
+    for (size_t i = 0; i < loads.size(); ++i) {
+        auto cost = loadScore(loads[i].events_per_sec, loads[i].bytes_per_sec)
+                    + per_socket * loads[i].sockets;
+        if (cost < min_cost) {
+            min_cost = cost;
+            idx = i;
+        }
+    }
+    return idx;
+}
+
+bool Schedule::loopsToRebalance(int& busy, int& idle, size_t& gap) {
+    auto loads = loopLoads();
+    if (loads.size() < 2) {
+        return false;
+    }
+    size_t max_score = 0;
+    size_t min_score = std::numeric_limits<size_t>::max();
+    for (size_t i = 0; i < loads.size(); ++i) {
+        auto score = loadScore(loads[i].events_per_sec, loads[i].bytes_per_sec);
+        if (score >= max_score) {
+            max_score = score;
+            busy = i;
+        }
+        if (score < min_score) {
+            min_score = score;
+            idle = i;
+        }
+    }
+    if (busy == idle
+        || max_score < min_score + LOOP_REBALANCE_MIN_RATE
+        || max_score < min_score * LOOP_REBALANCE_RATIO) {
+        return false;
+    }
+    gap = max_score - min_score;
+    return true;
+}
+
+int Schedule::cpuNumaNode(int cpu) const {
+    if (cpu >= 0 && (size_t)cpu < _cpu_nodes.size()) {
+        return _cpu_nodes[cpu];
+    }
+    return Utils::getCpuNumaNode(cpu);
+}
+
+void Schedule::countCallbackDelay(size_t delay_us) {
+    s_callbacks.fetch_add(1, std::memory_order_relaxed);
+    s_callback_delay_us.fetch_add(delay_us, std::memory_order_relaxed);
+    auto max_delay = s_callback_max_delay_us.load(std::memory_order_relaxed);
+    while (delay_us > max_delay
+           && !s_callback_max_delay_us.compare_exchange_weak(
+                   max_delay, delay_us, std::memory_order_relaxed)) {
+    }
+}
+
+bool Schedule::inScheduleThread() const {
+    return LoopThread::in_loop_thread()
+           || (_time_thread && _time_thread->inTimeThread());
+}
+
+LoopStats Schedule::loopStats() const {
+    LoopStats stats;
+    memset(&stats, 0, sizeof(stats));
+    for (auto& thread : _threads) {
+        thread.collect_stats(stats);
+    }
+    stats.callbacks = s_callbacks.load(std::memory_order_relaxed);
+    stats.callback_delay_us = s_callback_delay_us.load(std::memory_order_relaxed);
+    stats.callback_max_delay_us = s_callback_max_delay_us.load(std::memory_order_relaxed);
+    return stats;
+}
+
+LoopStats getLoopStats() {
+    return Schedule::getInstance().loopStats();
+}
+
+std::vector<LoopLoad> getLoopLoads() {
+    return Schedule::getInstance().loopLoads();
+}
+
 }
@@ -9,7 +9,10 @@
 #include <future>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include "common/time_thread.h"
+#include "common/thread_pool.h"
+#include "common/common_defines.h"
 
 namespace antflash {
 
@@ -26,8 +29,10 @@ public:
     }
 
     bool init(int32_t schedule_num = -1);
+    bool init(const LoopOptions& options);
     void destroy_schedule();
     void destroy_time_schedule();
+    void destroy_executor();
 
     //TODO change fd + handler to a class
     bool addSchedule(int fd, int events, int idx = -1) {
@@ -38,8 +43,15 @@ public:
         return addScheduleInternal(fd, events, (void*)&handler, idx);
     }
 
+    //Replace events of fd which is already scheduled
+    bool modifySchedule(int fd, int events, Handler &handler, int idx = -1);
+
     void removeSchedule(int fd, int events, int idx = -1);
 
+    //Run task in loop thread of idx after events it has polled are handled,
+    //return false if task could not be posted
+    bool runInLoop(int idx, Handler task);
+
     size_t addTimeschdule(size_t abs_time, TimerTaskFn&& fn) {
         return _time_thread->scheduleAbs(abs_time, std::move(fn));
     }
@@ -50,14 +62,70 @@ public:
 
     size_t scheduleThreadSize() const;
 
+    //Index of loop thread which socket of fd is assigned to when connecting
+    int assignLoop(int fd);
+
+    //Index of loop thread which connected socket of fd moves to, or idx if it
+    //stays in current loop thread
+    int reassignLoop(int fd, int idx) const;
+
+    //Count sockets read by loop thread of idx into its load
+    void attachSocket(int idx, bool migrated = false);
+    void detachSocket(int idx, bool migrated = false);
+
+    //Count bytes read in current loop thread into its load
+    static void countReadBytes(size_t n);
+
+    //Load of each loop thread, sampled again if last sample is old enough
+    std::vector<LoopLoad> loopLoads();
+
+    bool loopRebalance() const {
+        return _loop_rebalance;
+    }
+
+    //Busiest and idlest loop threads if load of them differs too much, and
+    //difference of their load score
+    bool loopsToRebalance(int& busy, int& idle, size_t& gap);
+
+    //Score of load which loop threads are compared by
+    static size_t loadScore(size_t events_per_sec, size_t bytes_per_sec) {
+        return events_per_sec + bytes_per_sec / LOOP_LOAD_BYTES_PER_EVENT;
+    }
+
+    //Default executor of async session callbacks, nullptr if callbacks run
+    //in loop and timer threads
+    const std::shared_ptr<CallbackExecutor>& callbackExecutor() const {
+        return _callback_executor;
+    }
+
+    //Count time a callback is queued in executor before running
+    static void countCallbackDelay(size_t delay_us);
+
+    //Whether current thread is loop or timer thread, which should never block
+    bool inScheduleThread() const;
+
+    LoopStats loopStats() const;
+
 private:
     bool addScheduleInternal(int fd, int events, void *handler, int idx);
+    int loopOnNode(int node, int fd) const;
+    int leastLoadedLoop();
+    void sampleLoads();
+    int cpuNumaNode(int cpu) const;
 
     Schedule();
     ~Schedule();
 
     std::vector<LoopThread> _threads;
     std::unique_ptr<TimeThread> _time_thread;
+    std::unique_ptr<ThreadPool<std::function<void()>>> _callback_pool;
+    std::shared_ptr<CallbackExecutor> _callback_executor;
+    ELoopAssign _loop_assign;
+    bool _loop_rebalance;
+    std::mutex _load_mtx;
+    size_t _load_sample_us;
+    //Numa node of each cpu, cached when sockets are assigned by numa
+    std::vector<int> _cpu_nodes;
 };
 
 
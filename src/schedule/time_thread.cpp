@@ -60,6 +60,8 @@ struct TaskContainer {
                 (size_t)((double)TASK_QUEUE_SIZE * 2.0 / 3.0);
 };
 
+static thread_local const TimeThread* s_current_time_thread = nullptr;
+
 TimeThread::TimeThread() : 
     _exit(false),
     _nearest_run_time(std::numeric_limits<size_t>::max()),
@@ -78,13 +80,17 @@ static void deleteThreadLocalTaskContainer(void* arg) {
     //p_task->status.store(TaskContainer::RECLAIMED, std::memory_order_release);
 }
 
-bool TimeThread::init() {
+bool TimeThread::init(const std::vector<int>& cpus) {
     _exit.store(false, std::memory_order_release);
 
     pthread_key_create(&_local_task, deleteThreadLocalTaskContainer);
     _containers.reserve(std::thread::hardware_concurrency());
     std::promise<bool> init_ret;
-    _td.reset(new std::thread([this, &init_ret](){
+    _td.reset(new std::thread([this, &init_ret, &cpus](){
+        s_current_time_thread = this;
+        if (!cpus.empty() && !Utils::setThreadAffinity(cpus)) {
+            LOG_ERROR("pin timer thread to cpus fail");
+        }
         init_ret.set_value(true);
         while (!_exit.load(std::memory_order_acquire)) {
             loopOnce();
@@ -175,8 +181,7 @@ size_t TimeThread::scheduleAbs(size_t abs_time, TimerTaskFn&& fn) {
     } 
     
     if (tasks.size() >= TaskContainer::WARING_TASK_QUEUE_SIZE) {
-        std::lock_guard<std::mutex> guard(_wake_mtx);
-        _wake_cond.notify_one();
+        wakeToCollect();
     }
 
     return task_id;
@@ -191,12 +196,24 @@ bool TimeThread::unschedule(size_t task_id) {
     }
 
     if (tasks.size() >= TaskContainer::WARING_TASK_QUEUE_SIZE) {
-        _wake_cond.notify_one();
+        wakeToCollect();
     }
 
     return true;
 }
 
+bool TimeThread::inTimeThread() const {
+    return s_current_time_thread == this;
+}
+
+void TimeThread::wakeToCollect() {
+    //Timer thread only wakes up when nearest run time changes, make it
+    //earliest so that tasks in queue are collected before queue is full
+    _nearest_run_time.store(0, std::memory_order_release);
+    std::lock_guard<std::mutex> guard(_wake_mtx);
+    _wake_cond.notify_one();
+}
+
 void TimeThread::collectUnschedule(TaskContainer* container) {
     size_t cur_size = container->abandon_tasks.size();
     AbandonTask abandon_task;
@@ -16,8 +16,6 @@
 
 namespace antflash {
 
-alignas(SIZE_OF_AVOID_FALSE_SHARING) std::atomic<size_t> s_session_id(1);
-
 static std::string s_session_error_info[] = {
         "success",
         "protocol not found",
@@ -54,6 +52,12 @@ Session& Session::to(Channel& channel) {
     if (_retry < 0) {
         _retry = channel._options.max_retry;
     }
+    if (!_executor) {
+        _executor = channel._options.callback_executor;
+    }
+    if (_inline_callback < 0) {
+        _inline_callback = channel._options.inline_callback ? 1 : 0;
+    }
 
     _channel = &channel;
 
@@ -73,7 +77,8 @@ Session& Session::sync() {
 
 Session &Session::async(SessionAsyncCallback callback) {
     sendInternalWithRetry(&callback);
-    if (failed()) {
+    //Callback is consumed if session is notified before failing
+    if (failed() && callback) {
         callback(_error_code, _response);
     }
     return *this;
@@ -84,9 +89,15 @@ void Session::sendInternalWithRetry(SessionAsyncCallback *callback) {
     for (size_t i = 0; i < retry; ++i) {
         _error_code = ESessionError::SESSION_OK;
         sendInternal(callback);
-        //If session is ok or reading timeout, break the retry
+        //If session is ok, reading timeout, or waiting for socket until
+        //timeout, break the retry
         if (_error_code == ESessionError::SESSION_OK
-            || _error_code == ESessionError::READ_TIMEOUT) {
+            || _error_code == ESessionError::READ_TIMEOUT
+            || _error_code == ESessionError::SOCKET_BUSY) {
+            break;
+        }
+        //Callback has been called by timeout task, nothing left to retry
+        if (nullptr != callback && !*callback) {
             break;
         }
     }
@@ -114,23 +125,10 @@ void Session::sendInternal(SessionAsyncCallback* callback) {
         }
 
         _begin_time_us = Utils::getHighPrecisionTimeStamp();
-        size_t session_id = s_session_id.fetch_add(1, std::memory_order_relaxed);
 
-        //1, package request data to io buffer
-        IOBuffer write_buf;
-        if (nullptr == _request ||
-            !_protocol->assemble_request_fn(*_request, session_id, write_buf)) {
-            _error_code = ESessionError::ASSEMBLE_REQUEST_FAIL;
-            break;
-        }
-
-        //2, Init session info for later reading, and its life cycle is controlled in Socket
+        //1, Init session info for later reading, it is referred by its slot in Socket,
+        //timeout task and sync waiting thread, and deleted by the last one of them
         session_info = new SocketReadSession;
-        if (_protocol->converse_request_fn) {
-            session_info->request_id = _protocol->converse_request_fn(session_id);
-        } else {
-            session_info->request_id = session_id;
-        }
         session_info->request_time = _begin_time_us;
         session_info->protocol = _protocol;
         if (_timeout > 0) {
@@ -138,40 +136,72 @@ void Session::sendInternal(SessionAsyncCallback* callback) {
         } else {
             session_info->expire_time = std::numeric_limits<size_t>::max();
         }
-
         session_info->response = _response;
-        if (nullptr != callback) {
-            session_info->callback = std::move(*callback);
-        }
-        session_info->owners.tryShared();//for timeout thread, always success
 
-        //3, Send session info to Socket, thread compatible
-        if (!_socket->prepareRead(session_info)) {
+        //2, Send session info to Socket, which gives request id, thread compatible.
+        //If too many sessions are in flight, wait for one to finish until timeout
+        if (!_socket->prepareRead(session_info, session_info->expire_time)) {
             _error_code = ESessionError::SOCKET_BUSY;
             delete session_info;
             session_info = nullptr;
             break;
         }
+        //Latency is measured from taking slot, without time waiting for it
+        session_info->request_time = Utils::getHighPrecisionTimeStamp();
+        bool sync = nullptr == callback;
+        if (sync) {
+            session_info->addRef();
+        }
+
+        //3, package request data to io buffer
+        IOBuffer write_buf;
+        if (nullptr == _request ||
+            !_protocol->assemble_request_fn(
+                    *_request, session_info->request_id, write_buf)) {
+            _error_code = ESessionError::ASSEMBLE_REQUEST_FAIL;
+            _socket->cancelRead(session_info);
+            if (sync) {
+                session_info->releaseRef();
+            }
+            break;
+        }
+
+        //No response comes before writing, so callback is safe to set here
+        if (!sync) {
+            session_info->callback = std::move(*callback);
+            if (_inline_callback <= 0) {
+                session_info->executor = _executor ? _executor
+                        : Schedule::getInstance().callbackExecutor();
+            }
+        }
 
         //4, Add timeout schedule
+        std::weak_ptr<Socket> socket = _socket;
+        session_info->addRef();
         session_info->timer_task_id = Schedule::getInstance().addTimeschdule(
                 session_info->expire_time,
-                [session_info]() {
+                [session_info, socket]() {
                     auto error = ESessionError::READ_TIMEOUT;
-                    if (session_info->notify(error)) {
+                    //If socket is gone, session has left its slot
+                    auto s = socket.lock();
+                    if (session_info->notify(error, s.get())) {
                         LOG_WARN("request id {} is timeout", session_info->request_id);
                     }
-                    LOG_DEBUG("release shared:{}", session_info->timer_task_id);
-                    //release timeout thread shared status
-                    session_info->owners.releaseShared();
+                    session_info->releaseRef();
                 });
         LOG_DEBUG("add timeout:{}", session_info->timer_task_id);
 
-        //If adding timeout fail, just release shared
+        //If adding timeout fail, just give up reading and release references
         if (session_info->timer_task_id <= 0) {
-            LOG_ERROR("add timeout fail, release shared:{}", session_info->timer_task_id);
+            LOG_ERROR("add timeout fail:{}", session_info->timer_task_id);
             _error_code = ESessionError::TIMER_BUSY;
-            session_info->owners.releaseShared();
+            if (_socket->cancelRead(session_info) && !sync) {
+                *callback = std::move(session_info->callback);
+            }
+            if (sync) {
+                session_info->releaseRef();
+            }
+            session_info->releaseRef();
             break;
         }
 
@@ -179,19 +209,27 @@ void Session::sendInternal(SessionAsyncCallback* callback) {
         //5, Write data to Socket's fd
         if (!_socket->write(write_buf, _timeout - clock.elapsed())) {
             _error_code = ESessionError::WRITE_FAIL;
-            //If adding timeout fail, just remove timeout and release shared
-            Schedule::getInstance().removeTimeschdule(session_info->timer_task_id);
-            session_info->owners.releaseShared();
+            //Give up reading, and timeout task releases its reference when expired
+            if (_socket->cancelRead(session_info)) {
+                if (!sync) {
+                    *callback = std::move(session_info->callback);
+                }
+            } else if (sync) {
+                //Notified by timeout already, wait until it finishes notifying
+                session_info->result.get_future().get();
+            }
+            if (sync) {
+                session_info->releaseRef();
+            }
             break;
         }
         LOG_DEBUG("write data cost {} ms", clock.elapsed());
 
         //6, Sync waiting
-        if (!session_info->callback) {
+        if (sync) {
             _error_code = session_info->result.get_future().get();
             session_info->postProcess(_error_code);
-            //Release sync shared status
-            session_info->owners.releaseShared();
+            session_info->releaseRef();
         }
     } while (0);
 }
@@ -7,11 +7,27 @@
 #include <cstring>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <sys/un.h>
 #include "common/utils.h"
 
 namespace antflash {
 
 bool EndPoint::parseFromString(const char *str) {
+    static constexpr char UNIX_PREFIX[] = "unix:";
+    if (0 == strncmp(str, UNIX_PREFIX, sizeof(UNIX_PREFIX) - 1)) {
+        const char* path = str + sizeof(UNIX_PREFIX) - 1;
+        //Path must be terminated by '\0' in sun_path
+        size_t len = strlen(path);
+        if (0 == len || len >= sizeof(((struct sockaddr_un*)nullptr)->sun_path)) {
+            return false;
+        }
+        ip = IP_ANY;
+        port = 0;
+        unix_path = path;
+        return true;
+    }
+    unix_path.clear();
+
     constexpr auto STR_MAX_SIZE = 64;
     char inner_str[STR_MAX_SIZE];
     const char* p = str;
@@ -63,6 +79,9 @@ bool EndPoint::parseFromString(const char *str) {
 }
 
 std::string EndPoint::ipToStr() const {
+    if (isUnix()) {
+        return "unix:" + unix_path;
+    }
     char tmp_ip[INET_ADDRSTRLEN];
     char tmp[INET_ADDRSTRLEN + 16];
     inet_ntop(AF_INET, &ip, tmp_ip, INET_ADDRSTRLEN);
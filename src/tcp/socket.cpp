@@ -5,6 +5,8 @@
 #include "socket.h"
 #include <errno.h>
 #include <poll.h>
+#include <thread>
+#include <cmath>
 #include "session/session.h"
 #include "socket_manager.h"
 #include "socket_base.h"
@@ -13,9 +15,25 @@
 #include "common/log.h"
 #include "schedule/schedule.h"
 #include "protocol/protocol_define.h"
+#include "rpc.h"
 
 namespace antflash {
 
+static std::atomic<size_t> s_zero_copy_threshold(SOCKET_ZERO_COPY_THRESHOLD);
+//Socket whose read event is being handled by current loop thread
+static thread_local const Socket* s_reading_socket = nullptr;
+
+struct Socket::WriteRequest {
+    IOBuffer data;
+    //Older request, which is set by writer after pushing
+    std::atomic<WriteRequest*> next;
+
+    //Next of request which has been pushed but not linked yet
+    static WriteRequest* unconnected() {
+        return reinterpret_cast<WriteRequest*>(static_cast<intptr_t>(-1));
+    }
+};
+
 void SocketReadSession::postProcess(ESessionError &error) {
     if (error == ESessionError::SESSION_OK) {
         if (nullptr != response) {
@@ -28,13 +46,122 @@ void SocketReadSession::postProcess(ESessionError &error) {
     }
 }
 
+void SocketReadSession::dispatchCallback(ESessionError err) {
+    if (!executor || !Schedule::getInstance().inScheduleThread()) {
+        postProcess(err);
+        callback(err, response);
+        return;
+    }
+    addRef();
+    auto submit_us = Utils::getSteadyTimeStampMicro();
+    (*executor)([this, err, submit_us]() {
+        Schedule::countCallbackDelay(Utils::getSteadyTimeStampMicro() - submit_us);
+        auto error = err;
+        postProcess(error);
+        callback(error, response);
+        releaseRef();
+    });
+}
+
+SessionSlots::SessionSlots(size_t capacity) :
+        _capacity(std::min(std::max(capacity, (size_t)1),
+                           MAX_SESSION_SLOTS_ON_SOCKET)),
+        _index_bits(0),
+        _slots(new Slot[_capacity]),
+        _free_head(0),
+        _size(0) {
+    while (((size_t)1 << _index_bits) < _capacity) {
+        ++_index_bits;
+    }
+    _generation_mask = (uint32_t)(((uint64_t)1 << (32 - _index_bits)) - 1);
+    for (size_t i = 0; i < _capacity; ++i) {
+        _slots[i].session.store(nullptr, std::memory_order_relaxed);
+        _slots[i].next_free.store(
+                i + 1 < _capacity ? (uint32_t)(i + 1) : NO_SLOT,
+                std::memory_order_relaxed);
+        _slots[i].generation = 0;
+    }
+}
+
+bool SessionSlots::add(SocketReadSession* session) {
+    uint64_t head = _free_head.load(std::memory_order_acquire);
+    uint32_t index = 0;
+    while (true) {
+        index = (uint32_t)head;
+        if (index == NO_SLOT) {
+            return false;
+        }
+        uint64_t next = (((head >> 32) + 1) << 32)
+                        | _slots[index].next_free.load(std::memory_order_relaxed);
+        if (_free_head.compare_exchange_weak(
+                head, next, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            break;
+        }
+    }
+
+    //Generation 0 is skipped so that request id is never 0
+    auto& slot = _slots[index];
+    slot.generation = (slot.generation + 1) & _generation_mask;
+    if (slot.generation == 0) {
+        slot.generation = 1;
+    }
+    session->request_id = ((size_t)slot.generation << _index_bits) | index;
+    slot.session.store(session, std::memory_order_release);
+    _size.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+bool SessionSlots::remove(SocketReadSession* session) {
+    uint32_t index = (uint32_t)(session->request_id & (((size_t)1 << _index_bits) - 1));
+    SocketReadSession* expect = session;
+    if (!_slots[index].session.compare_exchange_strong(
+            expect, nullptr, std::memory_order_acq_rel)) {
+        return false;
+    }
+    _size.fetch_sub(1, std::memory_order_relaxed);
+    pushFree(index);
+    return true;
+}
+
+SocketReadSession* SessionSlots::find(size_t request_id) const {
+    size_t index = request_id & (((size_t)1 << _index_bits) - 1);
+    if (index >= _capacity) {
+        return nullptr;
+    }
+    auto session = _slots[index].session.load(std::memory_order_acquire);
+    if (nullptr == session || session->request_id != request_id) {
+        return nullptr;
+    }
+    return session;
+}
+
+void SessionSlots::pushFree(uint32_t index) {
+    uint64_t head = _free_head.load(std::memory_order_relaxed);
+    uint64_t next = 0;
+    do {
+        _slots[index].next_free.store((uint32_t)head, std::memory_order_relaxed);
+        next = (((head >> 32) + 1) << 32) | index;
+    } while (!_free_head.compare_exchange_weak(
+            head, next, std::memory_order_release, std::memory_order_relaxed));
+}
+
 Socket::~Socket() {
-    SocketReadSession* session = nullptr;
-    while (_session_info.pop(session)) {
-        _session_map.emplace(session->request_id, session);
+    //Sessions still waiting are deleted by timeout task or sync waiting
+    //thread if they still hold references
+    for (size_t i = 0; i < _sessions.capacity(); ++i) {
+        auto session = _sessions.at(i);
+        if (nullptr != session && _sessions.remove(session)) {
+            session->releaseRef();
+        }
     }
-    while (!_session_map.empty()) {
-        tryReclaimSessionMap();
+    reclaimSessions();
+
+    //Requests left in write list, tail has been linked to null
+    WriteRequest* req = _write_head.load(std::memory_order_acquire);
+    while (req && req != WriteRequest::unconnected()) {
+        WriteRequest* next = req->next.load(std::memory_order_relaxed);
+        delete req;
+        req = next;
     }
 }
 
@@ -47,89 +174,186 @@ const Protocol* Socket::getProtocol() const {
 }
 
 bool Socket::connect(int32_t connect_timeout_ms) {
-    _fd = base::create_socket();
-    base::prepare_socket(_fd);
+    return connectAsync(connect_timeout_ms).get();
+}
+
+std::shared_future<bool> Socket::connectAsync(
+        int32_t connect_timeout_ms, std::function<void(bool)> on_done) {
+    _connection.done.store(false, std::memory_order_relaxed);
+    _connection.result = std::promise<bool>();
+    std::shared_future<bool> result(_connection.result.get_future());
+
+    _fd = base::create_socket(_remote);
+    base::prepare_socket(_fd, _remote);
 
+    //Connecting to unix domain socket never returns EINPROGRESS, EAGAIN
+    //means backlog of server is full
     int ret = base::connect(_fd, _remote);
     if (ret != 0 && errno != EINPROGRESS) {
         LOG_ERROR("connect fail, error no: {}", errno);
         setStatus(RPC_STATUS_SOCKET_CONNECT_FAIL);
-        return false;
+        if (on_done) {
+            on_done(false);
+        }
+        _connection.result.set_value(false);
+        return result;
     }
 
-    std::shared_ptr<std::promise<bool>> wakeup(new std::promise<bool>);
-    auto self(shared_from_this());
     _connection.timeout_ms = connect_timeout_ms;
-    _connection.on_connection = [self, wakeup]() {
-        if (wakeup) {
-            Schedule::getInstance().removeSchedule(self->_fd.fd(), POLLOUT);
-            try {
-                wakeup->set_value(true);
-            } catch (std::future_error& ex) {
-                LOG_ERROR("set wakeup fail: {}", ex.what());
-            }
-        }
+    _connection.on_done = std::move(on_done);
+    //Handler holds 'self' until socket is reclaimed by socket manager,
+    //as schedule may call it even after it is removed
+    auto self(shared_from_this());
+    _connection.on_connection = [self]() {
+        self->finishConnect(false);
     };
 
+    auto loop_idx = Schedule::getInstance().assignLoop(_fd.fd());
+    _loop_idx.store(loop_idx, std::memory_order_relaxed);
+    _loop_attached = true;
+    Schedule::getInstance().attachSocket(loop_idx);
+
     if (!Schedule::getInstance().addSchedule(
-            _fd.fd(), POLLOUT, _connection.on_connection)) {
+            _fd.fd(), POLLOUT, _connection.on_connection, loop_idx)) {
         LOG_ERROR("add on connection schedule fail!");
+        _loop_attached = false;
+        Schedule::getInstance().detachSocket(loop_idx);
+        _connection.on_connection = std::function<void()>();
+        _connection.done.store(true, std::memory_order_relaxed);
         setStatus(RPC_STATUS_SOCKET_CONNECT_FAIL);
-        return false;
+        auto callback = std::move(_connection.on_done);
+        if (callback) {
+            callback(false);
+        }
+        _connection.result.set_value(false);
+        return result;
     }
 
     if (connect_timeout_ms > 0) {
-        std::chrono::milliseconds span(connect_timeout_ms);
-        if (wakeup->get_future().wait_for(span) == std::future_status::timeout) {
-            setStatus(RPC_STATUS_SOCKET_CONNECT_TIMEOUT);
-            return false;
-        }
-    } else {
-        wakeup->get_future().wait();
+        std::weak_ptr<Socket> weak_self(self);
+        Schedule::getInstance().addTimeschdule(
+                Utils::getHighPrecisionTimeStamp() + connect_timeout_ms * 1000UL,
+                [weak_self]() {
+                    auto socket = weak_self.lock();
+                    if (socket) {
+                        socket->finishConnect(true);
+                    }
+                });
     }
 
-    //Release it as it holds 'self' shared pointer
-    _connection.on_connection = std::function<void()>();
+    return result;
+}
+
+void Socket::finishConnect(bool timeout) {
+    if (_connection.done.exchange(true, std::memory_order_acq_rel)) {
+        return;
+    }
 
-    auto connected = base::connected(_fd);
+    Schedule::getInstance().removeSchedule(_fd.fd(), POLLOUT, loopIndex());
+    auto self(shared_from_this());
+
+    bool connected = !timeout && base::connected(_fd);
     if (connected) {
+        if (s_zero_copy_threshold.load(std::memory_order_relaxed) > 0
+            && base::set_zero_copy(_fd.fd())) {
+            _zero_copy_capable = true;
+            _zero_copy.store(true, std::memory_order_relaxed);
+        }
+
         _last_active_time_us.store(
                 Utils::getHighPrecisionTimeStamp(),
                 std::memory_order_release);
 
-        auto self(shared_from_this());
-        _on_read = [self](){
+        //Connected socket is handled in loop thread of current handler, which
+        //never calls it again, so socket could be moved to another loop here
+        auto loop_idx = loopIndex();
+        auto new_idx = Schedule::getInstance().reassignLoop(_fd.fd(), loop_idx);
+        if (new_idx != loop_idx) {
+            Schedule::getInstance().detachSocket(loop_idx);
+            Schedule::getInstance().attachSocket(new_idx);
+            _loop_idx.store(new_idx, std::memory_order_relaxed);
+        }
+
+        _on_event = [self](){
+            if (self->_write_pending.load(std::memory_order_acquire)) {
+                self->flushWrite();
+            }
             self->onRead();
+            if (self->_migrate_to.load(std::memory_order_relaxed) >= 0) {
+                self->moveLoop();
+            }
         };
         if (!Schedule::getInstance().addSchedule(
-                _fd.fd(), POLLIN, _on_read)) {
+                _fd.fd(), POLLIN, _on_event, new_idx)) {
             LOG_ERROR("add on read schedule fail!");
-            setStatus(RPC_STATUS_SOCKET_CONNECT_FAIL);
-            //Release it as it holds 'self' shared pointer
-            _on_read = std::function<void()>();
-            return false;
+            connected = false;
+        } else {
+            setStatus(RPC_STATUS_OK);
         }
+    }
 
-        //Add this socket to socket manager
-        SocketManager::getInstance().addWatch(self);
-        setStatus(RPC_STATUS_OK);
-    } else {
-        setStatus(RPC_STATUS_SOCKET_CONNECT_FAIL);
+    if (!connected) {
+        setStatus(timeout ? RPC_STATUS_SOCKET_CONNECT_TIMEOUT
+                          : RPC_STATUS_SOCKET_CONNECT_FAIL);
     }
 
-    return connected;
+    //Add this socket to socket manager, which also reclaims failed socket
+    //and releases its handlers safely once its owner gives up it
+    SocketManager::getInstance().addWatch(self);
+
+    auto on_done = std::move(_connection.on_done);
+    if (on_done) {
+        on_done(connected);
+    }
+    _connection.result.set_value(connected);
 }
 
 void Socket::disconnect() {
-    //remove onRead event from schedule
-    Schedule::getInstance().removeSchedule(_fd.fd(), POLLIN);
+    //remove read and write events from schedule
+    std::lock_guard<std::mutex> guard(_loop_mtx);
+    Schedule::getInstance().removeSchedule(
+            _fd.fd(), POLLIN | POLLOUT, loopIndex());
+    if (_loop_attached) {
+        _loop_attached = false;
+        Schedule::getInstance().detachSocket(loopIndex());
+    }
 }
 
-bool Socket::write(IOBuffer& buffer, int32_t timeout_ms) {
-    //TODO only allow one writer without std::mutex for async write
-    //zhenggu.xwt:当前同步请求优先使用连接池中线程本地的socket连接，锁大概率不会陷入内核
-    std::lock_guard<std::recursive_mutex> lock(_write_mtx);
+void Socket::moveLoop() {
+    //Called in handler by current loop thread, which never calls handler
+    //again once fd is removed from it, so socket is never read by two loop
+    //threads at the same time
+    std::lock_guard<std::mutex> guard(_loop_mtx);
+    auto to = _migrate_to.exchange(-1, std::memory_order_relaxed);
+    auto from = loopIndex();
+    if (!_loop_attached || to < 0 || to == from) {
+        return;
+    }
 
+    auto& schedule = Schedule::getInstance();
+    int events = _write_pending.load(std::memory_order_acquire)
+                 ? POLLIN | POLLOUT : POLLIN;
+    schedule.removeSchedule(_fd.fd(), POLLIN | POLLOUT, from);
+    if (!schedule.addSchedule(_fd.fd(), events, _on_event, to)) {
+        LOG_ERROR("move socket {} to loop {} fail", _fd.fd(), to);
+        if (!schedule.addSchedule(_fd.fd(), events, _on_event, from)) {
+            LOG_ERROR("add on read schedule fail!");
+            setStatus(RPC_STATUS_SOCKET_READ_ERROR);
+        }
+        return;
+    }
+    _loop_idx.store(to, std::memory_order_relaxed);
+    schedule.detachSocket(from, true);
+    schedule.attachSocket(to, true);
+}
+
+//Only modified by flusher, no need to use atomic read-modify-write
+static inline void increase(std::atomic<size_t>& counter, size_t n) {
+    counter.store(counter.load(std::memory_order_relaxed) + n,
+                  std::memory_order_relaxed);
+}
+
+bool Socket::write(IOBuffer& buffer, int32_t timeout_ms) {
     if (timeout_ms < 0) {
         LOG_ERROR("has already timeout:{}.", timeout_ms);
         return false;
@@ -141,42 +365,280 @@ bool Socket::write(IOBuffer& buffer, int32_t timeout_ms) {
         return false;
     }
 
-    size_t cur_size = 0;
-    while (cur_size < buffer_size) {
-        //Socket fd may be closed when writing data, and SIGPIPE will be sent
-        //currently we just ignore SIGPIPE signal
-        ssize_t nw = buffer.cut_into_file_descriptor(_fd.fd(), buffer_size);
-        if (nw < 0) {
-            if (errno != EAGAIN) {
+    if (_write_pending_bytes.fetch_add(buffer_size, std::memory_order_seq_cst)
+        + buffer_size > SOCKET_MAX_PENDING_WRITE_BYTES) {
+        _write_pending_bytes.fetch_sub(buffer_size, std::memory_order_relaxed);
+        LOG_ERROR("too much data pending to write into {}", _remote.ipToStr());
+        return false;
+    }
+
+    auto req = new WriteRequest;
+    req->data.append(std::move(buffer));
+    req->next.store(WriteRequest::unconnected(), std::memory_order_relaxed);
+
+    auto prev = _write_head.exchange(req, std::memory_order_acq_rel);
+    if (nullptr != prev) {
+        //Data will be written by current flusher
+        req->next.store(prev, std::memory_order_release);
+        if (_batch_window_us > 0
+            && _write_pending_bytes.load(std::memory_order_seq_cst)
+               >= _batch_max_bytes) {
+            flushBatch();
+        }
+        return true;
+    }
+
+    //Become flusher
+    req->next.store(nullptr, std::memory_order_relaxed);
+    _write_buf.append(std::move(req->data));
+    _write_tail = req;
+    increase(_write_requests, 1);
+    increase(_write_batches, 1);
+
+    if (_batch_window_us > 0) {
+        if (holdBatch() && takeBatch()) {
+            return flushWrite();
+        }
+        return true;
+    }
+    return flushWrite();
+}
+
+bool Socket::flushWrite() {
+    bool ok = true;
+    while (true) {
+        while (!_write_buf.empty()) {
+            //Socket fd may be closed when writing data, and SIGPIPE will be sent
+            //currently we just ignore SIGPIPE signal
+            ssize_t nw = writeOnce(_write_buf, _write_buf.length());
+            increase(_write_syscalls, 1);
+            if (nw < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN) {
+                    //Socket is not writable, hand off to loop thread. Session
+                    //waiting for response is still limited by its timeout task.
+                    //Data is handed off only after fd is registered, so that
+                    //loop thread never flushes it while registration fails.
+                    std::unique_lock<std::mutex> loop_guard(_loop_mtx);
+                    if (!Schedule::getInstance().modifySchedule(
+                            _fd.fd(), POLLIN | POLLOUT, _on_event, loopIndex())) {
+                        loop_guard.unlock();
+                        LOG_ERROR("add on writable schedule fail!");
+                        setStatus(RPC_STATUS_SOCKET_WRITE_ERROR);
+                        _write_pending_bytes.fetch_sub(
+                                _write_buf.length(), std::memory_order_relaxed);
+                        _write_buf.clear();
+                        ok = false;
+                        break;
+                    }
+                    _write_pending.store(true, std::memory_order_release);
+                    //Writable event may be handled before hand off, register
+                    //again so that it is reported once more if fd is writable
+                    Schedule::getInstance().modifySchedule(
+                            _fd.fd(), POLLIN | POLLOUT, _on_event, loopIndex());
+                    return ok;
+                }
                 LOG_ERROR("Fail to write into {}", _remote.ipToStr());
                 setStatus(RPC_STATUS_SOCKET_WRITE_ERROR);
-                return false;
+                //Drop data, all sessions of this socket will fail or timeout
+                _write_pending_bytes.fetch_sub(
+                        _write_buf.length(), std::memory_order_relaxed);
+                _write_buf.clear();
+                ok = false;
+                break;
             }
+            LOG_DEBUG("write {} to {}", nw, _remote.ipToStr());
+            increase(_write_bytes, nw);
+            _write_pending_bytes.fetch_sub(nw, std::memory_order_seq_cst);
+        }
+
+        if (_write_pending.load(std::memory_order_relaxed)) {
+            //Must be done before giving up flusher, or else it may override
+            //writable event added by next flusher.
+            _write_pending.store(false, std::memory_order_relaxed);
+            std::lock_guard<std::mutex> loop_guard(_loop_mtx);
+            Schedule::getInstance().modifySchedule(
+                    _fd.fd(), POLLIN, _on_event, loopIndex());
+        }
+
+        //Give up flusher if no more request is pushed
+        WriteRequest* newest = _write_tail;
+        if (_write_head.compare_exchange_strong(
+                newest, nullptr, std::memory_order_acq_rel)) {
+            delete _write_tail;
+            _write_tail = nullptr;
+            return ok;
         }
-        LOG_DEBUG("write {} to {}", nw, _remote.ipToStr());
-        cur_size += nw;
+        collectWriteRequests(newest);
+        //Go on flushing if batch is full, instead of calling flushWrite again
+        if (_batch_window_us > 0 && !(holdBatch() && takeBatch())) {
+            return ok;
+        }
+    }
+}
+
+bool Socket::holdBatch() {
+    //Writers increase pending bytes before checking waiting flag, and we
+    //set the flag before checking pending bytes, so at least one of us
+    //sees batch is full.
+    _batch_waiting.store(true, std::memory_order_seq_cst);
+    if (_write_pending_bytes.load(std::memory_order_seq_cst) >= _batch_max_bytes) {
+        return true;
+    }
+
+    //Keep one timer per socket, if timer of an earlier batch is pending,
+    //held data is just flushed earlier
+    if (_batch_timer.exchange(true, std::memory_order_acq_rel)) {
+        return false;
+    }
+    auto self(shared_from_this());
+    auto task_id = Schedule::getInstance().addTimeschdule(
+            Utils::getHighPrecisionTimeStamp() + _batch_window_us,
+            [self]() {
+                self->_batch_timer.store(false, std::memory_order_release);
+                //Write in loop thread of socket, so that timer thread is not
+                //delayed by it, unless loop threads are stopped
+                if (!Schedule::getInstance().runInLoop(
+                        self->loopIndex(), [self]() { self->flushBatch(); })) {
+                    self->flushBatch();
+                }
+            });
+    if (task_id <= 0) {
+        _batch_timer.store(false, std::memory_order_release);
+        return true;
+    }
+    return false;
+}
+
+bool Socket::takeBatch() {
+    if (!_batch_waiting.exchange(false, std::memory_order_acq_rel)) {
+        //Batch has been flushed by others
+        return false;
     }
 
+    //Take requests pushed while holding
+    WriteRequest* newest = _write_head.load(std::memory_order_acquire);
+    if (newest != _write_tail) {
+        collectWriteRequests(newest);
+    }
     return true;
 }
 
+void Socket::flushBatch() {
+    if (takeBatch()) {
+        flushWrite();
+    }
+}
+
+void Socket::collectWriteRequests(WriteRequest* newest) {
+    //Reverse requests from newest to current tail, so that data is written
+    //in order of pushing.
+    WriteRequest* fifo = nullptr;
+    WriteRequest* req = newest;
+    while (req != _write_tail) {
+        WriteRequest* next = nullptr;
+        //Writer links request right after pushing, wait for it
+        while ((next = req->next.load(std::memory_order_acquire))
+               == WriteRequest::unconnected()) {
+            std::this_thread::yield();
+        }
+        req->next.store(fifo, std::memory_order_relaxed);
+        fifo = req;
+        req = next;
+    }
+    delete _write_tail;
+
+    if (_write_buf.empty()) {
+        increase(_write_batches, 1);
+    }
+    size_t num = 0;
+    while (fifo) {
+        WriteRequest* next = fifo->next.load(std::memory_order_relaxed);
+        _write_buf.append(std::move(fifo->data));
+        if (fifo != newest) {
+            delete fifo;
+        }
+        fifo = next;
+        ++num;
+    }
+    newest->next.store(nullptr, std::memory_order_relaxed);
+    _write_tail = newest;
+    increase(_write_requests, num);
+}
+
+ssize_t Socket::writeOnce(IOBuffer& buffer, size_t size_hint) {
+    if (_zero_copy.load(std::memory_order_relaxed)
+        && size_hint >= s_zero_copy_threshold.load(std::memory_order_relaxed)) {
+        return writeZeroCopy(buffer, size_hint);
+    }
+    return buffer.cut_into_file_descriptor(_fd.fd(), size_hint);
+}
+
+ssize_t Socket::writeZeroCopy(IOBuffer& buffer, size_t size_hint) {
+    IOBuffer pinned;
+    ssize_t nw = buffer.cut_into_file_descriptor_zero_copy(
+            _fd.fd(), size_hint, &pinned);
+    if (nw > 0) {
+        //Kernel numbers each successful send, and there is only one
+        //flusher at a time, so sequence is the same as kernel's.
+        std::lock_guard<std::mutex> lock(_zero_copy_mtx);
+        _zero_copy_pending.push_back({_zero_copy_seq++, std::move(pinned)});
+    } else if (nw < 0 && errno == ENOBUFS) {
+        //Pinned memory exceeds socket option memory limit, copy instead
+        nw = buffer.cut_into_file_descriptor(_fd.fd(), size_hint);
+    }
+    return nw;
+}
+
+void Socket::onZeroCopyCompletion() {
+    uint32_t lo = 0;
+    uint32_t hi = 0;
+    bool copied = false;
+    while (base::read_zero_copy_completion(_fd.fd(), lo, hi, copied)) {
+        LOG_DEBUG("zero copy completion [{}, {}], copied:{}", lo, hi, copied);
+        if (copied) {
+            //Kernel copied data anyway, such as loopback device, zero copy
+            //only adds notification overhead.
+            _zero_copy.store(false, std::memory_order_relaxed);
+        }
+        //Completions of tcp socket are in order
+        std::lock_guard<std::mutex> lock(_zero_copy_mtx);
+        while (!_zero_copy_pending.empty()
+               && (int32_t)(_zero_copy_pending.front().seq - hi) <= 0) {
+            _zero_copy_pending.pop_front();
+        }
+    }
+}
+
 void Socket::onRead() {
+    _read_events.store(_read_events.load(std::memory_order_relaxed) + 1,
+                       std::memory_order_relaxed);
     if (UNLIKELY(nullptr == _protocol)) {
         LOG_ERROR("protocol not found.");
         setStatus(RPC_STATUS_SOCKET_READ_ERROR);
         return;
     }
+    s_reading_socket = this;
 
-    constexpr size_t MIN_ONCE_READ = 4096;
     //If last OnRead met some error, as socket may not be closed immediately,
     //OnRead event may still be triggered, in this case, just return and wait
     //for socket's closing.
     bool read_eof = !active();
     size_t total_nr = 0;
 
+    //Error queue is signaled by the same event as read
+    if (_zero_copy_capable) {
+        onZeroCopyCompletion();
+    }
+
     while (!read_eof) {
-        auto nr = _read_buf.append_from_file_descriptor(_fd.fd(), MIN_ONCE_READ);
+        const size_t read_size = nextReadSize();
+        auto nr = _read_buf.append_from_file_descriptor(_fd.fd(), read_size);
         LOG_DEBUG("read receive size:{}", nr);
+        _read_syscalls.store(_read_syscalls.load(std::memory_order_relaxed) + 1,
+                             std::memory_order_relaxed);
 
         if (0 == nr) {
             read_eof = true;
@@ -200,6 +662,9 @@ void Socket::onRead() {
         }
 
         total_nr += nr;
+        _read_bytes.store(_read_bytes.load(std::memory_order_relaxed) + nr,
+                          std::memory_order_relaxed);
+        updateReadHint(read_size, nr);
 
         ssize_t receive_request_id = 0;
         while (true) {
@@ -215,8 +680,11 @@ void Socket::onRead() {
         }
     }
 
+    Schedule::countReadBytes(total_nr);
+
     //Try to release and reclaim unused session
-    tryReclaimSessionMap();
+    s_reading_socket = nullptr;
+    reclaimSessions();
 
     return;
 }
@@ -232,6 +700,9 @@ ssize_t Socket::cutIntoMessage() {
             _read_buf, response_size, receive_request_id, &_read_additional_data);
     if (ret == EResParseResult::PARSE_NOT_ENOUGH_DATA) {
         LOG_DEBUG("parse not enough data");
+        //Protocol like bolt knows message size from header
+        _pending_read_size = response_size > _read_buf.size() ?
+                             response_size - _read_buf.size() : 0;
         return 0;
     } else if (ret == EResParseResult::PARSE_ERROR) {
         LOG_FATAL("parse data fail from: {}, close connection", _remote.ipToStr());
@@ -240,69 +711,210 @@ ssize_t Socket::cutIntoMessage() {
     }
 
     LOG_DEBUG("response data:{}", response_size);
+    _pending_read_size = 0;
+    _responses.store(_responses.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_relaxed);
     _last_active_time_us.store(Utils::getHighPrecisionTimeStamp(),
                                std::memory_order_release);
 
-    size_t on_read_begin_time = Utils::getHighPrecisionTimeStamp();
-    //Set session info to session map for reflect corresponding session
     SocketReadSession* session = nullptr;
-    while (_session_info.pop(session)) {
-        //If session created time is later than onRead time,
-        //it means that session is inserted after onRead occur,
-        //this session has nothing to do with this onRead.
-        LOG_DEBUG("OnRead prepare:{}", session->request_id);
-        auto p = _session_map.emplace(session->request_id, session);
-        if (!p.second) {
-            //Duplicated request id, impossible in normal case
-            LOG_FATAL("IMPOSSIBLE CASE!!!!!MEMORY LEAK!!!!");
-        }
-        if (session->request_time >= on_read_begin_time) {
-            break;
-        }
-    }
-
-    decltype(_session_map)::iterator itr;
     if (_protocol->type == EProtocolType::PROTOCOL_HTTP) {
-        itr = _session_map.begin();
-
+        //Response belongs to the earliest session still waiting
+        std::lock_guard<std::mutex> guard(_ordered_mtx);
+        while (nullptr == session && !_ordered_ids.empty()) {
+            session = _sessions.find(_ordered_ids.front());
+            _ordered_ids.pop_front();
+        }
     } else {
         //find correspond session and send sync notice
-        itr = _session_map.find(receive_request_id);
+        session = _sessions.find(receive_request_id);
     }
-    if (itr == _session_map.end() || nullptr == itr->second) {
+    if (nullptr == session) {
         LOG_WARN("request id {} not found in any session.", receive_request_id);
         _read_buf.pop_front(response_size);
         return receive_request_id;
     }
 
-    session = itr->second;
+    if (_window_adaptive) {
+        adjustWindow(Utils::getHighPrecisionTimeStamp() - session->request_time);
+    }
     _read_buf.cut(&session->read_buf, response_size);
     session->data = _read_additional_data;
     _read_additional_data = nullptr;
 
-    session->notify(ESessionError::SESSION_OK);
+    session->notify(ESessionError::SESSION_OK, this);
 
     return receive_request_id;
 }
 
-void Socket::tryReclaimSessionMap() {
-    for (auto itr = _session_map.begin(); itr != _session_map.end();) {
-        if (nullptr == itr->second) {
-            itr = _session_map.erase(itr);
+size_t Socket::nextReadSize() const {
+    auto size = std::max(_read_hint, _pending_read_size);
+    return std::min(std::max(size, SOCKET_MIN_ONCE_READ), SOCKET_MAX_ONCE_READ);
+}
+
+void Socket::updateReadHint(size_t expect_size, size_t read_size) {
+    if (read_size >= expect_size) {
+        //More data may be left in socket, read more next time
+        _read_hint = std::min(expect_size * 2, SOCKET_MAX_ONCE_READ);
+    } else {
+        _read_hint = (_read_hint * 3 + read_size) / 4;
+    }
+}
+
+bool Socket::tryPrepareRead(SocketReadSession* session) {
+    if (_sessions.size() >= _window.load(std::memory_order_relaxed)) {
+        return false;
+    }
+    return _sessions.add(session);
+}
+
+bool Socket::prepareRead(SocketReadSession *val, size_t deadline_us) {
+    while (!tryPrepareRead(val)) {
+        if (Utils::getHighPrecisionTimeStamp() >= deadline_us
+            || Schedule::getInstance().inScheduleThread()) {
+            return false;
+        }
+
+        std::unique_lock<std::mutex> lock(_window_mtx);
+        _parked.fetch_add(1, std::memory_order_relaxed);
+        //Pairs with fence in @wakeParked, so that either parked session sees
+        //the free slot or the one freeing slot sees parked session
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto has_room = [this]() {
+            return _sessions.size() < _window.load(std::memory_order_relaxed);
+        };
+        if (deadline_us == std::numeric_limits<size_t>::max()) {
+            _window_cond.wait(lock, has_room);
         } else {
-            SocketReadSession* session = itr->second;
-            //Session upgrade status will be set by OnRead thread or timeout thread
-            //when @SocketReadSession::notify is called, and here we just wait for
-            // session sync method and time out thread release shared and then reclaim it
-            if (session->owners.tryExclusive()) {
-                LOG_DEBUG("Reclaim session:{}", session->request_id);
-                delete session;
-                itr = _session_map.erase(itr);
-            } else {
-                ++itr;
+            auto now = Utils::getHighPrecisionTimeStamp();
+            if (deadline_us > now) {
+                _window_cond.wait_for(
+                        lock, std::chrono::microseconds(deadline_us - now), has_room);
             }
         }
+        _parked.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    if (nullptr != _protocol && _protocol->type == EProtocolType::PROTOCOL_HTTP) {
+        std::lock_guard<std::mutex> guard(_ordered_mtx);
+        _ordered_ids.push_back(val->request_id);
     }
+    return true;
+}
+
+void Socket::finishRead(SocketReadSession *val) {
+    if (_sessions.remove(val)) {
+        retire(val);
+        wakeParked(false);
+    }
+}
+
+void Socket::wakeParked(bool all) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_parked.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(_window_mtx);
+    if (all) {
+        _window_cond.notify_all();
+    } else {
+        _window_cond.notify_one();
+    }
+}
+
+void Socket::adjustWindow(size_t latency_us) {
+    ++_window_samples;
+    _window_latency_sum += latency_us;
+    _window_period_min = std::min(_window_period_min, latency_us);
+    size_t window = _window.load(std::memory_order_relaxed);
+    if (_window_samples < window) {
+        return;
+    }
+
+    //The lowest latency is taken as latency without queueing
+    ++_window_periods;
+    if (_window_min_latency == 0
+        || _window_period_min < _window_min_latency
+        || _window_periods % SOCKET_WINDOW_MIN_LATENCY_PERIODS == 0) {
+        _window_min_latency = std::max(_window_period_min, (size_t)1);
+    }
+
+    //Requests are queueing if latency goes beyond tolerance, shrink window
+    //in proportion then, and always leave some room to probe for more
+    size_t average = std::max(_window_latency_sum / _window_samples, (size_t)1);
+    double gradient = SOCKET_WINDOW_LATENCY_TOLERANCE * _window_min_latency / average;
+    gradient = std::max(0.5, std::min(1.0, gradient));
+    size_t next = (size_t)(window * gradient) + (size_t)std::sqrt((double)window);
+    next = std::max(next, std::min(SOCKET_MIN_INFLIGHT_WINDOW, _sessions.capacity()));
+    next = std::min(next, _sessions.capacity());
+    _window.store(next, std::memory_order_relaxed);
+
+    _window_samples = 0;
+    _window_latency_sum = 0;
+    _window_period_min = std::numeric_limits<size_t>::max();
+    if (next > window) {
+        wakeParked(true);
+    }
+}
+
+bool Socket::cancelRead(SocketReadSession *val) {
+    //Mark session notified, so that neither response nor timeout notifies it
+    if (val->notified.exchange(true, std::memory_order_acq_rel)) {
+        return false;
+    }
+    finishRead(val);
+    return true;
+}
+
+void Socket::retire(SocketReadSession* session) {
+    auto head = _retired.load(std::memory_order_relaxed);
+    do {
+        session->next_retired = head;
+    } while (!_retired.compare_exchange_weak(
+            head, session, std::memory_order_release, std::memory_order_relaxed));
+
+    //Sessions left during read event are reclaimed after it, others are
+    //reclaimed by loop thread at once, as no response may ever come again
+    if (nullptr == head && s_reading_socket != this) {
+        postReclaim();
+    }
+}
+
+void Socket::postReclaim() {
+    std::weak_ptr<Socket> weak_self = shared_from_this();
+    auto idx = loopIndex();
+    //If loop threads are stopped, retired sessions are released with socket
+    Schedule::getInstance().runInLoop(idx, [weak_self, idx]() {
+        auto self = weak_self.lock();
+        if (!self) {
+            return;
+        }
+        //Tasks run out of read events, and socket is read by its loop thread
+        //only, unless it has moved to another loop thread
+        if (self->loopIndex() == idx) {
+            self->reclaimSessions();
+        } else {
+            self->postReclaim();
+        }
+    });
+}
+
+void Socket::reclaimSessions() {
+    //Read thread may still use session found from slot after another thread
+    //makes it leave slot, so slot reference is released here when read event
+    //is done and no session found from slots is in use. Sessions left before
+    //are never found again, which makes each read event an epoch.
+    SocketReadSession* retired = _retired.exchange(nullptr, std::memory_order_acquire);
+    while (nullptr != retired) {
+        auto next = retired->next_retired;
+        LOG_DEBUG("Release session:{}", retired->request_id);
+        retired->releaseRef();
+        retired = next;
+    }
+}
+
+void setSocketZeroCopyThreshold(size_t bytes) {
+    s_zero_copy_threshold.store(bytes, std::memory_order_relaxed);
 }
 
 }
@@ -6,15 +6,17 @@
 #define RPC_TCP_SOCKET_H
 
 #include <vector>
-#include <unordered_map>
+#include <memory>
+#include <limits>
+#include <deque>
 #include <mutex>
+#include <condition_variable>
 #include <functional>
 #include <future>
 #include "socket_base.h"
 #include "common/common_defines.h"
 #include "common/io_buffer.h"
 #include "common/life_cycle_lock.h"
-#include "common/lockfree_queue.h"
 
 namespace antflash {
 
@@ -28,7 +30,14 @@ struct SocketReadSession {
         SUCCESS,
         FAIL
     };
-    //Request ID
+
+    //Created with the reference held by its slot in socket
+    SocketReadSession() :
+            refs(1),
+            notified(false),
+            data(nullptr),
+            next_retired(nullptr) {}
+    //Request ID, set by socket when session is prepared to read
     size_t request_id;
 
     //Request time
@@ -36,6 +45,9 @@ struct SocketReadSession {
 
     //Async session callback
     std::function<void(ESessionError, ResponseBase*)> callback;
+    //Executor running callback out of loop and timer threads, callback runs
+    //in place if not set
+    std::shared_ptr<CallbackExecutor> executor;
     ResponseBase* response;
     size_t expire_time;
     size_t timer_task_id;
@@ -46,8 +58,11 @@ struct SocketReadSession {
     //Protocol that session used
     const Protocol* protocol;
 
-    //life cycle and owner status
-    LifeCycleLock owners;
+    //References of slot in socket, timeout task and sync waiting thread,
+    //the last one releasing reference deletes session
+    std::atomic<int32_t> refs;
+    //Set by the first one of response, timeout and cancel
+    std::atomic<bool> notified;
 
     //read buffer
     IOBuffer read_buf;
@@ -55,51 +70,34 @@ struct SocketReadSession {
     //other data info
     void* data;
 
+    //Link of sessions left slots and waiting for slot reference released
+    SocketReadSession* next_retired;
+
+    inline void addRef() {
+        refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    inline void releaseRef() {
+        if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete this;
+        }
+    }
+
     /**
      * To notify session and do post process when receive data or timeout.
-     * As notify could be called by two thread:OnRead thread and Timeout thread,
-     * and read session memory is always reclaimed by OnRead thread. We should
-     * make sure timeout event always happen and release shared status in timeout
-     * event. There are two scenarios:
-     * 1, OnRead happens before timeout: OnRead upgrade owner success and go on
-     *   dealing post process and timeout thread try upgrade fail, timeout thread
-     *   just release shared status.
-     * 2, OnRead happens after timeout: OnRead upgrade owner fail and timeout thread
-     *   deals with post process and then release shared status.
-     * For Sync case: No matter which thread notify waiting work thread, add shared
-     * num before notify, and make sure memory not be reclaimed during work thread
-     * doing post process.
-     * As session memory is reclaimed in OnRead thread, so reclaim action and notify
-     * wouldn't happen at same time in OnRead thread, we don't need to worry about
-     * session memory segment in OnRead thread.
+     * Notify could be called by OnRead thread and Timeout thread, and only the
+     * first one takes effect. Each of them holds a reference during notifying:
+     * timeout thread holds its own one, and OnRead thread relies on the slot
+     * reference, which is only released by OnRead thread after this read event
+     * (see @Socket::reclaimSessions).
+     * For Sync case, working thread holds its own reference, so session is kept
+     * until it finishes post process.
+     * The one who notifies session successfully makes session leave its slot
+     * in @socket before callback, so that callback can send request again.
      * @param err session error code
+     * @param socket socket session waits on, nullptr if socket is gone
      */
-    inline bool notify(ESessionError err) {
-        //If shared fail, it means the other thread holds upgrade
-        if (!owners.tryShared()) {
-            return false;
-        }
-
-        //If upgrade fail, it means the other thread holds upgrade
-        bool notify_result = false;
-        if (owners.tryUpgradeNonReEntrant()) {
-            notify_result = true;
-            //For async case
-            if (callback) {
-                postProcess(err);
-                callback(err, response);
-            } else {
-                //In sync case, set promise and return, in this step
-                //owners has two shared owner, one for timeout thread,
-                //one for sync working thread.
-                result.set_value(err);
-                return notify_result;
-            }
-        }
-        //Release sync shared status if sync fail or in async case
-        owners.releaseShared();
-        return notify_result;
-    }
+    inline bool notify(ESessionError err, Socket* socket);
 
     /**
      * Post process when receive data or timeout. For some protocol like
@@ -109,17 +107,141 @@ struct SocketReadSession {
      * @param error
      */
     void postProcess(ESessionError& error);
+
+    /**
+     * Post process and call callback of async session, by executor if it is
+     * set and notifying thread is loop or timer thread. Task of executor holds
+     * its own reference of session.
+     * @param err session error code
+     */
+    void dispatchCallback(ESessionError err);
+};
+
+/**
+ * Read statistics of socket, only modified by read thread.
+ */
+struct SocketReadStats {
+    //Times of read system call, including EAGAIN
+    size_t read_syscalls;
+    //Bytes read from socket
+    size_t read_bytes;
+    //Messages cut from read buffer
+    size_t responses;
+};
+
+/**
+ * Write statistics of socket.
+ */
+struct SocketWriteStats {
+    //Times of write system call, including EAGAIN
+    size_t write_syscalls;
+    //Bytes written into socket
+    size_t write_bytes;
+    //Buffers passed to write
+    size_t requests;
+    //Batches of requests merged and written together, average batch size is
+    //requests / batches, or write_bytes / batches in bytes.
+    size_t batches;
+};
+
+/**
+ * Slots of sessions waiting for response on one socket. Request id is made of
+ * slot index in low bits and generation of the slot in high bits, so response
+ * finds its session by index directly, and response of a session which has
+ * left the slot is told by generation. Request id is no more than 32 bits to
+ * fit protocol like bolt. Slots are taken and freed by any thread through a
+ * lock free list, and sessions are only deleted by read thread, so session
+ * found by read thread stays valid even if it leaves slot at the same time.
+ */
+class SessionSlots {
+public:
+    explicit SessionSlots(size_t capacity);
+
+    SessionSlots(const SessionSlots&) = delete;
+    SessionSlots& operator=(const SessionSlots&) = delete;
+
+    //Put session to a free slot and set its request id, fail if all slots are taken
+    bool add(SocketReadSession* session);
+    //Free slot of session if it is still there
+    bool remove(SocketReadSession* session);
+    //Session of request id, or nullptr if not found
+    SocketReadSession* find(size_t request_id) const;
+
+    size_t capacity() const {
+        return _capacity;
+    }
+
+    size_t size() const {
+        return _size.load(std::memory_order_relaxed);
+    }
+
+    //Session in slot of index, only used when no one else uses slots
+    SocketReadSession* at(size_t index) const {
+        return _slots[index].session.load(std::memory_order_acquire);
+    }
+
+private:
+    struct Slot {
+        std::atomic<SocketReadSession*> session;
+        std::atomic<uint32_t> next_free;
+        uint32_t generation;
+    };
+    static constexpr uint32_t NO_SLOT = std::numeric_limits<uint32_t>::max();
+
+    void pushFree(uint32_t index);
+
+    size_t _capacity;
+    uint32_t _index_bits;
+    uint32_t _generation_mask;
+    std::unique_ptr<Slot[]> _slots;
+    //Index of first free slot in low 32 bits and ABA tag in high 32 bits
+    alignas(SIZE_OF_AVOID_FALSE_SHARING) std::atomic<uint64_t> _free_head;
+    alignas(SIZE_OF_AVOID_FALSE_SHARING) std::atomic<size_t> _size;
 };
 
 class Socket : public std::enable_shared_from_this<Socket> {
 friend class SocketManager;
 public:
-    Socket(const EndPoint& remote) :
+    Socket(const EndPoint& remote,
+           size_t max_sessions = MAX_PARALLEL_SESSION_SIZE_ON_SOCKET) :
             _remote(remote),
+            _loop_idx(-1),
+            _loop_attached(false),
+            _migrate_to(-1),
+            _rebalance_mark(0),
             _status(RPC_STATUS_INIT),
-            _session_info(MAX_PARALLEL_SESSION_SIZE_ON_SOCKET),
+            _read_hint(SOCKET_MIN_ONCE_READ),
+            _pending_read_size(0),
+            _read_syscalls(0),
+            _read_events(0),
+            _read_bytes(0),
+            _responses(0),
+            _sessions(max_sessions),
+            _retired(nullptr),
+            _window(_sessions.capacity()),
+            _window_adaptive(false),
+            _parked(0),
+            _window_samples(0),
+            _window_latency_sum(0),
+            _window_period_min(std::numeric_limits<size_t>::max()),
+            _window_min_latency(0),
+            _window_periods(0),
+            _zero_copy_capable(false),
+            _zero_copy(false),
+            _zero_copy_seq(0),
+            _write_head(nullptr),
+            _write_tail(nullptr),
+            _write_pending_bytes(0),
+            _write_pending(false),
+            _write_syscalls(0),
+            _write_bytes(0),
+            _write_requests(0),
+            _write_batches(0),
+            _batch_window_us(0),
+            _batch_max_bytes(0),
+            _batch_waiting(false),
+            _batch_timer(false),
             _read_additional_data(nullptr) {
-        _session_map.reserve(MAX_PARALLEL_SESSION_SIZE_ON_SOCKET);
     }
     ~Socket();
 
@@ -131,6 +253,24 @@ public:
         return _fd.fd();
     }
 
+    //Index of schedule loop thread handling this socket
+    int loopIndex() const {
+        return _loop_idx.load(std::memory_order_relaxed);
+    }
+
+    //Move socket to loop thread of @idx, which is done by current loop thread
+    //next time socket is read
+    void migrateLoop(int idx) {
+        _migrate_to.store(idx, std::memory_order_relaxed);
+    }
+
+    //Events and bytes read by socket in unit of load score of loop threads
+    size_t loadCounter() const {
+        return _read_events.load(std::memory_order_relaxed)
+               + _read_bytes.load(std::memory_order_relaxed)
+                 / LOOP_LOAD_BYTES_PER_EVENT;
+    }
+
     /**
      * return socket's related remote endpoint
      * @return endpoint
@@ -143,18 +283,52 @@ public:
     const Protocol* getProtocol() const;
 
     bool connect(int32_t connect_timeout_ms = -1);
+    //Connect without blocking, returned future is ready with result when
+    //socket is connected, fails or times out, and @on_done is called with
+    //the same result before that in thread of schedule or timer.
+    std::shared_future<bool> connectAsync(
+            int32_t connect_timeout_ms = -1,
+            std::function<void(bool)> on_done = std::function<void(bool)>());
     void disconnect();
     bool active() {
         return _status.load(std::memory_order_relaxed) == RPC_STATUS_OK;
     }
     bool write(IOBuffer& buffer, int32_t timeout_ms);
 
+    //Hold writes for at most @window_us or until @max_bytes data is held,
+    //and then write them together. Should be set before connecting.
+    void setWriteBatch(size_t window_us, size_t max_bytes) {
+        _batch_window_us = window_us;
+        _batch_max_bytes = max_bytes;
+    }
+
     size_t get_last_active_time() const {
         return _last_active_time_us.load(std::memory_order_acquire);
     }
 
-    bool prepareRead(SocketReadSession *val) {
-        return _session_info.push(val);
+    //Take a slot for session to wait for response and set its request id.
+    //If in flight window is full, wait until a slot is free or @deadline_us,
+    //except in schedule threads, which free slots and never wait.
+    bool prepareRead(SocketReadSession *val, size_t deadline_us = 0);
+    //Session is notified and leaves its slot, and slot reference is released
+    //after current read event. Only called by the one who notifies session.
+    void finishRead(SocketReadSession *val);
+    //Give up waiting for response of session, fail if session has been
+    //notified by response or timeout
+    bool cancelRead(SocketReadSession *val);
+
+    size_t waitingSessions() const {
+        return _sessions.size();
+    }
+
+    //Tune in flight window between SOCKET_MIN_INFLIGHT_WINDOW and max sessions
+    //of socket by observed latency. Should be set before connecting.
+    void setAdaptiveWindow(bool adaptive) {
+        _window_adaptive = adaptive;
+    }
+
+    size_t inflightWindow() const {
+        return _window.load(std::memory_order_relaxed);
     }
 
     inline bool tryShared() {
@@ -186,37 +360,172 @@ public:
         _status.store(fail, std::memory_order_relaxed);
     }
 
+    SocketWriteStats getWriteStats() const {
+        return {_write_syscalls.load(std::memory_order_relaxed),
+                _write_bytes.load(std::memory_order_relaxed),
+                _write_requests.load(std::memory_order_relaxed),
+                _write_batches.load(std::memory_order_relaxed)};
+    }
+
+    SocketReadStats getReadStats() const {
+        return {_read_syscalls.load(std::memory_order_relaxed),
+                _read_bytes.load(std::memory_order_relaxed),
+                _responses.load(std::memory_order_relaxed)};
+    }
+
 private:
     void onRead();
-    void tryReclaimSessionMap();
+    void moveLoop();
+    void finishConnect(bool timeout);
+    struct WriteRequest;
+    bool flushWrite();
+    //Hold written data until batch window passes, return whether batch is
+    //full and should be flushed at once
+    bool holdBatch();
+    //Take held batch to flush, false if it has been taken by others
+    bool takeBatch();
+    void flushBatch();
+    void collectWriteRequests(WriteRequest* newest);
+    ssize_t writeOnce(IOBuffer& buffer, size_t size_hint);
+    bool tryPrepareRead(SocketReadSession* session);
+    void wakeParked(bool all);
+    void adjustWindow(size_t latency_us);
+    void retire(SocketReadSession* session);
+    void reclaimSessions();
+    //Reclaim retired sessions in loop thread out of read events
+    void postReclaim();
     ssize_t cutIntoMessage();
+    size_t nextReadSize() const;
+    void updateReadHint(size_t expect_size, size_t read_size);
+    ssize_t writeZeroCopy(IOBuffer& buffer, size_t size_hint);
+    void onZeroCopyCompletion();
 
     struct SocketConnection {
         int32_t timeout_ms;
         std::function<void()> on_connection;
+        //Set by the first of connected event and timeout
+        std::atomic<bool> done;
+        std::promise<bool> result;
+        std::function<void(bool)> on_done;
     };
 
     EndPoint _remote;
 
     base::FdGuard _fd;
+    //Loop thread of socket is changed by itself only when it is read, and
+    //changes of schedule after connected are guarded by mutex
+    std::mutex _loop_mtx;
+    std::atomic<int> _loop_idx;
+    bool _loop_attached;
+    std::atomic<int> _migrate_to;
+    //Load counter when socket manager rebalanced loop threads last time
+    size_t _rebalance_mark;
     SocketConnection _connection;
     std::atomic<ERpcStatus> _status;
 
-    std::function<void()> _on_read;
+    //Handle both readable and writable events of fd
+    std::function<void()> _on_event;
     const Protocol* _protocol;
     IOBuffer _read_buf;
 
-    MPSCQueue<SocketReadSession*> _session_info;
-    std::unordered_map<size_t, SocketReadSession*> _session_map;
+    //Size of next read, grow when read fills buffer, or else decay to
+    //moving average of recent read size
+    size_t _read_hint;
+    //Left size of message which is partially received
+    size_t _pending_read_size;
+
+    std::atomic<size_t> _read_syscalls;
+    //Times socket is read by loop thread, for load of loop threads
+    std::atomic<size_t> _read_events;
+    std::atomic<size_t> _read_bytes;
+    std::atomic<size_t> _responses;
+
+    SessionSlots _sessions;
+    //Request ids in sending order, only for protocol like http whose
+    //response carries no request id
+    std::mutex _ordered_mtx;
+    std::deque<size_t> _ordered_ids;
+    //Sessions left slots are pushed here by any thread, and read thread
+    //releases their slot references when it does not hold any session found
+    //from slots, which is after each read event, or in a task of loop thread
+    //if sessions are left out of read events
+    std::atomic<SocketReadSession*> _retired;
+
+    //Sessions beyond window wait on condition until a slot is free, and
+    //window is tuned by read thread from latency of each period of window
+    //responses if adaptive.
+    std::atomic<size_t> _window;
+    bool _window_adaptive;
+    std::atomic<size_t> _parked;
+    std::mutex _window_mtx;
+    std::condition_variable _window_cond;
+    size_t _window_samples;
+    size_t _window_latency_sum;
+    size_t _window_period_min;
+    size_t _window_min_latency;
+    size_t _window_periods;
+
+    //Data sent by MSG_ZEROCOPY is kept until kernel notifies completion,
+    //and notifications are read from error queue in read thread.
+    struct ZeroCopySend {
+        uint32_t seq;
+        IOBuffer data;
+    };
+    bool _zero_copy_capable;
+    std::atomic<bool> _zero_copy;
+    uint32_t _zero_copy_seq;
+    std::mutex _zero_copy_mtx;
+    std::deque<ZeroCopySend> _zero_copy_pending;
 
     std::atomic<size_t> _last_active_time_us;
-    std::recursive_mutex _write_mtx;
+
+    //Writers push requests to a lock free list, the one who finds list
+    //empty becomes flusher and writes data of all requests in list. If fd
+    //is not writable, flusher hands off to loop thread, which goes on
+    //flushing when writable event comes. Flusher owns write buffer and
+    //tail, which is the newest request whose data is in write buffer.
+    std::atomic<WriteRequest*> _write_head;
+    WriteRequest* _write_tail;
+    IOBuffer _write_buf;
+    std::atomic<size_t> _write_pending_bytes;
+    std::atomic<bool> _write_pending;
+
+    std::atomic<size_t> _write_syscalls;
+    std::atomic<size_t> _write_bytes;
+    std::atomic<size_t> _write_requests;
+    std::atomic<size_t> _write_batches;
+
+    //Flusher holds its role without writing when batching, and the role is
+    //taken by timer or writer who makes held data reach max bytes.
+    size_t _batch_window_us;
+    size_t _batch_max_bytes;
+    std::atomic<bool> _batch_waiting;
+    //Whether batch timer of socket is pending, at most one at a time
+    std::atomic<bool> _batch_timer;
+
     LifeCycleLock _sharers;
 
     //TODO use more effective and proper way to transfer data
     void* _read_additional_data;
 };
 
+inline bool SocketReadSession::notify(ESessionError err, Socket* socket) {
+    if (notified.exchange(true, std::memory_order_acq_rel)) {
+        return false;
+    }
+
+    if (nullptr != socket) {
+        socket->finishRead(this);
+    }
+    //For async case
+    if (callback) {
+        dispatchCallback(err);
+    } else {
+        result.set_value(err);
+    }
+    return true;
+}
+
 }
 
 #endif //RPC_TCP_SOCKET_H
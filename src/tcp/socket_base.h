@@ -12,6 +12,17 @@
 #include <sys/un.h>
 #include "tcp/endpoint.h"
 
+#if defined(OS_LINUX)
+//Zero copy send is supported since linux 4.14, define flags in case that
+//headers of libc are older than kernel.
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#endif
+
 namespace antflash {
 
 namespace base {
@@ -73,8 +84,8 @@ private:
     int _fd;
 };
 
-FdGuard create_socket();
-bool prepare_socket(FdGuard& fd);
+FdGuard create_socket(const EndPoint& remote);
+bool prepare_socket(FdGuard& fd, const EndPoint& remote);
 int connect(FdGuard& fd, EndPoint& remote);
 bool connected(FdGuard& fd);
 
@@ -82,6 +93,19 @@ bool set_blocking(int fd);
 bool set_non_blocking(int fd);
 bool set_close_on_exec(int fd);
 bool set_no_delay(int socket);
+bool set_zero_copy(int socket);
+//SO_BUSY_POLL, linux only
+bool set_busy_poll(int socket, int us);
+//Cpu on which last packet of socket is handled by kernel, SO_INCOMING_CPU,
+//linux only, -1 if unknown
+int incoming_cpu(int socket);
+
+//Read one notification of MSG_ZEROCOPY from socket error queue, sends
+//numbered in [lo, hi] are completed and their memory could be reused.
+//@copied is set if kernel copied data instead. Return false if there is
+//no more notification.
+bool read_zero_copy_completion(int socket, uint32_t& lo, uint32_t& hi,
+                               bool& copied);
 
 }
 }
@@ -4,40 +4,17 @@
 
 #include "socket_manager.h"
 #include <future>
-#include <poll.h>
 #include "common/utils.h"
 #include "session/session.h"
 #include "schedule/schedule.h"
 #include "common/log.h"
+#include "rpc.h"
 
 namespace antflash {
 
 bool SocketManager::init() {
     _exit.store(false, std::memory_order_release);
 
-    int reclaim_fd[2];
-    reclaim_fd[0] = -1;
-    reclaim_fd[1] = -1;
-    if (pipe(reclaim_fd) != 0) {
-        return false;
-    }
-    _reclaim_fd[0] = reclaim_fd[0];
-    _reclaim_fd[1] = reclaim_fd[1];
-
-    auto size = Schedule::getInstance().scheduleThreadSize();
-    _on_reclaim.reserve(size);
-    _reclaim_notify_flag.resize(size, false);
-    for (size_t i = 0; i < size; ++i) {
-        _on_reclaim.emplace_back([this, i]() {
-            _reclaim_notify_flag[i] = true;
-            Schedule::getInstance().removeSchedule(
-                    _reclaim_fd[1].fd(), POLLOUT, i);
-            std::lock_guard<std::mutex> guard(_reclaim_mtx);
-            _reclaim_notify.notify_one();
-        });
-    }
-
-
     _thread.reset(new std::thread([this](){
         while (!_exit.load(std::memory_order_acquire)) {
             watchConnections();
@@ -72,7 +49,8 @@ void SocketManager::destroy() {
 
     //As socket manager is destroyed after schedule manager, clear reclaim list directly
     for (auto socket : _reclaim_list) {
-       socket->_on_read = std::function<void()>();
+       socket->_on_event = std::function<void()>();
+       socket->_connection.on_connection = std::function<void()>();
        LOG_DEBUG("reset socket:{}", socket->fd());
     }
     _reclaim_list.clear();
@@ -109,41 +87,38 @@ void SocketManager::watchConnections() {
         }
     }
 
-    //2. Try to reclaim socket
-    if (!_reclaim_list.empty()) {
-        size_t schedule_size = Schedule::getInstance().scheduleThreadSize();
-        size_t cur_idx = _reclaim_counter++ % schedule_size;
-        _reclaim_notify_flag[cur_idx] = false;
-
-        Schedule::getInstance().addSchedule(
-                _reclaim_fd[1].fd(), POLLOUT,
-                _on_reclaim[cur_idx], cur_idx);
-
-        std::unique_lock<std::mutex> lock(_reclaim_mtx);
-        auto status = _reclaim_notify.wait_for(
-                lock, std::chrono::milliseconds(500),
-                [this, cur_idx]() {
-                    return _reclaim_notify_flag[cur_idx];
-                });
-
-        //Receiving notify successfully from schedule must happen in next loop as
-        //adding schedule of reclaim is after removing schedule of sockets.
-        //And in this case, sockets can be reclaimed safety.
-        if (status) {
-            for (auto itr = _reclaim_list.begin(); itr != _reclaim_list.end();) {
-                if (((*itr)->fd() % schedule_size) == cur_idx) {
-                    //release socket shared_from_this so that memory can be reclaimed
-                    (*itr)->_on_read = std::function<void()>();
-                    LOG_DEBUG("reset socket:{}", (*itr)->fd());
-                    itr = _reclaim_list.erase(itr);
-                } else {
-                    ++itr;
-                }
-            }
+    //2. Try to reclaim socket in its loop thread. Task runs after events
+    //polled before disconnecting are handled, and no more event of socket
+    //is polled then, so handlers can be released safely.
+    for (auto itr = _reclaim_list.begin(); itr != _reclaim_list.end();) {
+        auto socket = *itr;
+        bool posted = Schedule::getInstance().runInLoop(
+                socket->loopIndex(), [socket]() {
+            //release socket shared_from_this so that memory can be reclaimed
+            socket->_on_event = std::function<void()>();
+            socket->_connection.on_connection = std::function<void()>();
+            LOG_DEBUG("reset socket:{}", socket->fd());
+        });
+        if (posted) {
+            itr = _reclaim_list.erase(itr);
+        } else {
+            ++itr;
         }
     }
 
-    //3. send heartbeat to watch sockets
+    //3. Move busy socket from busiest loop thread to idlest one
+    if (Schedule::getInstance().loopRebalance()) {
+        rebalanceLoops(sockets);
+    }
+
+    //4. Ask threads which have been idle to give back cached io buffer blocks
+    auto now = Utils::getSteadyTimeStampMicro();
+    if (now - _trim_us >= IO_BUFFER_IDLE_TRIM_US) {
+        _trim_us = now;
+        trimIOBufferThreadCaches(true);
+    }
+
+    //5. send heartbeat to watch sockets
     for (auto& socket : sockets) {
         //If socket status is not active, and still in watch list, it means
         //this socket is not used by any other session yet, just skip it
@@ -180,4 +155,55 @@ void SocketManager::watchConnections() {
     }
 }
 
+void SocketManager::rebalanceLoops(
+        std::vector<std::shared_ptr<Socket>>& sockets) {
+    auto now = Utils::getSteadyTimeStampMicro();
+    auto period = now - _rebalance_us;
+    bool first = (_rebalance_us == 0);
+    _rebalance_us = now;
+
+    //Rate of each socket in unit of load score since last round
+    std::vector<size_t> rates(sockets.size(), 0);
+    for (size_t i = 0; i < sockets.size(); ++i) {
+        auto counter = sockets[i]->loadCounter();
+        if (!first && period > 0 && counter >= sockets[i]->_rebalance_mark) {
+            rates[i] = (counter - sockets[i]->_rebalance_mark)
+                       * 1000000UL / period;
+        }
+        sockets[i]->_rebalance_mark = counter;
+    }
+    if (first) {
+        return;
+    }
+
+    int busy = -1;
+    int idle = -1;
+    size_t gap = 0;
+    if (!Schedule::getInstance().loopsToRebalance(busy, idle, gap)) {
+        return;
+    }
+
+    //Moving socket whose rate is half of gap balances two loop threads best,
+    //and socket busier than gap only moves the imbalance elsewhere
+    size_t target = gap / 2;
+    ssize_t chosen = -1;
+    size_t min_diff = std::numeric_limits<size_t>::max();
+    for (size_t i = 0; i < sockets.size(); ++i) {
+        if (sockets[i]->loopIndex() != busy || !sockets[i]->active()
+            || rates[i] == 0 || rates[i] >= gap) {
+            continue;
+        }
+        auto diff = rates[i] > target ? rates[i] - target : target - rates[i];
+        if (diff < min_diff) {
+            min_diff = diff;
+            chosen = i;
+        }
+    }
+    if (chosen >= 0) {
+        LOG_INFO("move socket[{}] from loop {} to loop {}",
+                 sockets[chosen]->fd(), busy, idle);
+        sockets[chosen]->migrateLoop(idle);
+    }
+}
+
 }
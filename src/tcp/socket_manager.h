@@ -9,7 +9,6 @@
 #include <thread>
 #include <list>
 #include <mutex>
-#include <condition_variable>
 #include "socket.h"
 
 namespace antflash {
@@ -27,23 +26,22 @@ public:
 
 private:
     SocketManager() : _exit(false),
-                      _reclaim_counter(0) {}
+                      _rebalance_us(0),
+                      _trim_us(0) {}
     ~SocketManager() {
         destroy();
     }
 
     void watchConnections();
+    void rebalanceLoops(std::vector<std::shared_ptr<Socket>>& sockets);
 
     std::atomic<bool> _exit;
     std::unique_ptr<std::thread> _thread;
     std::list<std::shared_ptr<Socket>> _list;
     std::list<std::shared_ptr<Socket>> _reclaim_list;
-    base::FdGuard _reclaim_fd[2];
-    std::vector<std::function<void()>> _on_reclaim;
-    std::mutex _reclaim_mtx;
-    std::condition_variable _reclaim_notify;
-    std::vector<bool> _reclaim_notify_flag;
-    size_t _reclaim_counter;
+    size_t _rebalance_us;
+    //Last time idle threads were asked to trim io buffer caches
+    size_t _trim_us;
     std::mutex _mtx;
 };
 
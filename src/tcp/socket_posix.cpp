@@ -4,9 +4,20 @@
 
 #include "socket_base.h"
 #include <errno.h>
+#include <cstring>
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <sys/un.h>
+#if defined(OS_LINUX)
+#include <linux/errqueue.h>
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+#endif
 
 namespace antflash {
 namespace base {
@@ -43,22 +54,92 @@ bool set_no_delay(int socket) {
                            TCP_NODELAY, (char*)&flag, sizeof(flag));
 }
 
+bool set_zero_copy(int socket) {
+#if defined(OS_LINUX)
+    int flag = 1;
+    return 0 == setsockopt(socket, SOL_SOCKET,
+                           SO_ZEROCOPY, (char*)&flag, sizeof(flag));
+#else
+    return false;
+#endif
+}
 
-FdGuard create_socket() {
-    return FdGuard(socket(AF_INET, SOCK_STREAM, 0));
+bool set_busy_poll(int socket, int us) {
+#if defined(OS_LINUX)
+    return 0 == setsockopt(socket, SOL_SOCKET,
+                           SO_BUSY_POLL, (char*)&us, sizeof(us));
+#else
+    return false;
+#endif
 }
 
-bool prepare_socket(FdGuard& fd) {
+int incoming_cpu(int socket) {
+#if defined(OS_LINUX) && defined(SO_INCOMING_CPU)
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (0 == getsockopt(socket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len)) {
+        return cpu;
+    }
+#endif
+    return -1;
+}
+
+bool read_zero_copy_completion(int socket, uint32_t& lo, uint32_t& hi,
+                               bool& copied) {
+#if defined(OS_LINUX)
+    char control[128];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    while (recvmsg(socket, &msg, MSG_ERRQUEUE) >= 0) {
+        for (auto cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                  || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            auto err = (struct sock_extended_err*)CMSG_DATA(cm);
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            lo = err->ee_info;
+            hi = err->ee_data;
+            copied = err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED;
+            return true;
+        }
+        //Not a zero copy notification, skip it
+        msg.msg_controllen = sizeof(control);
+    }
+#endif
+    return false;
+}
+
+FdGuard create_socket(const EndPoint& remote) {
+    return FdGuard(socket(remote.isUnix() ? AF_UNIX : AF_INET, SOCK_STREAM, 0));
+}
+
+bool prepare_socket(FdGuard& fd, const EndPoint& remote) {
 #if defined(OS_MACOSX)
     const int value = 1;
     setsockopt(fd.fd(), SOL_SOCKET, SO_NOSIGPIPE, &value, sizeof(int));
 #endif
     return set_non_blocking(fd.fd())
            && set_close_on_exec(fd.fd())
-           && set_no_delay(fd.fd());
+           && (remote.isUnix() || set_no_delay(fd.fd()));
 }
 
 int connect(FdGuard& fd, EndPoint& remote) {
+    if (remote.isUnix()) {
+        struct sockaddr_un addr;
+        bzero((char*)&addr, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        //Length is checked when parsing endpoint
+        strncpy(addr.sun_path, remote.unix_path.c_str(),
+                sizeof(addr.sun_path) - 1);
+        return connect(fd.fd(), (struct sockaddr*)&addr, sizeof(addr));
+    }
+
     struct sockaddr_in addr;
     bzero((char*)&addr, sizeof(addr));
     addr.sin_family = AF_INET;
@@ -0,0 +1,218 @@
+// Copyright (c) 2018 Ant Financial, Inc. All Rights Reserved
+//
+
+#include "common/block_pool.h"
+#include <gtest/gtest.h>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <future>
+#include <vector>
+#include "common/io_buffer.h"
+#include "common/utils.h"
+#include "rpc.h"
+
+using namespace antflash;
+
+TEST(BlockPoolTest, sizeClass) {
+    auto block = BlockPool::acquire(1);
+    ASSERT_NE(block, nullptr);
+    ASSERT_EQ(block->size_class, 0U);
+    ASSERT_EQ(block->capacity + sizeof(Block), BlockPool::sizeOfClass(0));
+    BlockPool::release(block);
+
+    block = BlockPool::acquire(BUFFER_DEFAULT_BLOCK_SIZE + 1);
+    ASSERT_NE(block, nullptr);
+    ASSERT_EQ(block->size_class, 1U);
+    ASSERT_EQ(block->capacity + sizeof(Block), BlockPool::sizeOfClass(1));
+    BlockPool::release(block);
+
+    block = BlockPool::acquire(BUFFER_MAX_SLICE_SIZE + 1);
+    ASSERT_NE(block, nullptr);
+    ASSERT_EQ(block->size_class, BlockPool::NONE_SIZE_CLASS);
+    ASSERT_EQ(block->owner, nullptr);
+    ASSERT_EQ(block->capacity + sizeof(Block), BUFFER_MAX_SLICE_SIZE + 1);
+    BlockPool::release(block);
+}
+
+TEST(BlockPoolTest, localReuse) {
+    auto block = BlockPool::acquire();
+    block->size = 100;
+    BlockPool::release(block);
+
+    auto before = BlockPool::stats();
+    auto reused = BlockPool::acquire();
+    auto after = BlockPool::stats();
+    ASSERT_EQ(reused, block);
+    ASSERT_EQ(reused->size, 0U);
+    ASSERT_EQ(after.reused_blocks, before.reused_blocks + 1);
+    ASSERT_EQ(after.allocated_blocks, before.allocated_blocks);
+    BlockPool::release(reused);
+}
+
+TEST(BlockPoolTest, refCount) {
+    auto block = BlockPool::acquire();
+    ASSERT_EQ(block->refCount(), 1U);
+    block->incRef();
+    std::thread th([block]() {
+        block->decRef();
+    });
+    th.join();
+    ASSERT_EQ(block->refCount(), 1U);
+
+    auto before = BlockPool::stats();
+    block->decRef();
+    auto reused = BlockPool::acquire();
+    ASSERT_EQ(reused, block);
+    ASSERT_EQ(BlockPool::stats().reused_blocks, before.reused_blocks + 1);
+    reused->decRef();
+}
+
+TEST(BlockPoolTest, remoteRelease) {
+    auto block = BlockPool::acquire();
+    auto before = BlockPool::stats();
+    std::thread th([block]() {
+        BlockPool::release(block);
+    });
+    th.join();
+    auto after = BlockPool::stats();
+    ASSERT_EQ(after.remote_freed_blocks, before.remote_freed_blocks + 1);
+
+    //Block released by other thread is recycled to owner thread
+    Block* reused = nullptr;
+    std::vector<Block*> blocks;
+    for (size_t i = 0; i < 1024 && reused != block; ++i) {
+        reused = BlockPool::acquire();
+        blocks.push_back(reused);
+    }
+    ASSERT_EQ(reused, block);
+    for (auto b : blocks) {
+        BlockPool::release(b);
+    }
+}
+
+TEST(BlockPoolTest, maxRetainedBytes) {
+    auto origin = BlockPool::getMaxRetainedBytes();
+    BlockPool::setMaxRetainedBytes(0);
+    auto block = BlockPool::acquire();
+    auto retained = BlockPool::stats().retained_bytes;
+    BlockPool::release(block);
+    ASSERT_EQ(BlockPool::stats().retained_bytes, retained);
+    BlockPool::setMaxRetainedBytes(origin);
+
+    std::thread th([]() {
+        IOBuffer buffer;
+        buffer.append(std::string(BUFFER_DEFAULT_BLOCK_SIZE * 4, 'a'));
+    });
+    th.join();
+    ASSERT_GT(getIOBufferPoolStats().thread_caches, 0U);
+}
+
+TEST(BlockPoolTest, chainAndTrim) {
+    std::thread th([]() {
+        setIOBufferMaxChainedBlocks(2);
+        auto before = getIOBufferPoolStats();
+
+        //Each appender holds a partially filled block and pushes it back
+        //to chain when flushing.
+        std::vector<IOBuffer> buffers(4);
+        {
+            std::vector<std::unique_ptr<IOBufferAppender>> appenders;
+            for (auto& buffer : buffers) {
+                appenders.emplace_back(new IOBufferAppender(&buffer));
+                auto data = appenders.back()->reserve(BUFFER_DEFAULT_BLOCK_SIZE);
+                ASSERT_NE(data, nullptr);
+                appenders.back()->commit(10);
+            }
+        }
+        auto stats = getIOBufferPoolStats();
+        ASSERT_EQ(stats.chained_blocks, before.chained_blocks + 2);
+        ASSERT_GE(stats.live_blocks, before.live_blocks + 4);
+        ASSERT_GE(stats.live_bytes, stats.chained_bytes + stats.pinned_bytes);
+
+        //Large block is not owned by any thread cache
+        auto large = BlockPool::acquire(BUFFER_MAX_SLICE_SIZE * 2);
+        ASSERT_EQ(getIOBufferPoolStats().live_bytes,
+                  stats.live_bytes + BUFFER_MAX_SLICE_SIZE * 2);
+        large->decRef();
+
+        buffers.clear();
+        trimIOBufferThreadCache();
+        stats = getIOBufferPoolStats();
+        ASSERT_EQ(stats.chained_blocks, before.chained_blocks);
+        ASSERT_LE(stats.live_blocks, before.live_blocks);
+        setIOBufferMaxChainedBlocks(IO_BUFFER_MAX_CHAINED_BLOCKS);
+    });
+    th.join();
+}
+
+TEST(BlockPoolTest, trimRequest) {
+    //Thread retains free blocks, and releases them when it is asked and
+    //allocates again
+    std::promise<void> filled;
+    std::promise<void> requested;
+    std::promise<size_t> trimmed;
+    std::thread th([&]() {
+        {
+            std::vector<Block*> blocks;
+            for (size_t i = 0; i < 16; ++i) {
+                blocks.push_back(BlockPool::acquire());
+            }
+            for (auto block : blocks) {
+                block->decRef();
+            }
+        }
+        filled.set_value();
+        requested.get_future().wait();
+        auto before = getIOBufferPoolStats().retained_bytes;
+        IOBuffer buffer;
+        buffer.append("trim");
+        trimmed.set_value(before - getIOBufferPoolStats().retained_bytes);
+    });
+    filled.get_future().wait();
+
+    //Thread acquired blocks before first request, and is found idle by the
+    //second one
+    trimIOBufferThreadCaches(true);
+    trimIOBufferThreadCaches(true);
+    requested.set_value();
+    ASSERT_GE(trimmed.get_future().get(), 16 * BUFFER_DEFAULT_BLOCK_SIZE);
+    th.join();
+
+    //Negative chained deltas are accounted as signed values
+    auto before = getIOBufferPoolStats().chained_bytes;
+    BlockPool::addLocalChained(1, BUFFER_DEFAULT_BLOCK_SIZE);
+    BlockPool::addLocalChained(-1, -(int64_t)BUFFER_DEFAULT_BLOCK_SIZE);
+    ASSERT_EQ(getIOBufferPoolStats().chained_bytes, before);
+}
+
+TEST(BlockPoolTest, performance) {
+    constexpr size_t count = 1000000;
+    std::vector<Block*> blocks(16, nullptr);
+
+    auto start = Utils::getHighPrecisionTimeStamp();
+    for (size_t i = 0; i < count; ++i) {
+        auto& block = blocks[i % blocks.size()];
+        if (block) {
+            block->decRef();
+        }
+        block = BlockPool::acquire();
+    }
+    auto end = Utils::getHighPrecisionTimeStamp();
+    for (auto block : blocks) {
+        block->decRef();
+    }
+    std::cout << "block pool time cost:" << (end - start) / 1000 << "ms" << std::endl;
+
+    std::vector<std::shared_ptr<char>> mems(16);
+    start = Utils::getHighPrecisionTimeStamp();
+    for (size_t i = 0; i < count; ++i) {
+        mems[i % mems.size()] = std::shared_ptr<char>(
+                static_cast<char*>(std::malloc(BUFFER_DEFAULT_BLOCK_SIZE)),
+                [](char* p) {
+                    std::free(p);
+                });
+    }
+    end = Utils::getHighPrecisionTimeStamp();
+    std::cout << "malloc time cost:" << (end - start) / 1000 << "ms" << std::endl;
+}
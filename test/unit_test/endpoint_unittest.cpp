@@ -29,3 +29,25 @@ TEST(EndPointTest, parseFromString) {
     GTEST_ASSERT_EQ(point.parseFromString(str.c_str()), true);
     GTEST_ASSERT_EQ(point.port, 0);
 }
+
+TEST(EndPointTest, parseUnixFromString) {
+    antflash::EndPoint point;
+    std::string str = "unix:/tmp/bolt.sock";
+    GTEST_ASSERT_EQ(point.parseFromString(str.c_str()), true);
+    GTEST_ASSERT_EQ(point.isUnix(), true);
+    ASSERT_STREQ(point.unix_path.c_str(), "/tmp/bolt.sock");
+    ASSERT_STREQ(str.c_str(), point.ipToStr().c_str());
+
+    antflash::EndPoint copy(point);
+    GTEST_ASSERT_EQ(copy.isUnix(), true);
+    ASSERT_STREQ(copy.unix_path.c_str(), "/tmp/bolt.sock");
+
+    str = "unix:";
+    GTEST_ASSERT_EQ(point.parseFromString(str.c_str()), false);
+    str = "unix:/" + std::string(200, 'a');
+    GTEST_ASSERT_EQ(point.parseFromString(str.c_str()), false);
+
+    str = "127.0.0.1:12345";
+    GTEST_ASSERT_EQ(point.parseFromString(str.c_str()), true);
+    GTEST_ASSERT_EQ(point.isUnix(), false);
+}
@@ -11,6 +11,7 @@
 #include "common/io_buffer.h"
 #include <gtest/gtest.h>
 #include <protocol/http/http_parser.h>
+#include "io_buffer_unittest.pb.h"
 
 TEST(HttpTest, baseFunction) {
     {
@@ -136,3 +137,89 @@ TEST(BoltTest, baseFunction) {
         ASSERT_FALSE(antflash::bolt::parseHeartbeatResponse(response));
     }
 }
+
+TEST(HttpTest, attachUserData) {
+    std::string body(antflash::BUFFER_MAX_SLICE_SIZE, 'h');
+    size_t deleted = 0;
+    {
+        antflash::HttpRequest request;
+        request.uri("127.0.0.1:12200")
+                .method(antflash::HTTP_METHOD_POST)
+                .attach(&body[0], body.size(), [&deleted](void*) {
+                    ++deleted;
+                });
+        ASSERT_EQ(request.attach_size(), body.size());
+
+        //Assemble twice as retry, attach data should not be consumed
+        for (size_t i = 0; i < 2; ++i) {
+            antflash::IOBuffer buffer;
+            ASSERT_TRUE(antflash::http::assembleHttpRequest(request, 1, buffer));
+            auto str = buffer.to_string();
+            ASSERT_EQ(str.substr(str.size() - body.size()), body);
+            ASSERT_EQ(request.attach_size(), body.size());
+        }
+        ASSERT_EQ(deleted, 0UL);
+    }
+    ASSERT_EQ(deleted, 1UL);
+}
+
+TEST(BoltTest, userData) {
+    std::string body(antflash::BUFFER_MAX_SLICE_SIZE, 'b');
+    size_t deleted = 0;
+    antflash::IOBuffer buffer;
+    {
+        antflash::BoltRequest request;
+        request.data(&body[0], body.size(), [&deleted](void*) {
+            ++deleted;
+        });
+
+        antflash::IOBuffer buffer2;
+        ASSERT_TRUE(antflash::bolt::assembleBoltRequest(request, 1, buffer));
+        ASSERT_TRUE(antflash::bolt::assembleBoltRequest(request, 2, buffer2));
+        ASSERT_EQ(buffer.size(), buffer2.size());
+        auto str = buffer.to_string();
+        ASSERT_EQ(str.substr(str.size() - body.size()), body);
+    }
+    //Still referred by buffer
+    ASSERT_EQ(deleted, 0UL);
+    buffer.clear();
+    ASSERT_EQ(deleted, 1UL);
+}
+
+TEST(BoltTest, protobufData) {
+    for (size_t msg_size : {10UL, antflash::BUFFER_MAX_SLICE_SIZE * 2}) {
+        UnitTestProto proto;
+        proto.set_name("UnitTest");
+        proto.set_id(12345);
+        proto.mutable_msg()->add_msg(std::string(msg_size, 'p'));
+        antflash::BoltRequest request;
+        request.service("com.alipay.test.TestService:1.0")
+                .method("echo")
+                .traceId("trace")
+                .data(proto);
+
+        antflash::IOBuffer buffer;
+        ASSERT_TRUE(antflash::bolt::assembleBoltRequest(request, 1, buffer));
+
+        //Header is followed by class name and header key values
+        antflash::IOBufferReader reader(buffer);
+        uint16_t class_len = 0;
+        uint16_t header_len = 0;
+        uint32_t content_len = 0;
+        ASSERT_EQ(reader.skip(14), 14UL);
+        ASSERT_TRUE(reader.readUint16(class_len));
+        ASSERT_TRUE(reader.readUint16(header_len));
+        ASSERT_TRUE(reader.readUint32(content_len));
+        ASSERT_EQ(content_len, proto.ByteSizeLong());
+        ASSERT_EQ(buffer.size(), 22UL + class_len + header_len + content_len);
+
+        //Content is serialized into one contiguous slice
+        auto last = buffer.slice(buffer.slice_num() - 1);
+        ASSERT_GE(last.second, content_len);
+        UnitTestProto parsed;
+        ASSERT_TRUE(parsed.ParseFromArray(
+                last.first + last.second - content_len, content_len));
+        ASSERT_EQ(parsed.msg().msg(0).size(), msg_size);
+        ASSERT_EQ(parsed.name(), proto.name());
+    }
+}
@@ -7,10 +7,16 @@
 #include <gtest/gtest.h>
 #include <fstream>
 #include <fcntl.h>
+#include <arpa/inet.h>
 #include <thread>
 #include <random>
+#include <iostream>
+#include <deque>
+#include <netinet/in.h>
 #include <google/protobuf/message.h>
 #include <common/common_defines.h>
+#include "common/utils.h"
+#include "tcp/socket_base.h"
 #include "io_buffer_unittest.pb.h"
 
 using namespace antflash;
@@ -451,3 +457,403 @@ TEST(IOBufferTest, ZeroStream) {
 
     work.join();
 }
+
+TEST(IOBufferTest, pipelinedMessagePerformance) {
+    constexpr size_t message_size = 120;
+    constexpr size_t message_num = 50000;
+    std::string message(message_size, 'm');
+
+    IOBuffer read_buf;
+    for (size_t i = 0; i < message_num; ++i) {
+        read_buf.append(message);
+    }
+    IOBuffer read_buf2(read_buf);
+
+    //Simulate cutting responses one by one from read buffer
+    size_t cut_num = 0;
+    auto start = Utils::getHighPrecisionTimeStamp();
+    while (read_buf.size() >= message_size) {
+        IOBuffer msg;
+        read_buf.cut(&msg, message_size);
+        if (msg.size() == message_size) {
+            ++cut_num;
+        }
+    }
+    auto end = Utils::getHighPrecisionTimeStamp();
+    ASSERT_EQ(cut_num, message_num);
+    ASSERT_TRUE(read_buf.empty());
+    std::cout << "cut " << message_num << " messages time cost:"
+              << (end - start) << "us, "
+              << (end - start) * 1000 / message_num << "ns per message" << std::endl;
+
+    start = Utils::getHighPrecisionTimeStamp();
+    while (read_buf2.size() >= message_size) {
+        read_buf2.pop_front(message_size);
+    }
+    end = Utils::getHighPrecisionTimeStamp();
+    ASSERT_TRUE(read_buf2.empty());
+    std::cout << "pop_front " << message_num << " messages time cost:"
+              << (end - start) << "us, "
+              << (end - start) * 1000 / message_num << "ns per message" << std::endl;
+}
+
+TEST(IOBufferTest, workloadPerformance) {
+    constexpr size_t loop = 100000;
+    std::string s1("I'm so missing my dear darling now");
+    std::string s2(BUFFER_DEFAULT_BLOCK_SIZE / 2, 'b');
+
+    //Append, copy, append buffer and cut, as baseFunction and constructions
+    auto start = Utils::getHighPrecisionTimeStamp();
+    for (size_t i = 0; i < loop; ++i) {
+        IOBuffer buffer;
+        buffer.append(s1);
+        buffer.append(s2);
+        IOBuffer copy(buffer);
+        IOBuffer appended;
+        appended.append(copy);
+        appended.append(buffer);
+        IOBuffer out;
+        appended.cut(&out, s1.size() + s2.size());
+        IOBuffer assigned;
+        assigned = out;
+    }
+    auto end = Utils::getHighPrecisionTimeStamp();
+    std::cout << "buffer operations time cost:" << (end - start) / 1000 << "ms" << std::endl;
+
+    //Protobuf serialize and parse through zero copy stream, as ZeroStream
+    UnitTestProto proto1;
+    proto1.set_name("UnitTest");
+    proto1.set_id(12345);
+    proto1.set_uid(54321);
+    proto1.mutable_msg()->add_msg(std::string(20000, 'p'));
+    proto1.mutable_msg()->add_code(200);
+    start = Utils::getHighPrecisionTimeStamp();
+    for (size_t i = 0; i < loop / 10; ++i) {
+        IOBuffer buffer;
+        IOBufferZeroCopyOutputStream output(&buffer);
+        ASSERT_TRUE(proto1.SerializeToZeroCopyStream(&output));
+        IOBuffer copy(buffer);
+        UnitTestProto proto2;
+        IOBufferZeroCopyInputStream input(copy);
+        ASSERT_TRUE(proto2.ParseFromZeroCopyStream(&input));
+    }
+    end = Utils::getHighPrecisionTimeStamp();
+    std::cout << "zero copy stream time cost:" << (end - start) / 1000 << "ms" << std::endl;
+}
+
+TEST(IOBufferTest, userData) {
+    std::string data(BUFFER_DEFAULT_BLOCK_SIZE * 3, 'u');
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = 'a' + i % 26;
+    }
+    void* deleted = nullptr;
+    size_t deleted_count = 0;
+    {
+        IOBuffer buffer;
+        buffer.append("head");
+        buffer.append_user_data(&data[0], data.size(),
+                                [&deleted, &deleted_count](void* p) {
+            deleted = p;
+            ++deleted_count;
+        });
+        buffer.append("tail");
+        ASSERT_EQ(buffer.size(), data.size() + 8);
+        ASSERT_EQ(buffer.slice_num(), 3U);
+        //Not copied
+        ASSERT_EQ(buffer.slice(1).first, data.data());
+        ASSERT_EQ(buffer.to_string(), "head" + data + "tail");
+
+        IOBuffer copy(buffer);
+        IOBuffer front;
+        copy.cut(&front, 100);
+        ASSERT_EQ(front.to_string(), "head" + data.substr(0, 96));
+        ASSERT_EQ(copy.slice(0).first, data.data() + 96);
+
+        //Write to pipe with writev
+        int fds[2];
+        ASSERT_EQ(pipe(fds), 0);
+        fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+        IOBuffer out(buffer);
+        IOBuffer in;
+        while (!out.empty()) {
+            ASSERT_GT(out.cut_into_file_descriptor(fds[1], out.size()), 0);
+            while (in.append_from_file_descriptor(fds[0], BUFFER_DEFAULT_BLOCK_SIZE) > 0) {
+            }
+        }
+        close(fds[0]);
+        close(fds[1]);
+        ASSERT_EQ(in.to_string(), buffer.to_string());
+
+        //Read through zero copy stream
+        IOBufferZeroCopyInputStream stream(buffer);
+        const void* p = nullptr;
+        int size = 0;
+        ASSERT_TRUE(stream.Next(&p, &size));
+        ASSERT_TRUE(stream.Next(&p, &size));
+        ASSERT_EQ(p, data.data());
+        ASSERT_EQ((size_t)size, data.size());
+        ASSERT_EQ(deleted_count, 0U);
+    }
+    ASSERT_EQ(deleted, data.data());
+    ASSERT_EQ(deleted_count, 1U);
+
+    //Deleter is called in the thread which releases last reference
+    IOBuffer buffer;
+    buffer.append_user_data(&data[0], data.size(), [&deleted_count](void*) {
+        ++deleted_count;
+    });
+    std::thread th([&buffer]() {
+        IOBuffer moved(std::move(buffer));
+    });
+    th.join();
+    ASSERT_EQ(deleted_count, 2U);
+}
+
+TEST(IOBufferTest, reader) {
+    IOBuffer buffer;
+    std::string data(BUFFER_DEFAULT_BLOCK_SIZE + 16, 'r');
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = 'a' + i % 26;
+    }
+    buffer.append_user_data(&data[0], 10, nullptr);
+    buffer.append_user_data(&data[10], data.size() - 10, nullptr);
+    ASSERT_EQ(buffer.slice_num(), 2U);
+
+    IOBufferReader reader(buffer);
+    char tmp[64];
+    //Contiguous bytes refer to block directly
+    ASSERT_EQ(reader.fetch(tmp, 8), data.data());
+    //Bytes span slices are copied
+    auto p = static_cast<const char*>(reader.fetch(tmp, 20));
+    ASSERT_EQ(p, tmp);
+    ASSERT_EQ(std::string(p, 20), data.substr(0, 20));
+    ASSERT_EQ(reader.position(), 0U);
+
+    std::string out;
+    ASSERT_TRUE(reader.read(out, 12));
+    ASSERT_EQ(out, data.substr(0, 12));
+    ASSERT_EQ(reader.position(), 12U);
+    ASSERT_EQ(reader.left(), data.size() - 12);
+    ASSERT_EQ(reader.fetch(tmp, 8), data.data() + 12);
+
+    ASSERT_EQ(reader.skip(100), 100U);
+    uint8_t c = 0;
+    ASSERT_TRUE(reader.readUint8(c));
+    ASSERT_EQ(c, (uint8_t)data[112]);
+
+    const char* slice = nullptr;
+    size_t size = 0;
+    ASSERT_TRUE(reader.next(&slice, &size));
+    ASSERT_EQ(slice, data.data() + 113);
+    ASSERT_EQ(size, data.size() - 113);
+    ASSERT_FALSE(reader.next(&slice, &size));
+    ASSERT_EQ(reader.left(), 0U);
+    ASSERT_EQ(reader.fetch(tmp, 1), nullptr);
+    ASSERT_FALSE(reader.read(tmp, 1));
+    //Reading does not consume buffer
+    ASSERT_EQ(buffer.size(), data.size());
+
+    IOBuffer numbers;
+    uint16_t u16 = htons(0x1234);
+    uint32_t u32 = htonl(0x12345678);
+    numbers.append(&u16, 1);
+    numbers.append_user_data(reinterpret_cast<char*>(&u16) + 1, 1, nullptr);
+    numbers.append(&u32, 3);
+    numbers.append_user_data(reinterpret_cast<char*>(&u32) + 3, 1, nullptr);
+    IOBufferReader number_reader(numbers);
+    uint16_t r16 = 0;
+    uint32_t r32 = 0;
+    ASSERT_TRUE(number_reader.readUint16(r16));
+    ASSERT_TRUE(number_reader.readUint32(r32));
+    ASSERT_EQ(r16, 0x1234);
+    ASSERT_EQ(r32, 0x12345678U);
+    ASSERT_FALSE(number_reader.readUint16(r16));
+    ASSERT_EQ(number_reader.skip(10), 0U);
+}
+
+TEST(IOBufferTest, appender) {
+    IOBuffer buffer;
+    buffer.append("head");
+    {
+        IOBufferAppender appender(&buffer);
+        appender.append("abc");
+        appender.appendUint16(0x1234);
+        appender.appendUint32(0x12345678);
+        appender.appendDecimal(0);
+        appender.appendDecimal(-1);
+        appender.appendDecimal(1234567890123);
+        auto p = appender.reserve(5);
+        ASSERT_NE(p, nullptr);
+        memcpy(p, "12345", 5);
+        appender.commit(3);
+        //Not committed before flushing
+        ASSERT_EQ(buffer.size(), 4U);
+    }
+    std::string expect("headabc\x12\x34\x12\x34\x56\x78" "0-11234567890123123");
+    ASSERT_EQ(buffer.to_string(), expect);
+    //Written bytes are merged to one slice
+    ASSERT_EQ(buffer.slice_num(), 1U);
+
+    IOBufferReader reader(buffer);
+    uint16_t u16 = 0;
+    uint32_t u32 = 0;
+    ASSERT_EQ(reader.skip(7), 7U);
+    ASSERT_TRUE(reader.readUint16(u16));
+    ASSERT_TRUE(reader.readUint32(u32));
+    ASSERT_EQ(u16, 0x1234);
+    ASSERT_EQ(u32, 0x12345678U);
+
+    //Data spans several blocks, and reserved space larger than block
+    std::string data(BUFFER_DEFAULT_BLOCK_SIZE * 2 + 100, 'd');
+    IOBuffer large;
+    {
+        IOBufferAppender appender(&large);
+        appender.append(data);
+        auto p = appender.reserve(BUFFER_MAX_SLICE_SIZE);
+        ASSERT_NE(p, nullptr);
+        memset(p, 'e', BUFFER_MAX_SLICE_SIZE);
+        appender.commit(BUFFER_MAX_SLICE_SIZE);
+        appender.flush();
+        ASSERT_EQ(large.size(), data.size() + BUFFER_MAX_SLICE_SIZE);
+        appender.append("tail");
+    }
+    ASSERT_EQ(large.to_string(),
+              data + std::string(BUFFER_MAX_SLICE_SIZE, 'e') + "tail");
+
+    //Other buffers appending during appender's life do not share its space
+    IOBuffer first;
+    IOBuffer second;
+    {
+        IOBufferAppender appender(&first);
+        appender.append("first");
+        second.append("second");
+        appender.append("first");
+    }
+    ASSERT_EQ(first.to_string(), "firstfirst");
+    ASSERT_EQ(second.to_string(), "second");
+}
+
+TEST(IOBufferTest, appenderPerformance) {
+    constexpr size_t loop = 100000;
+    const std::string key("sofa_head_target_service");
+    const std::string value("com.alipay.test.TestService:1.0");
+
+    auto start = Utils::getHighPrecisionTimeStamp();
+    for (size_t i = 0; i < loop; ++i) {
+        IOBuffer buffer;
+        for (size_t j = 0; j < 4; ++j) {
+            uint32_t size = htonl(key.size());
+            buffer.append(&size, sizeof(size));
+            buffer.append(key);
+            size = htonl(value.size());
+            buffer.append(&size, sizeof(size));
+            buffer.append(value);
+        }
+    }
+    auto end = Utils::getHighPrecisionTimeStamp();
+    std::cout << "append key values time cost:" << (end - start) / 1000 << "ms" << std::endl;
+
+    start = Utils::getHighPrecisionTimeStamp();
+    for (size_t i = 0; i < loop; ++i) {
+        IOBuffer buffer;
+        IOBufferAppender appender(&buffer);
+        for (size_t j = 0; j < 4; ++j) {
+            appender.appendUint32(key.size());
+            appender.append(key);
+            appender.appendUint32(value.size());
+            appender.append(value);
+        }
+    }
+    end = Utils::getHighPrecisionTimeStamp();
+    std::cout << "appender key values time cost:" << (end - start) / 1000 << "ms" << std::endl;
+}
+
+#if defined(OS_LINUX)
+static bool createLoopbackPair(base::FdGuard& client, base::FdGuard& server) {
+    base::FdGuard listener(socket(AF_INET, SOCK_STREAM, 0));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(listener.fd(), (struct sockaddr*)&addr, sizeof(addr)) != 0
+        || listen(listener.fd(), 1) != 0
+        || getsockname(listener.fd(), (struct sockaddr*)&addr, &len) != 0) {
+        return false;
+    }
+    client = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(client.fd(), (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        return false;
+    }
+    server = accept(listener.fd(), nullptr, nullptr);
+    return server.fd() >= 0;
+}
+
+TEST(IOBufferTest, zeroCopyPerformance) {
+    constexpr size_t total = 64 * 1024 * 1024;
+    for (size_t msg_size : {4096UL, 16384UL, 65536UL, 262144UL, 1048576UL}) {
+        for (bool zero_copy : {false, true}) {
+            base::FdGuard client;
+            base::FdGuard server;
+            ASSERT_TRUE(createLoopbackPair(client, server));
+            if (zero_copy && !base::set_zero_copy(client.fd())) {
+                std::cout << "zero copy is not supported" << std::endl;
+                return;
+            }
+
+            std::thread reader([&server]() {
+                std::vector<char> buf(1024 * 1024);
+                size_t nr = 0;
+                while (nr < total) {
+                    auto n = read(server.fd(), buf.data(), buf.size());
+                    if (n <= 0) {
+                        break;
+                    }
+                    nr += n;
+                }
+            });
+
+            const std::string data(msg_size, 'z');
+            std::deque<std::pair<uint32_t, IOBuffer>> pending;
+            uint32_t seq = 0;
+            size_t nw = 0;
+            auto start = Utils::getHighPrecisionTimeStamp();
+            while (nw < total) {
+                IOBuffer buffer;
+                buffer.append(data);
+                while (!buffer.empty()) {
+                    ssize_t n = 0;
+                    if (zero_copy) {
+                        IOBuffer pinned;
+                        n = buffer.cut_into_file_descriptor_zero_copy(
+                                client.fd(), msg_size, &pinned);
+                        if (n > 0) {
+                            pending.emplace_back(seq++, std::move(pinned));
+                        }
+                        uint32_t lo = 0, hi = 0;
+                        bool copied = false;
+                        while (base::read_zero_copy_completion(
+                                client.fd(), lo, hi, copied)) {
+                            while (!pending.empty()
+                                   && (int32_t)(pending.front().first - hi) <= 0) {
+                                pending.pop_front();
+                            }
+                        }
+                    } else {
+                        n = buffer.cut_into_file_descriptor(client.fd(), msg_size);
+                    }
+                    ASSERT_GT(n, 0);
+                    nw += n;
+                }
+            }
+            auto end = Utils::getHighPrecisionTimeStamp();
+            reader.join();
+            std::cout << (zero_copy ? "zero copy" : "writev")
+                      << " message size:" << msg_size
+                      << " time cost:" << (end - start) / 1000 << "ms"
+                      << " pending:" << pending.size() << std::endl;
+        }
+    }
+}
+#endif
@@ -0,0 +1,208 @@
+// Copyright (c) 2018 Ant Financial, Inc. All Rights Reserved
+//
+
+#include "simple_bolt_server.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <string.h>
+#include <string>
+#include "common/common_defines.h"
+
+namespace antflash {
+
+struct [[gnu::packed]] SimpleBoltRequestHeader {
+    uint8_t proto;
+    uint8_t type;
+    uint16_t cmdcode;
+    uint8_t ver2;
+    uint32_t request_id;
+    uint8_t codec;
+    uint32_t timeout;
+    uint16_t class_len;
+    uint16_t header_len;
+    uint32_t content_len;
+};
+
+struct [[gnu::packed]] SimpleBoltResponseHeader {
+    uint8_t proto;
+    uint8_t type;
+    uint16_t cmdcode;
+    uint8_t ver2;
+    uint32_t request_id;
+    uint8_t codec;
+    uint16_t status;
+    uint16_t class_len;
+    uint16_t header_len;
+    uint32_t content_len;
+};
+
+static bool readFully(int fd, void* buf, size_t size) {
+    size_t cur = 0;
+    while (cur < size) {
+        auto nr = ::read(fd, (char*)buf + cur, size - cur);
+        if (nr <= 0) {
+            return false;
+        }
+        cur += nr;
+    }
+    return true;
+}
+
+static bool writeFully(int fd, const void* buf, size_t size) {
+    size_t cur = 0;
+    while (cur < size) {
+        auto nw = ::send(fd, (const char*)buf + cur, size - cur, MSG_NOSIGNAL);
+        if (nw <= 0) {
+            return false;
+        }
+        cur += nw;
+    }
+    return true;
+}
+
+bool SimpleBoltServer::start(int port) {
+    _listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (_listen_fd < 0) {
+        return false;
+    }
+    int on = 1;
+    setsockopt(_listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(_listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+        || listen(_listen_fd, 1024) != 0) {
+        close(_listen_fd);
+        _listen_fd = -1;
+        return false;
+    }
+
+    return startAccept();
+}
+
+bool SimpleBoltServer::start(const std::string& unix_path) {
+    _listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (_listen_fd < 0) {
+        return false;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, unix_path.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(unix_path.c_str());
+    if (bind(_listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+        || listen(_listen_fd, 1024) != 0) {
+        close(_listen_fd);
+        _listen_fd = -1;
+        return false;
+    }
+    _unix_path = unix_path;
+
+    return startAccept();
+}
+
+bool SimpleBoltServer::startAccept() {
+    _accept_thread = std::thread([this]() {
+        while (!_exit) {
+            int conn = accept(_listen_fd, nullptr, nullptr);
+            if (conn < 0) {
+                continue;
+            }
+            int flag = 1;
+            setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+            std::lock_guard<std::mutex> lock(_mtx);
+            if (_exit) {
+                close(conn);
+                break;
+            }
+            _conns.push_back(conn);
+            _conn_threads.emplace_back([this, conn]() {
+                serve(conn);
+            });
+        }
+    });
+
+    return true;
+}
+
+void SimpleBoltServer::stop() {
+    if (_listen_fd < 0) {
+        return;
+    }
+    _exit = true;
+    shutdown(_listen_fd, SHUT_RDWR);
+    _accept_thread.join();
+    close(_listen_fd);
+    _listen_fd = -1;
+    if (!_unix_path.empty()) {
+        unlink(_unix_path.c_str());
+    }
+
+    std::lock_guard<std::mutex> lock(_mtx);
+    for (auto conn : _conns) {
+        shutdown(conn, SHUT_RDWR);
+    }
+    for (auto& th : _conn_threads) {
+        th.join();
+    }
+    for (auto conn : _conns) {
+        close(conn);
+    }
+    _conns.clear();
+    _conn_threads.clear();
+}
+
+void SimpleBoltServer::serve(int conn) {
+    std::string body;
+    std::string response;
+    while (!_exit) {
+        SimpleBoltRequestHeader req;
+        if (!readFully(conn, &req, sizeof(req))) {
+            break;
+        }
+        size_t content_len = ntohl(req.content_len);
+        size_t body_len = ntohs(req.class_len) + ntohs(req.header_len) + content_len;
+        body.resize(body_len);
+        if (body_len > 0 && !readFully(conn, &body[0], body_len)) {
+            break;
+        }
+
+        const bool heartbeat = ntohs(req.cmdcode) == BOLT_PROTOCOL_CMD_HEARTBEAT;
+        size_t response_size = heartbeat ? 0 : _response_size.load();
+        SimpleBoltResponseHeader rsp;
+        rsp.proto = BOLT_PROTOCOL_TYPE;
+        rsp.type = BOLT_PROTOCOL_RESPONSE;
+        rsp.cmdcode = htons(heartbeat ?
+                BOLT_PROTOCOL_CMD_HEARTBEAT : BOLT_PROTOCOL_CMD_RESPONSE);
+        rsp.ver2 = BOLT_PROTOCOL_VER2;
+        rsp.request_id = req.request_id;
+        rsp.codec = BOLT_PROTOCOL_CODEC_PB;
+        rsp.status = 0;
+        rsp.class_len = 0;
+        rsp.header_len = 0;
+
+        response.assign((const char*)&rsp, sizeof(rsp));
+        if (response_size > 0) {
+            response.append(response_size, 'r');
+        } else if (!heartbeat) {
+            response.append(body, body_len - content_len, content_len);
+        }
+        auto header = (SimpleBoltResponseHeader*)&response[0];
+        header->content_len = htonl(response.size() - sizeof(rsp));
+
+        if (!writeFully(conn, response.data(), response.size())) {
+            break;
+        }
+        ++_requests;
+    }
+}
+
+}
@@ -0,0 +1,58 @@
+// Copyright (c) 2018 Ant Financial, Inc. All Rights Reserved
+//
+
+#ifndef RPC_SIMPLE_BOLT_SERVER_H
+#define RPC_SIMPLE_BOLT_SERVER_H
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <string>
+
+namespace antflash {
+
+//Bolt server for unit test, each connection is served by one thread and
+//response content is either echo of request content or fixed size data.
+class SimpleBoltServer {
+public:
+    SimpleBoltServer() : _listen_fd(-1), _response_size(0),
+                         _exit(false), _requests(0) {}
+    ~SimpleBoltServer() {
+        stop();
+    }
+
+    bool start(int port);
+
+    //Listen on unix domain socket of path
+    bool start(const std::string& unix_path);
+
+    void stop();
+
+    //If size is 0, echo request content
+    void setResponseSize(size_t size) {
+        _response_size = size;
+    }
+
+    size_t requests() const {
+        return _requests.load();
+    }
+
+private:
+    bool startAccept();
+    void serve(int conn);
+
+    int _listen_fd;
+    std::atomic<size_t> _response_size;
+    std::atomic<bool> _exit;
+    std::atomic<size_t> _requests;
+    std::thread _accept_thread;
+    std::mutex _mtx;
+    std::vector<int> _conns;
+    std::vector<std::thread> _conn_threads;
+    std::string _unix_path;
+};
+
+}
+
+#endif //RPC_SIMPLE_BOLT_SERVER_H
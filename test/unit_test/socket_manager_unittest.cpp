@@ -7,10 +7,16 @@
 #include "tcp/socket.h"
 #include "tcp/socket_manager.h"
 #include "simple_socket_server.h"
+#include "simple_bolt_server.h"
 #include <protocol/bolt/bolt_response.h>
 #include "protocol/bolt/bolt_protocol.h"
 #include <gtest/gtest.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <algorithm>
 #include "schedule/loop_thread.h"
+#include "rpc.h"
+#include "common/utils.h"
 
 namespace antflash {
 class ChannelUnitTest {
@@ -37,6 +43,30 @@ public:
         return false;
     }
 
+    SocketReadStats readStats() const {
+        return _socket->getReadStats();
+    }
+
+    SocketWriteStats writeStats() const {
+        return _socket->getWriteStats();
+    }
+
+    size_t inflightWindow() const {
+        return _socket->inflightWindow();
+    }
+
+    int loopIndex() const {
+        return _socket->loopIndex();
+    }
+
+    int fd() const {
+        return _socket->fd();
+    }
+
+    std::weak_ptr<Socket> weakSocket() const {
+        return _socket;
+    }
+
 private:
     std::shared_ptr<Socket> _socket;
 };
@@ -85,6 +115,270 @@ TEST(SocketTest, base) {
     thread2 = std::move(thread1);
 }
 
+static bool createLoopbackPairs(size_t num,
+                                std::vector<base::FdGuard>& clients,
+                                std::vector<base::FdGuard>& servers) {
+    base::FdGuard listener(socket(AF_INET, SOCK_STREAM, 0));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(listener.fd(), (struct sockaddr*)&addr, sizeof(addr)) != 0
+        || listen(listener.fd(), (int)num) != 0
+        || getsockname(listener.fd(), (struct sockaddr*)&addr, &len) != 0) {
+        return false;
+    }
+    clients.resize(num);
+    servers.resize(num);
+    for (size_t i = 0; i < num; ++i) {
+        clients[i] = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(clients[i].fd(),
+                    (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            return false;
+        }
+        servers[i] = accept(listener.fd(), nullptr, nullptr);
+        if (servers[i].fd() < 0
+            || !base::set_non_blocking(servers[i].fd())
+            || !base::set_no_delay(clients[i].fd())
+            || !base::set_no_delay(servers[i].fd())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+TEST(LoopThreadTest, busyPoll) {
+    constexpr size_t msg_size = 64;
+    constexpr size_t rounds = 2048;
+    for (uint32_t busy_poll_us : {0U, 2000U}) {
+        LoopOptions options;
+        options.busy_poll_us = busy_poll_us;
+        options.socket_busy_poll_us = busy_poll_us > 0 ? 50 : 0;
+        LoopThread thread;
+        ASSERT_TRUE(thread.start(options));
+
+        std::vector<base::FdGuard> clients;
+        std::vector<base::FdGuard> servers;
+        ASSERT_TRUE(createLoopbackPairs(1, clients, servers));
+        int fd = servers[0].fd();
+        Schedule::Handler handler = [fd]() {
+            char buf[4096];
+            while (true) {
+                auto n = read(fd, buf, sizeof(buf));
+                if (n <= 0) {
+                    break;
+                }
+                ASSERT_EQ(write(fd, buf, n), n);
+            }
+        };
+        ASSERT_TRUE(thread.add_event(fd, POLLIN, &handler));
+
+        char buf[msg_size];
+        memset(buf, 'b', sizeof(buf));
+        std::vector<size_t> latency;
+        latency.reserve(rounds);
+        for (size_t r = 0; r < rounds; ++r) {
+            //Requests arrive at idle loop, which sleeps unless busy polling
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+            auto start = Utils::getSteadyTimeStampMicro();
+            ASSERT_EQ(write(clients[0].fd(), buf, msg_size), (ssize_t)msg_size);
+            size_t nr = 0;
+            while (nr < msg_size) {
+                auto n = read(clients[0].fd(), buf + nr, msg_size - nr);
+                ASSERT_GT(n, 0);
+                nr += n;
+            }
+            latency.push_back(Utils::getSteadyTimeStampMicro() - start);
+        }
+        thread.remove_event(fd, POLLIN);
+
+        LoopStats stats;
+        memset(&stats, 0, sizeof(stats));
+        thread.collect_stats(stats);
+        thread.stop();
+
+        std::sort(latency.begin(), latency.end());
+        std::cout << "busy poll:" << busy_poll_us << "us"
+                  << " p50:" << latency[rounds / 2] << "us"
+                  << " p99:" << latency[rounds * 99 / 100] << "us"
+                  << " spin:" << stats.spin_us << "us"
+                  << " handle:" << stats.handle_us << "us"
+                  << " spin hits:" << stats.spin_hits
+                  << " sleeps:" << stats.sleeps << std::endl;
+        if (busy_poll_us > 0) {
+            ASSERT_EQ(stats.busy_poll_threads, 1UL);
+            ASSERT_GT(stats.events, 0UL);
+            ASSERT_GT(stats.spin_hits, 0UL);
+            ASSERT_GT(stats.spin_us, 0UL);
+        } else {
+            ASSERT_EQ(stats.busy_poll_threads, 0UL);
+        }
+    }
+}
+
+TEST(LoopThreadTest, runInLoop) {
+    constexpr size_t producers = 4;
+    constexpr size_t tasks = 20000;
+    for (uint32_t busy_poll_us : {0U, 2000U}) {
+        LoopOptions options;
+        options.busy_poll_us = busy_poll_us;
+        LoopThread thread;
+        ASSERT_TRUE(thread.start(options));
+
+        //Tasks are run by loop thread only, no need to lock
+        size_t done = 0;
+        std::vector<size_t> last(producers, 0);
+        bool ordered = true;
+        bool in_loop = true;
+        std::promise<void> all_done;
+        std::vector<std::thread> threads;
+        for (size_t p = 0; p < producers; ++p) {
+            threads.emplace_back([&, p]() {
+                for (size_t i = 1; i <= tasks; ++i) {
+                    auto task = [&, p, i]() {
+                        in_loop = in_loop && LoopThread::in_loop_thread();
+                        ordered = ordered && (last[p] + 1 == i);
+                        last[p] = i;
+                        if (++done == producers * tasks) {
+                            all_done.set_value();
+                        }
+                    };
+                    //Queue is full, wait for loop thread
+                    while (!thread.run_in_loop(task)) {
+                        std::this_thread::yield();
+                    }
+                }
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        ASSERT_EQ(all_done.get_future().wait_for(std::chrono::seconds(10)),
+                  std::future_status::ready);
+        ASSERT_TRUE(ordered);
+        ASSERT_TRUE(in_loop);
+
+        //Task posted in loop thread runs after current one instead of nested
+        std::promise<std::string> order;
+        std::string trace;
+        ASSERT_TRUE(thread.run_in_loop([&]() {
+            thread.run_in_loop([&]() {
+                trace += "inner";
+                order.set_value(trace);
+            });
+            trace += "outer,";
+        }));
+        ASSERT_EQ(order.get_future().get(), "outer,inner");
+
+        //Tasks posted before stop are run, and no task is accepted after
+        bool last_run = false;
+        ASSERT_TRUE(thread.run_in_loop([&last_run]() {
+            last_run = true;
+        }));
+        thread.stop();
+        ASSERT_TRUE(last_run);
+        ASSERT_FALSE(thread.run_in_loop([]() {}));
+    }
+
+    //Socket is released in its loop thread once channel is gone
+    SimpleBoltServer server;
+    ASSERT_TRUE(server.start(6342));
+    ASSERT_TRUE(globalInit());
+    std::weak_ptr<Socket> weak_socket;
+    {
+        Channel channel;
+        ASSERT_TRUE(channel.init("127.0.0.1:6342", nullptr));
+        ChannelUnitTest test(channel);
+        weak_socket = test.weakSocket();
+        ASSERT_FALSE(weak_socket.expired());
+    }
+    Utils::Timer timer;
+    while (!weak_socket.expired() && timer.elapsed() < 5000) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    ASSERT_TRUE(weak_socket.expired());
+    globalDestroy();
+    server.stop();
+}
+
+TEST(LoopThreadTest, pollBatch) {
+    constexpr size_t fds = 300;
+    for (uint32_t busy_poll_us : {0U, 2000U}) {
+        LoopOptions options;
+        options.busy_poll_us = busy_poll_us;
+        options.max_poll_events = 256;
+        LoopThread thread;
+        ASSERT_TRUE(thread.start(options));
+        ASSERT_EQ(thread.load().poll_batch, MAX_POLL_EVENT);
+
+        std::vector<base::FdGuard> clients;
+        std::vector<base::FdGuard> servers;
+        ASSERT_TRUE(createLoopbackPairs(fds, clients, servers));
+        std::atomic<size_t> handled(0);
+        std::vector<std::function<void()>> handlers(fds);
+        for (size_t i = 0; i < fds; ++i) {
+            int fd = servers[i].fd();
+            handlers[i] = [fd, &handled]() {
+                char buf[64];
+                while (read(fd, buf, sizeof(buf)) > 0) {
+                }
+                ++handled;
+            };
+            ASSERT_TRUE(thread.add_event(fd, POLLIN, &handlers[i]));
+        }
+
+        //Hold loop thread until all sockets are readable, so that they are
+        //polled together as a burst
+        for (size_t round = 0; round < 2; ++round) {
+            std::promise<void> entered;
+            std::promise<void> written;
+            auto wait_written = written.get_future().share();
+            ASSERT_TRUE(thread.run_in_loop([&entered, wait_written]() {
+                entered.set_value();
+                wait_written.wait();
+            }));
+            entered.get_future().wait();
+            handled = 0;
+            for (auto& client : clients) {
+                ASSERT_EQ(write(client.fd(), "x", 1), 1);
+            }
+            written.set_value();
+            Utils::Timer timer;
+            while (handled.load() < fds && timer.elapsed() < 5000) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            ASSERT_EQ(handled.load(), fds);
+        }
+
+        //Batch doubles while polls come back full, and stops at max
+        auto load = thread.load();
+        ASSERT_EQ(load.poll_batch, 256UL);
+        size_t wakeups = 0;
+        size_t events = 0;
+        size_t handle_iterations = 0;
+        size_t idle_iterations = 0;
+        for (size_t i = 0; i < LOOP_HISTOGRAM_BUCKETS; ++i) {
+            wakeups += load.wakeup_events[i];
+            events += load.wakeup_events[i] * (i > 0 ? (1UL << (i - 1)) : 0);
+            handle_iterations += load.handle_us[i];
+            idle_iterations += load.idle_us[i];
+        }
+        std::cout << "busy poll us: " << busy_poll_us << ", wakeups: " << wakeups
+                  << ", full batches of 256: " << load.wakeup_events[9] << std::endl;
+        //Lower bounds of buckets sum up to no more than events handled
+        ASSERT_LE(events, 2 * fds + wakeups);
+        ASSERT_GE(load.wakeup_events[9], 1UL);
+        ASSERT_EQ(handle_iterations, wakeups);
+        ASSERT_EQ(idle_iterations, wakeups);
+
+        for (size_t i = 0; i < fds; ++i) {
+            thread.remove_event(servers[i].fd(), POLLIN);
+        }
+        thread.stop();
+    }
+}
+
 TEST(BoltResponseTest, base) {
     BoltResponse response;
     IOBuffer empty;
@@ -92,8 +386,12 @@ TEST(BoltResponseTest, base) {
     size_t request_id = 0;
     ASSERT_EQ(response.checkHeader(empty, data_size, request_id),
               EResParseResult::PARSE_NOT_ENOUGH_DATA);
+    data_size = empty.size();
     ASSERT_EQ(response.deserialize(empty),
               EResParseResult::PARSE_NOT_ENOUGH_DATA);
+    //Short data must be left in buffer until the rest arrives
+    ASSERT_EQ(empty.size(), data_size);
+    empty.clear();
     BoltHeaderTest header;
     header.proto = BOLT_PROTOCOL_TYPE + 1;
     header.content_len = 64 * 1024 * 1024;
@@ -176,8 +474,11 @@ TEST(BoltResponseTest, base) {
     header.status = BoltResponse::SUCCESS;
     header.ntoh();
     empty.append((const void*)&header, sizeof(header));
+    data_size = empty.size();
     ASSERT_EQ(response.deserialize(empty),
               EResParseResult::PARSE_NOT_ENOUGH_DATA);
+    ASSERT_EQ(empty.size(), data_size);
+    empty.clear();
 
     header.proto = BOLT_PROTOCOL_TYPE;
     header.type = BOLT_PROTOCOL_RESPONSE;
@@ -189,8 +490,11 @@ TEST(BoltResponseTest, base) {
     auto header2 = header;
     header.ntoh();
     empty.append((const void*)&header, sizeof(header));
+    data_size = empty.size();
     ASSERT_EQ(response.deserialize(empty),
               EResParseResult::PARSE_NOT_ENOUGH_DATA);
+    ASSERT_EQ(empty.size(), data_size);
+    empty.clear();
     header2.status = BoltResponse::SERVER_SERIAL_EXCEPTION;
     header2.ntoh();
     empty.append((const void*)&header2, sizeof(header2));
@@ -210,8 +514,11 @@ TEST(BoltResponseTest, base) {
     uint32_t header_key_size = 0;
     header_key_size = htonl(header_key_size);
     empty.append((const void*)&header_key_size, sizeof(uint32_t));
+    data_size = empty.size();
     ASSERT_EQ(response.deserialize(empty),
               EResParseResult::PARSE_NOT_ENOUGH_DATA);
+    ASSERT_EQ(empty.size(), data_size);
+    empty.clear();
 
     header.proto = BOLT_PROTOCOL_TYPE;
     header.type = BOLT_PROTOCOL_RESPONSE;
@@ -225,8 +532,11 @@ TEST(BoltResponseTest, base) {
     header_key_size = 10;
     header_key_size = htonl(header_key_size);
     empty.append((const void*)&header_key_size, sizeof(uint32_t));
+    data_size = empty.size();
     ASSERT_EQ(response.deserialize(empty),
               EResParseResult::PARSE_NOT_ENOUGH_DATA);
+    ASSERT_EQ(empty.size(), data_size);
+    empty.clear();
 
     header.proto = BOLT_PROTOCOL_TYPE;
     header.type = BOLT_PROTOCOL_RESPONSE;
@@ -277,8 +587,11 @@ TEST(BoltResponseTest, base) {
     empty.append("key");
     empty.append((const void*)&header_key_size, sizeof(uint32_t));
     empty.append("66");
+    data_size = empty.size();
     ASSERT_EQ(response.deserialize(empty),
               EResParseResult::PARSE_NOT_ENOUGH_DATA);
+    ASSERT_EQ(empty.size(), data_size);
+    empty.clear();
 
     std::string ss;
     BoltResponse str_rsp(ss);
@@ -314,6 +627,56 @@ TEST(BoltResponseTest, base) {
               EResParseResult::PARSE_NOT_ENOUGH_DATA);
 }
 
+TEST(BoltResponseTest, parsePerformance) {
+    constexpr size_t message_num = 50000;
+    const std::string key("service");
+    const std::string value("com.alipay.test.TestService:1.0");
+    const std::string content(256, 'c');
+
+    BoltHeaderTest header;
+    header.proto = BOLT_PROTOCOL_TYPE;
+    header.type = BOLT_PROTOCOL_RESPONSE;
+    header.cmdcode = BOLT_PROTOCOL_CMD_RESPONSE;
+    header.status = BoltResponse::SUCCESS;
+    header.class_len = 0;
+    header.header_len = sizeof(uint32_t) * 2 + key.size() + value.size();
+    header.content_len = content.size();
+    header.ntoh();
+    uint32_t key_size = htonl(key.size());
+    uint32_t value_size = htonl(value.size());
+
+    IOBuffer buffer;
+    for (size_t i = 0; i < message_num; ++i) {
+        header.request_id = htonl(i);
+        buffer.append((const void*)&header, sizeof(header));
+        buffer.append((const void*)&key_size, sizeof(uint32_t));
+        buffer.append(key);
+        buffer.append((const void*)&value_size, sizeof(uint32_t));
+        buffer.append(value);
+        buffer.append(content);
+    }
+
+    size_t parsed = 0;
+    auto start = Utils::getHighPrecisionTimeStamp();
+    while (!buffer.empty()) {
+        size_t data_size = 0;
+        size_t request_id = 0;
+        ASSERT_EQ(BoltResponse::checkHeader(buffer, data_size, request_id),
+                  EResParseResult::PARSE_OK);
+        ASSERT_EQ(request_id, parsed);
+        std::string data;
+        BoltResponse response(data);
+        ASSERT_EQ(response.deserialize(buffer), EResParseResult::PARSE_OK);
+        ASSERT_EQ(data.size(), content.size());
+        ++parsed;
+    }
+    auto end = Utils::getHighPrecisionTimeStamp();
+    ASSERT_EQ(parsed, message_num);
+    std::cout << "parse " << message_num << " bolt responses time cost:"
+              << (end - start) << "us, "
+              << (end - start) * 1000 / message_num << "ns per message" << std::endl;
+}
+
 TEST(SocketManagerTest, base) {
 
     SimpleSocketServer server;
@@ -365,3 +728,913 @@ TEST(SocketManagerTest, base) {
     SocketManager::getInstance().destroy();
     Schedule::getInstance().destroy_time_schedule();
 }
+
+TEST(SocketTest, adaptiveRead) {
+    SimpleBoltServer server;
+    ASSERT_TRUE(server.start(6330));
+    ASSERT_TRUE(globalInit());
+
+    constexpr size_t response_size = 1024 * 1024;
+    constexpr size_t request_num = 16;
+    server.setResponseSize(response_size);
+    {
+        Channel channel;
+        ASSERT_TRUE(channel.init("127.0.0.1:6330", nullptr));
+        ChannelUnitTest test(channel);
+
+        BoltRequest request;
+        request.data("ping");
+        for (size_t i = 0; i < request_num; ++i) {
+            std::string data;
+            BoltResponse response(data);
+            Session session;
+            session.send(request).to(channel).receiveTo(response).timeout(2000).sync();
+            ASSERT_FALSE(session.failed()) << session.getErrText();
+            ASSERT_EQ(data.size(), response_size);
+        }
+
+        auto stats = test.readStats();
+        ASSERT_EQ(stats.responses, request_num);
+        ASSERT_GE(stats.read_bytes, response_size * request_num);
+        std::cout << "read syscalls per " << response_size << " bytes response: "
+                  << (double)stats.read_syscalls / stats.responses << std::endl;
+        //Fixed 4KB read costs at least 256 syscalls per response
+        ASSERT_LT(stats.read_syscalls, request_num * 64);
+    }
+
+    globalDestroy();
+    server.stop();
+}
+
+TEST(SocketTest, pendingWrite) {
+    SimpleBoltServer server;
+    ASSERT_TRUE(server.start(6331));
+    ASSERT_TRUE(globalInit());
+
+    //Requests are much larger than socket send buffer, writer should queue
+    //left data and return instead of spinning on EAGAIN.
+    constexpr size_t request_size = 1024 * 1024;
+    constexpr size_t request_num = 32;
+    {
+        Channel channel;
+        ASSERT_TRUE(channel.init("127.0.0.1:6331", nullptr));
+
+        BoltRequest request;
+        const std::string content(request_size, 'w');
+        request.data(content);
+
+        std::atomic<size_t> succeeded(0);
+        std::atomic<size_t> finished(0);
+        std::promise<void> done;
+        std::vector<std::string> datas(request_num);
+        std::vector<std::unique_ptr<BoltResponse>> responses;
+        for (size_t i = 0; i < request_num; ++i) {
+            responses.emplace_back(new BoltResponse(datas[i]));
+            Session session;
+            session.send(request).to(channel)
+                    .receiveTo(*responses.back()).timeout(2000)
+                    .async([&](ESessionError err, ResponseBase*) {
+                        if (err == ESessionError::SESSION_OK) {
+                            ++succeeded;
+                        }
+                        if (++finished == request_num) {
+                            done.set_value();
+                        }
+                    });
+            ASSERT_FALSE(session.failed()) << session.getErrText();
+        }
+
+        ASSERT_EQ(done.get_future().wait_for(std::chrono::seconds(5)),
+                  std::future_status::ready);
+        ASSERT_EQ(succeeded.load(), request_num);
+        for (auto& data : datas) {
+            ASSERT_EQ(data, content);
+        }
+    }
+
+    globalDestroy();
+    server.stop();
+}
+
+TEST(SocketTest, writeCombining) {
+    SimpleBoltServer server;
+    ASSERT_TRUE(server.start(6332));
+    ASSERT_TRUE(globalInit());
+
+    constexpr size_t thread_num = 64;
+    constexpr size_t request_num = 200;
+    {
+        Channel channel;
+        ASSERT_TRUE(channel.init("127.0.0.1:6332", nullptr));
+        ChannelUnitTest test(channel);
+
+        std::atomic<size_t> succeeded(0);
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < thread_num; ++i) {
+            threads.emplace_back([&channel, &succeeded, i]() {
+                BoltRequest request;
+                const std::string content = std::to_string(i);
+                request.data(content);
+                for (size_t j = 0; j < request_num; ++j) {
+                    std::string data;
+                    BoltResponse response(data);
+                    Session session;
+                    session.send(request).to(channel)
+                            .receiveTo(response).timeout(2000).sync();
+                    if (!session.failed() && data == content) {
+                        ++succeeded;
+                    }
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        ASSERT_EQ(succeeded.load(), thread_num * request_num);
+
+        auto stats = test.writeStats();
+        ASSERT_EQ(stats.requests, thread_num * request_num);
+        ASSERT_LE(stats.write_syscalls, stats.requests);
+        std::cout << "write syscalls per request: "
+                  << (double)stats.write_syscalls / stats.requests << std::endl;
+    }
+
+    globalDestroy();
+    server.stop();
+}
+
+TEST(SocketTest, writeBatch) {
+    SimpleBoltServer server;
+    ASSERT_TRUE(server.start(6333));
+    ASSERT_TRUE(globalInit());
+
+    constexpr size_t thread_num = 16;
+    constexpr size_t request_num = 100;
+    auto run = [](Channel& channel, size_t& succeeded) {
+        std::atomic<size_t> ok(0);
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < thread_num; ++i) {
+            threads.emplace_back([&channel, &ok]() {
+                BoltRequest request;
+                request.data("batch");
+                for (size_t j = 0; j < request_num; ++j) {
+                    std::string data;
+                    BoltResponse response(data);
+                    Session session;
+                    session.send(request).to(channel)
+                            .receiveTo(response).timeout(2000).sync();
+                    if (!session.failed() && data == "batch") {
+                        ++ok;
+                    }
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        succeeded = ok.load();
+    };
+
+    {
+        //Held by time window
+        ChannelOptions options;
+        options.batch_window_us = 200;
+        Channel channel;
+        ASSERT_TRUE(channel.init("127.0.0.1:6333", &options));
+        ChannelUnitTest test(channel);
+
+        size_t succeeded = 0;
+        run(channel, succeeded);
+        ASSERT_EQ(succeeded, thread_num * request_num);
+        auto stats = test.writeStats();
+        ASSERT_EQ(stats.requests, thread_num * request_num);
+        ASSERT_LT(stats.batches, stats.requests);
+        std::cout << "requests per batch: "
+                  << (double)stats.requests / stats.batches << std::endl;
+    }
+
+    {
+        //Flushed at once as batch is always full
+        ChannelOptions options;
+        options.batch_window_us = 10 * 1000 * 1000;
+        options.batch_max_bytes = 1;
+        Channel channel;
+        ASSERT_TRUE(channel.init("127.0.0.1:6333", &options));
+
+        Utils::Timer timer;
+        size_t succeeded = 0;
+        run(channel, succeeded);
+        ASSERT_EQ(succeeded, thread_num * request_num);
+        ASSERT_LT(timer.elapsed(), 5000);
+    }
+
+    globalDestroy();
+    server.stop();
+}
+
+TEST(SocketTest, unixDomainSocket) {
+    const std::string path = "/tmp/bolt_rpc_unittest.sock";
+    SimpleBoltServer tcp_server;
+    ASSERT_TRUE(tcp_server.start(6334));
+    SimpleBoltServer unix_server;
+    ASSERT_TRUE(unix_server.start(path));
+
+    //Http server answering every request with fixed response
+    base::FdGuard http_listener(socket(AF_UNIX, SOCK_STREAM, 0));
+    const std::string http_path = "/tmp/bolt_rpc_unittest_http.sock";
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, http_path.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(http_path.c_str());
+    ASSERT_EQ(bind(http_listener.fd(), (struct sockaddr*)&addr, sizeof(addr)), 0);
+    ASSERT_EQ(listen(http_listener.fd(), 16), 0);
+    std::thread http_server([&http_listener]() {
+        base::FdGuard conn(accept(http_listener.fd(), nullptr, nullptr));
+        std::string request;
+        char buf[4096];
+        while (true) {
+            auto n = read(conn.fd(), buf, sizeof(buf));
+            if (n <= 0) {
+                break;
+            }
+            request.append(buf, n);
+            if (request.find("\r\n\r\n") != std::string::npos) {
+                static const std::string response =
+                        "HTTP/1.1 200 OK\r\nContent-Length: 4\r\n\r\nuds!";
+                ASSERT_EQ(write(conn.fd(), response.data(), response.size()),
+                          (ssize_t)response.size());
+                request.clear();
+            }
+        }
+    });
+
+    ASSERT_TRUE(globalInit());
+
+    {
+        Channel channel;
+        ASSERT_FALSE(channel.init("unix:/tmp/bolt_rpc_unittest_none.sock",
+                                  nullptr));
+    }
+
+    {
+        ChannelOptions options;
+        options.protocol = EProtocolType::PROTOCOL_HTTP;
+        Channel channel;
+        ASSERT_TRUE(channel.init(("unix:" + http_path).c_str(), &options));
+        HttpRequest request;
+        request.uri("http://localhost/uds").method(EHttpMethod::HTTP_METHOD_GET);
+        HttpResponse response;
+        Session session;
+        session.send(request).to(channel).receiveTo(response).sync();
+        ASSERT_FALSE(session.failed());
+        ASSERT_EQ(response.body(), "uds!");
+    }
+
+    //Timers of one thread are limited by its time task queue, so that
+    //each transport is measured in a new thread
+    constexpr size_t request_num = 3000;
+    for (auto address : {"127.0.0.1:6334",
+                         "unix:/tmp/bolt_rpc_unittest.sock"}) {
+        Channel channel;
+        ASSERT_TRUE(channel.init(address, nullptr));
+
+        size_t succeeded = 0;
+        size_t cost = 0;
+        std::thread([&channel, &succeeded, &cost]() {
+            BoltRequest request;
+            request.data(std::string(128, 'u'));
+            auto start = Utils::getHighPrecisionTimeStamp();
+            for (size_t i = 0; i < request_num; ++i) {
+                std::string data;
+                BoltResponse response(data);
+                Session session;
+                session.send(request).to(channel)
+                        .receiveTo(response).timeout(2000).sync();
+                if (!session.failed() && data.size() == 128) {
+                    ++succeeded;
+                }
+            }
+            cost = Utils::getHighPrecisionTimeStamp() - start;
+        }).join();
+        ASSERT_EQ(succeeded, request_num);
+        std::cout << address << " requests:" << request_num
+                  << " cost:" << cost << "us"
+                  << " avg latency:" << (double)cost / request_num << "us"
+                  << std::endl;
+    }
+
+    globalDestroy();
+    tcp_server.stop();
+    unix_server.stop();
+    shutdown(http_listener.fd(), SHUT_RDWR);
+    http_server.join();
+    unlink(http_path.c_str());
+}
+
+TEST(SocketTest, connectAsync) {
+    SimpleBoltServer server;
+    ASSERT_TRUE(server.start(6335));
+    ASSERT_TRUE(globalInit());
+
+    {
+        EndPoint end_point;
+        ASSERT_TRUE(end_point.parseFromString("127.0.0.1:6335"));
+        auto socket = std::make_shared<Socket>(end_point);
+        std::promise<bool> done;
+        auto result = socket->connectAsync(1000, [&done](bool connected) {
+            done.set_value(connected);
+        });
+        ASSERT_TRUE(result.get());
+        ASSERT_TRUE(done.get_future().get());
+        ASSERT_TRUE(socket->active());
+    }
+
+    {
+        //Unroutable address, which either fails at once or times out
+        EndPoint end_point;
+        ASSERT_TRUE(end_point.parseFromString("10.255.255.1:6335"));
+        auto socket = std::make_shared<Socket>(end_point);
+        Utils::Timer timer;
+        auto result = socket->connectAsync(100);
+        ASSERT_FALSE(result.get());
+        ASSERT_FALSE(socket->active());
+        ASSERT_LT(timer.elapsed(), 1000UL);
+    }
+
+    {
+        //Pool members are connected in parallel, so that init costs about
+        //one connect timeout instead of pool size of them
+        ChannelOptions options;
+        options.connection_type = EConnectionType::CONNECTION_TYPE_POOLED;
+        options.pool_size = 16;
+        options.connect_timeout_ms = 100;
+        Channel channel;
+        Utils::Timer timer;
+        ASSERT_FALSE(channel.init("10.255.255.1:6335", &options));
+        ASSERT_LT(timer.elapsed(), 800UL);
+    }
+
+    {
+        ChannelOptions options;
+        options.connection_type = EConnectionType::CONNECTION_TYPE_POOLED;
+        options.pool_size = 64;
+        Channel channel;
+        Utils::Timer timer;
+        ASSERT_TRUE(channel.init("127.0.0.1:6335", &options));
+        std::cout << "connect pool of " << options.pool_size
+                  << " cost:" << timer.elapsedMicro() << "us" << std::endl;
+    }
+
+    {
+        //Return once 2 connections are ready, others are warmed in background
+        ChannelOptions options;
+        options.connection_type = EConnectionType::CONNECTION_TYPE_POOLED;
+        options.pool_size = 8;
+        options.pool_ready_size = 2;
+        Channel channel;
+        ASSERT_TRUE(channel.init("127.0.0.1:6335", &options));
+
+        std::vector<std::thread> threads;
+        std::atomic<size_t> ok(0);
+        for (size_t i = 0; i < 8; ++i) {
+            threads.emplace_back([&channel, &ok]() {
+                BoltRequest request;
+                request.data("warm");
+                std::string data;
+                BoltResponse response(data);
+                Session session;
+                session.send(request).to(channel)
+                        .receiveTo(response).timeout(2000).sync();
+                if (!session.failed() && data == "warm") {
+                    ++ok;
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        ASSERT_EQ(ok.load(), 8UL);
+    }
+
+    globalDestroy();
+    server.stop();
+}
+
+TEST(SocketTest, sessionSlots) {
+    {
+        SessionSlots slots(4);
+        SocketReadSession sessions[5];
+        for (size_t i = 0; i < 4; ++i) {
+            ASSERT_TRUE(slots.add(&sessions[i]));
+            ASSERT_NE(sessions[i].request_id, 0UL);
+            ASSERT_LE(sessions[i].request_id, (size_t)std::numeric_limits<uint32_t>::max());
+        }
+        ASSERT_FALSE(slots.add(&sessions[4]));
+        ASSERT_EQ(slots.size(), 4UL);
+        for (size_t i = 0; i < 4; ++i) {
+            ASSERT_EQ(slots.find(sessions[i].request_id), &sessions[i]);
+        }
+
+        //Slot is reused by new generation, and old request id is stale
+        size_t stale_id = sessions[1].request_id;
+        ASSERT_TRUE(slots.remove(&sessions[1]));
+        ASSERT_FALSE(slots.remove(&sessions[1]));
+        ASSERT_EQ(slots.find(stale_id), nullptr);
+        ASSERT_TRUE(slots.add(&sessions[4]));
+        ASSERT_NE(sessions[4].request_id, stale_id);
+        ASSERT_EQ(slots.find(stale_id), nullptr);
+        ASSERT_EQ(slots.find(sessions[4].request_id), &sessions[4]);
+    }
+
+    SimpleBoltServer server;
+    ASSERT_TRUE(server.start(6336));
+    ASSERT_TRUE(globalInit());
+
+    //Each lane keeps one request in flight, and sends next one in callback
+    struct Lane {
+        Lane() : response(data) {}
+        BoltRequest request;
+        std::string content;
+        std::string data;
+        BoltResponse response;
+    };
+    constexpr size_t request_num = 50000;
+    for (size_t in_flight : {1000UL, 10000UL}) {
+        ChannelOptions options;
+        options.max_parallel_sessions = in_flight;
+        Channel channel;
+        ASSERT_TRUE(channel.init("127.0.0.1:6336", &options));
+
+        std::vector<std::unique_ptr<Lane>> lanes;
+        for (size_t i = 0; i < in_flight; ++i) {
+            lanes.emplace_back(new Lane);
+            lanes.back()->content = std::to_string(i);
+            lanes.back()->request.data(lanes.back()->content);
+        }
+        std::atomic<size_t> sent(0);
+        std::atomic<size_t> received(0);
+        std::atomic<size_t> succeeded(0);
+        std::atomic<bool> finished(false);
+        std::promise<bool> done;
+        std::function<void(Lane*)> send;
+        send = [&](Lane* lane) {
+            if (sent.fetch_add(1) >= request_num) {
+                return;
+            }
+            lane->data.clear();
+            Session session;
+            session.send(lane->request).to(channel)
+                    .receiveTo(lane->response).timeout(5000)
+                    .async([&, lane](ESessionError err, ResponseBase*) {
+                        if (err == ESessionError::SESSION_OK
+                            && lane->data == lane->content) {
+                            ++succeeded;
+                        }
+                        //Lane stops at failure, so that failing callback
+                        //is not called recursively
+                        if (err != ESessionError::SESSION_OK
+                            || ++received == request_num) {
+                            if (!finished.exchange(true)) {
+                                done.set_value(true);
+                            }
+                        } else {
+                            send(lane);
+                        }
+                    });
+        };
+
+        Utils::Timer timer;
+        for (auto& lane : lanes) {
+            send(lane.get());
+        }
+        ASSERT_TRUE(done.get_future().get());
+        auto cost = timer.elapsedMicro();
+        ASSERT_EQ(succeeded.load(), request_num);
+        std::cout << in_flight << " in flight, " << request_num << " requests cost:"
+                  << cost << "us, qps:" << request_num * 1000000 / cost << std::endl;
+    }
+
+    globalDestroy();
+    server.stop();
+}
+
+TEST(SocketTest, sessionReclaim) {
+    SimpleBoltServer server;
+    ASSERT_TRUE(server.start(6337));
+    ASSERT_TRUE(globalInit());
+
+    {
+        Channel channel;
+        ASSERT_TRUE(channel.init("127.0.0.1:6337", nullptr));
+
+        //Session keeps its callback until it is deleted, so token is released
+        //once all references of sessions are released
+        constexpr size_t request_num = 2000;
+        auto token = std::make_shared<int>(0);
+        BoltRequest request;
+        request.data("reclaim");
+        std::vector<std::string> datas(request_num);
+        std::vector<std::unique_ptr<BoltResponse>> responses;
+        std::atomic<size_t> succeeded(0);
+        std::atomic<size_t> received(0);
+        for (size_t i = 0; i < request_num; ++i) {
+            responses.emplace_back(new BoltResponse(datas[i]));
+            Session session;
+            session.send(request).to(channel).receiveTo(*responses[i])
+                    .timeout(100).async([token, &succeeded, &received](
+                            ESessionError err, ResponseBase*) {
+                        if (err == ESessionError::SESSION_OK) {
+                            ++succeeded;
+                        }
+                        ++received;
+                    });
+        }
+        while (received.load() < request_num) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        ASSERT_EQ(succeeded.load(), request_num);
+
+        //Timeout tasks release their references when expired
+        Utils::Timer timer;
+        while (token.use_count() > 1 && timer.elapsed() < 2000) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        ASSERT_EQ(token.use_count(), 1);
+
+        //Sync session is released by the last of waiting thread, slot and timeout
+        std::string data;
+        BoltResponse response(data);
+        Session session;
+        session.send(request).to(channel).receiveTo(response).timeout(100).sync();
+        ASSERT_FALSE(session.failed());
+        ASSERT_EQ(data, "reclaim");
+    }
+
+    {
+        //Sessions timed out on a connection which never responds are still
+        //released, without waiting for another read event
+        base::FdGuard listener(socket(AF_INET, SOCK_STREAM, 0));
+        ASSERT_GE(listener.fd(), 0);
+        int reuse = 1;
+        setsockopt(listener.fd(), SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(6344);
+        ASSERT_EQ(bind(listener.fd(), (struct sockaddr*)&addr, sizeof(addr)), 0);
+        ASSERT_EQ(listen(listener.fd(), 16), 0);
+
+        Channel channel;
+        ASSERT_TRUE(channel.init("127.0.0.1:6344", nullptr));
+
+        constexpr size_t request_num = 200;
+        auto token = std::make_shared<int>(0);
+        BoltRequest request;
+        request.data("silent");
+        std::string data;
+        BoltResponse response(data);
+        std::atomic<size_t> timeout(0);
+        for (size_t i = 0; i < request_num; ++i) {
+            Session session;
+            session.send(request).to(channel).receiveTo(response)
+                    .timeout(10).async([token, &timeout](ESessionError err, ResponseBase*) {
+                        if (err == ESessionError::READ_TIMEOUT) {
+                            ++timeout;
+                        }
+                    });
+        }
+        Utils::Timer timer;
+        while (token.use_count() > 1 && timer.elapsed() < 3000) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        ASSERT_EQ(timeout.load(), request_num);
+        ASSERT_EQ(token.use_count(), 1);
+    }
+
+    globalDestroy();
+    server.stop();
+}
+
+TEST(SocketTest, inflightWindow) {
+    SimpleBoltServer server;
+    ASSERT_TRUE(server.start(6338));
+    ASSERT_TRUE(globalInit());
+
+    auto run = [](Channel& channel, size_t thread_num, size_t request_num) {
+        std::atomic<size_t> ok(0);
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < thread_num; ++i) {
+            threads.emplace_back([&channel, &ok, request_num]() {
+                BoltRequest request;
+                request.data("window");
+                for (size_t j = 0; j < request_num; ++j) {
+                    std::string data;
+                    BoltResponse response(data);
+                    Session session;
+                    session.send(request).to(channel)
+                            .receiveTo(response).timeout(5000).sync();
+                    if (!session.failed() && data == "window") {
+                        ++ok;
+                    }
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        return ok.load();
+    };
+
+    {
+        //Burst beyond window waits for free slots instead of failing
+        ChannelOptions options;
+        options.max_parallel_sessions = 4;
+        Channel channel;
+        ASSERT_TRUE(channel.init("127.0.0.1:6338", &options));
+        ASSERT_EQ(run(channel, 32, 50), 32UL * 50);
+    }
+
+    {
+        //Waiting ends at timeout of session, server accepts nothing and never responds
+        int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        ASSERT_GE(listen_fd, 0);
+        int reuse = 1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(6339);
+        ASSERT_EQ(bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)), 0);
+        ASSERT_EQ(listen(listen_fd, 16), 0);
+
+        ChannelOptions options;
+        options.max_parallel_sessions = 1;
+        Channel channel;
+        ASSERT_TRUE(channel.init("127.0.0.1:6339", &options));
+
+        BoltRequest request;
+        request.data("window");
+        std::string data;
+        BoltResponse response(data);
+        std::promise<ESessionError> first;
+        Session session;
+        session.send(request).to(channel).receiveTo(response).timeout(1000)
+                .async([&first](ESessionError err, ResponseBase*) {
+                    first.set_value(err);
+                });
+
+        std::string data2;
+        BoltResponse response2(data2);
+        Session session2;
+        Utils::Timer timer;
+        session2.send(request).to(channel).receiveTo(response2).timeout(100).sync();
+        auto cost = timer.elapsed();
+        ASSERT_TRUE(session2.failed());
+        ASSERT_EQ(session2.getErrText(), Session::getErrText(ESessionError::SOCKET_BUSY));
+        ASSERT_GE(cost, 90UL);
+        ASSERT_LT(cost, 900UL);
+
+        ASSERT_EQ(first.get_future().get(), ESessionError::READ_TIMEOUT);
+        close(listen_fd);
+    }
+
+    {
+        //Window is tuned by latency and stays in bounds
+        ChannelOptions options;
+        options.max_parallel_sessions = 256;
+        options.adaptive_parallel_sessions = true;
+        Channel channel;
+        ASSERT_TRUE(channel.init("127.0.0.1:6338", &options));
+        ChannelUnitTest test(channel);
+        ASSERT_EQ(test.inflightWindow(), 256UL);
+        ASSERT_EQ(run(channel, 64, 100), 64UL * 100);
+        auto window = test.inflightWindow();
+        ASSERT_GE(window, SOCKET_MIN_INFLIGHT_WINDOW);
+        ASSERT_LE(window, 256UL);
+        std::cout << "adaptive in flight window: " << window << std::endl;
+    }
+
+    globalDestroy();
+    server.stop();
+}
+
+TEST(SocketTest, loopAffinity) {
+#if defined(OS_LINUX)
+    ASSERT_EQ(Utils::getCpuNumaNode(0), 0);
+    ASSERT_EQ(Utils::getCpuNumaNode(-1), -1);
+    ASSERT_FALSE(Utils::setThreadAffinity({-1}));
+#endif
+
+    SimpleBoltServer server;
+    ASSERT_TRUE(server.start(6340));
+
+    for (auto assign : {ELoopAssign::FD, ELoopAssign::CALLER_NUMA,
+                        ELoopAssign::INCOMING_CPU}) {
+        LoopOptions options;
+        options.threads = 2;
+        options.loop_cpus = {0};
+        options.timer_cpus = {0};
+        options.loop_assign = assign;
+        ASSERT_TRUE(globalInit(options));
+
+        Channel channel;
+        ASSERT_TRUE(channel.init("127.0.0.1:6340", nullptr));
+        ChannelUnitTest test(channel);
+        ASSERT_GE(test.loopIndex(), 0);
+        ASSERT_LT(test.loopIndex(), 2);
+        if (assign == ELoopAssign::INCOMING_CPU
+            && base::incoming_cpu(test.fd()) == 0) {
+            //First loop thread pinned on incoming cpu
+            ASSERT_EQ(test.loopIndex(), 0);
+        }
+
+        BoltRequest request;
+        request.data("affinity");
+        std::string data;
+        BoltResponse response(data);
+        Session session;
+        session.send(request).to(channel).receiveTo(response).timeout(1000).sync();
+        ASSERT_FALSE(session.failed());
+        ASSERT_EQ(data, "affinity");
+
+        globalDestroy();
+    }
+    server.stop();
+}
+
+TEST(SocketTest, loopLoad) {
+    SimpleBoltServer server;
+    ASSERT_TRUE(server.start(6341));
+
+    {
+        //Idle sockets are spread over loop threads
+        LoopOptions options;
+        options.threads = 2;
+        options.loop_assign = ELoopAssign::LEAST_LOADED;
+        ASSERT_TRUE(globalInit(options));
+
+        std::vector<std::unique_ptr<Channel>> channels;
+        for (size_t i = 0; i < 4; ++i) {
+            channels.emplace_back(new Channel);
+            ASSERT_TRUE(channels.back()->init("127.0.0.1:6341", nullptr));
+        }
+        auto loads = getLoopLoads();
+        ASSERT_EQ(loads.size(), 2UL);
+        ASSERT_EQ(loads[0].sockets, 2UL);
+        ASSERT_EQ(loads[1].sockets, 2UL);
+
+        channels.clear();
+        globalDestroy();
+    }
+
+    {
+        //Busy sockets crowded in one loop thread are moved to idle one
+        LoopOptions options;
+        options.threads = 2;
+        options.loop_rebalance = true;
+        ASSERT_TRUE(globalInit(options));
+
+        //Two of three channels must share one loop thread
+        std::vector<std::unique_ptr<Channel>> channels;
+        std::vector<Channel*> loop_channels[2];
+        int from = -1;
+        while (from < 0) {
+            channels.emplace_back(new Channel);
+            ASSERT_TRUE(channels.back()->init("127.0.0.1:6341", nullptr));
+            ChannelUnitTest test(*channels.back());
+            auto idx = test.loopIndex();
+            loop_channels[idx].push_back(channels.back().get());
+            if (loop_channels[idx].size() == 2) {
+                from = idx;
+            }
+        }
+        int to = 1 - from;
+        auto& busy = loop_channels[from];
+
+        std::atomic<bool> stop(false);
+        std::atomic<size_t> failed(0);
+        std::vector<std::thread> threads;
+        for (auto channel : busy) {
+            threads.emplace_back([channel, &stop, &failed]() {
+                BoltRequest request;
+                request.data("rebalance");
+                while (!stop.load()) {
+                    std::string data;
+                    BoltResponse response(data);
+                    Session session;
+                    session.send(request).to(*channel)
+                            .receiveTo(response).timeout(2000).sync();
+                    if (session.failed() || data != "rebalance") {
+                        ++failed;
+                    }
+                }
+            });
+        }
+
+        Utils::Timer timer;
+        while (timer.elapsed() < 8000 && getLoopLoads()[from].migrated_out == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        stop.store(true);
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        auto loads = getLoopLoads();
+        for (size_t i = 0; i < loads.size(); ++i) {
+            std::cout << "loop " << i << " sockets: " << loads[i].sockets
+                      << ", events/s: " << loads[i].events_per_sec
+                      << ", bytes/s: " << loads[i].bytes_per_sec
+                      << ", migrated in: " << loads[i].migrated_in
+                      << ", out: " << loads[i].migrated_out << std::endl;
+        }
+        ASSERT_EQ(failed.load(), 0UL);
+        ASSERT_GE(loads[from].migrated_out, 1UL);
+        ASSERT_EQ(loads[to].migrated_in, loads[from].migrated_out);
+        ASSERT_EQ(loads[0].sockets + loads[1].sockets, channels.size());
+
+        //Moved socket still works
+        for (auto channel : busy) {
+            BoltRequest request;
+            request.data("moved");
+            std::string data;
+            BoltResponse response(data);
+            Session session;
+            session.send(request).to(*channel).receiveTo(response).timeout(1000).sync();
+            ASSERT_FALSE(session.failed());
+            ASSERT_EQ(data, "moved");
+        }
+
+        channels.clear();
+        globalDestroy();
+    }
+    server.stop();
+}
+
+TEST(SessionTest, callbackExecutor) {
+    SimpleBoltServer server;
+    ASSERT_TRUE(server.start(6343));
+    ASSERT_TRUE(globalInit());
+    ASSERT_TRUE(Schedule::getInstance().callbackExecutor() != nullptr);
+
+    //Send one async request and return whether its callback ran in loop thread
+    auto send = [](Channel& channel, std::function<void(Session&)> setup) {
+        BoltRequest request;
+        request.data("callback");
+        std::string data;
+        BoltResponse response(data);
+        std::promise<bool> in_loop;
+        Session session;
+        session.send(request).to(channel).receiveTo(response).timeout(1000);
+        setup(session);
+        session.async([&in_loop, &data](ESessionError err, ResponseBase*) {
+            in_loop.set_value(err == ESessionError::SESSION_OK && data == "callback"
+                              && LoopThread::in_loop_thread());
+        });
+        EXPECT_FALSE(session.failed());
+        auto future = in_loop.get_future();
+        EXPECT_EQ(future.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+        return future.get();
+    };
+
+    {
+        Channel channel;
+        ASSERT_TRUE(channel.init("127.0.0.1:6343", nullptr));
+        //Response is deserialized and callback runs out of loop thread by default
+        auto before = getLoopStats().callbacks;
+        ASSERT_FALSE(send(channel, [](Session&) {}));
+        ASSERT_EQ(getLoopStats().callbacks, before + 1);
+        ASSERT_LE(getLoopStats().callback_delay_us, getLoopStats().callbacks
+                  * getLoopStats().callback_max_delay_us);
+
+        //Inline callback runs in loop thread and is not counted
+        ASSERT_TRUE(send(channel, [](Session& s) { s.inlineCallback(true); }));
+        ASSERT_EQ(getLoopStats().callbacks, before + 1);
+
+        //Executor given to session is used
+        std::atomic<size_t> submitted(0);
+        auto executor = std::make_shared<CallbackExecutor>(
+                [&submitted](std::function<void()> task) {
+                    ++submitted;
+                    std::thread(std::move(task)).detach();
+                });
+        ASSERT_FALSE(send(channel, [&executor](Session& s) { s.executor(executor); }));
+        ASSERT_EQ(submitted.load(), 1UL);
+    }
+
+    {
+        ChannelOptions options;
+        options.inline_callback = true;
+        Channel channel;
+        ASSERT_TRUE(channel.init("127.0.0.1:6343", &options));
+        ASSERT_TRUE(send(channel, [](Session&) {}));
+        //Session overrides option of channel
+        ASSERT_FALSE(send(channel, [](Session& s) { s.inlineCallback(false); }));
+    }
+
+    globalDestroy();
+    server.stop();
+}